@@ -0,0 +1,203 @@
+/*
+  Copyright (C) 2026 agent <agent@local>
+
+  Chunk pool used to back the per cu obstacks
+
+  Each cu allocates its tags from its own obstack, so the hot path, bump
+  allocating inside a chunk, is already private to the thread loading or
+  processing that cu. What the arena adds is where the obstack chunks come
+  from: big, transparent hugepage backed slabs that are carved in
+  ARENA__CHUNK_SIZE pieces, with the chunks released by cu__delete going
+  back to a free list to be reused by the next cu, and all the slabs being
+  unmapped at once when the cus goes away.
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of version 2 of the GNU General Public License as
+  published by the Free Software Foundation.
+*/
+
+#include "arena.h"
+
+#include <obstack.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define obstack_chunk_alloc malloc
+#define obstack_chunk_free free
+
+struct arena_slab {
+	struct arena_slab *next;
+	size_t		  size;
+};
+
+/*
+ * Header prepended to what is handed to obstack, 'size' is zero for
+ * ARENA__CHUNK_SIZE chunks carved from a slab and the malloc'ed size for
+ * the ones that didn't fit in a chunk.
+ */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t		   size;
+} __attribute__((aligned(16)));
+
+struct arena *arena__new(void)
+{
+	struct arena *self = malloc(sizeof(*self));
+
+	if (self != NULL) {
+		pthread_mutex_init(&self->lock, NULL);
+		self->slabs	  = NULL;
+		self->free_chunks = NULL;
+		self->slab_pos	  = NULL;
+		self->slab_end	  = NULL;
+	}
+
+	return self;
+}
+
+void arena__delete(struct arena *self)
+{
+	struct arena_slab *pos, *next;
+
+	if (self == NULL)
+		return;
+
+	for (pos = self->slabs; pos != NULL; pos = next) {
+		next = pos->next;
+		munmap(pos, pos->size);
+	}
+
+	pthread_mutex_destroy(&self->lock);
+	free(self);
+}
+
+/*
+ * mmap only guarantees page alignment, so twice the slab size is mapped and
+ * what is before and after the aligned slab in it is unmapped.
+ */
+static struct arena_slab *arena__map_slab(void)
+{
+	const size_t size = 2 * ARENA__SLAB_SIZE;
+	char *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *slab;
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	slab = (char *)(((uintptr_t)map + ARENA__SLAB_SIZE - 1) &
+			~(uintptr_t)(ARENA__SLAB_SIZE - 1));
+	if (slab != map)
+		munmap(map, slab - map);
+	munmap(slab + ARENA__SLAB_SIZE, map + size - slab - ARENA__SLAB_SIZE);
+#ifdef MADV_HUGEPAGE
+	madvise(slab, ARENA__SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+	return (struct arena_slab *)slab;
+}
+
+/*
+ * The slab header takes the start of the slab, so the first chunk is
+ * carved right after it, what is left at the end, less than a chunk, is
+ * wasted.
+ */
+static struct arena_chunk *arena__carve_chunk(struct arena *self)
+{
+	struct arena_chunk *chunk;
+
+	if (self->slab_end - self->slab_pos < ARENA__CHUNK_SIZE) {
+		struct arena_slab *slab = arena__map_slab();
+
+		if (slab == NULL)
+			return NULL;
+
+		slab->size  = ARENA__SLAB_SIZE;
+		slab->next  = self->slabs;
+		self->slabs = slab;
+		self->slab_pos = (char *)slab + sizeof(struct arena_chunk);
+		self->slab_end = (char *)slab + ARENA__SLAB_SIZE;
+	}
+
+	chunk = (struct arena_chunk *)self->slab_pos;
+	self->slab_pos += ARENA__CHUNK_SIZE;
+	return chunk;
+}
+
+/**
+ * arena__chunk_alloc - obstack chunkfun for obstack_specify_allocation_with_arg
+ * @self: the struct arena, passed as void * to match the obstack prototype
+ * @size: chunk size requested by obstack
+ *
+ * Requests that don't fit in a ARENA__CHUNK_SIZE chunk, i.e. a single
+ * object bigger than that, go straight to malloc.
+ */
+void *arena__chunk_alloc(void *self, size_t size)
+{
+	struct arena *arena = self;
+	struct arena_chunk *chunk;
+
+	if (size > ARENA__CHUNK_SIZE - sizeof(*chunk)) {
+		chunk = malloc(sizeof(*chunk) + size);
+		if (chunk == NULL)
+			return NULL;
+		chunk->size = size;
+		return chunk + 1;
+	}
+
+	pthread_mutex_lock(&arena->lock);
+	chunk = arena->free_chunks;
+	if (chunk != NULL)
+		arena->free_chunks = chunk->next;
+	else
+		chunk = arena__carve_chunk(arena);
+	pthread_mutex_unlock(&arena->lock);
+
+	if (chunk == NULL)
+		return NULL;
+	chunk->size = 0;
+	return chunk + 1;
+}
+
+/**
+ * arena__chunk_free - obstack freefun for obstack_specify_allocation_with_arg
+ * @self: the struct arena, passed as void * to match the obstack prototype
+ * @ptr: what arena__chunk_alloc returned
+ *
+ * Chunks go back to the free list, the slab memory is only returned to
+ * the OS in arena__delete.
+ */
+void arena__chunk_free(void *self, void *ptr)
+{
+	struct arena *arena = self;
+	struct arena_chunk *chunk = (struct arena_chunk *)ptr - 1;
+
+	if (chunk->size != 0) {
+		free(chunk);
+		return;
+	}
+
+	pthread_mutex_lock(&arena->lock);
+	chunk->next = arena->free_chunks;
+	arena->free_chunks = chunk;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * arena__obstack_init - make @obstack get its chunks from @self
+ * @self: the arena, NULL means plain malloc/free, as obstack_init does
+ * @obstack: obstack to initialize
+ *
+ * Returns, like obstack_init, 1 on success and 0 on failure.
+ */
+int arena__obstack_init(struct arena *self, struct obstack *obstack)
+{
+	if (self == NULL)
+		return obstack_init(obstack);
+
+	return obstack_specify_allocation_with_arg(obstack,
+					ARENA__CHUNK_SIZE - sizeof(struct arena_chunk),
+					0, arena__chunk_alloc,
+					arena__chunk_free, self);
+}
@@ -0,0 +1,42 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_ 1
+/*
+  Copyright (C) 2026 agent <agent@local>
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of version 2 of the GNU General Public License as
+  published by the Free Software Foundation.
+*/
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * Chunks are carved from ARENA__SLAB_SIZE slabs, that are mmaped at once,
+ * aligned to their size so that a transparent huge page can back each, and
+ * only returned to the OS in arena__delete.
+ */
+#define ARENA__SLAB_SIZE  (2 * 1024 * 1024)
+#define ARENA__CHUNK_SIZE (64 * 1024)
+
+struct arena_slab;
+struct arena_chunk;
+struct obstack;
+
+struct arena {
+	pthread_mutex_t	    lock;
+	struct arena_slab   *slabs;
+	struct arena_chunk  *free_chunks;
+	char		    *slab_pos;
+	char		    *slab_end;
+};
+
+struct arena *arena__new(void);
+void arena__delete(struct arena *self);
+
+void *arena__chunk_alloc(void *self, size_t size);
+void arena__chunk_free(void *self, void *ptr);
+
+int arena__obstack_init(struct arena *self, struct obstack *obstack);
+
+#endif /* _ARENA_H_ */
@@ -137,6 +137,7 @@ static int check_print_change(const struct class_member *old,
 	char old_type_name[128], new_type_name[128];
 	const struct tag *old_type = cu__type(old_cu, old->tag.type);
 	const struct tag *new_type = cu__type(new_cu, new->tag.type);
+	uint32_t type_changes = 0;
 	int changes = 0;
 
 	if (old_type == NULL || new_type == NULL)
@@ -149,17 +150,17 @@ static int check_print_change(const struct class_member *old,
 
 	if (old->byte_offset != new->byte_offset) {
 		changes = 1;
-		terse_type_changes |= TCHANGEF__OFFSET;
+		type_changes |= TCHANGEF__OFFSET;
 	}
 
 	if (old->bitfield_offset != new->bitfield_offset) {
 		changes = 1;
-		terse_type_changes |= TCHANGEF__BIT_OFFSET;
+		type_changes |= TCHANGEF__BIT_OFFSET;
 	}
 
 	if (old->bitfield_size != new->bitfield_size) {
 		changes = 1;
-		terse_type_changes |= TCHANGEF__BIT_SIZE;
+		type_changes |= TCHANGEF__BIT_SIZE;
 	}
 
 	if (strcmp(tag__name(old_type, old_cu, old_type_name,
@@ -167,9 +168,16 @@ static int check_print_change(const struct class_member *old,
 		   tag__name(new_type, new_cu, new_type_name,
 			     sizeof(new_type_name), NULL)) != 0) {
 		changes = 1;
-		terse_type_changes |= TCHANGEF__TYPE;
+		type_changes |= TCHANGEF__TYPE;
 	}
 
+	/*
+	 * cu_diff_iterator runs in parallel and only wants to know if there
+	 * are changes, terse_type_changes is for the printing pass.
+	 */
+	if (print)
+		terse_type_changes |= type_changes;
+
 	if (changes && print && !show_terse_type_changes)
 		printf("    %s\n"
 		       "     from:    %-21s /* %5u(%2u) %5zd(%2d) */\n"
@@ -199,7 +207,6 @@ static int check_print_members_changes(const struct class *structure,
 			class__find_member_by_name(new_structure, new_cu,
 						   member_name);
 		if (twin != NULL) {
-			twin->tag.visited = 1;
 			++nr_twins_found;
 			if (check_print_change(member, cu, twin, new_cu, print))
 				changes = 1;
@@ -226,8 +233,16 @@ static int check_print_members_changes(const struct class *structure,
 	if (!print)
 		goto out;
 
+	/*
+	 * The new members are the ones with no twin in the old struct, looked
+	 * up by name instead of marked above as the new cu may be being
+	 * diffed against other old cus at the same time.
+	 */
 	type__for_each_member(&new_structure->type, member) {
-		if (!member->tag.visited) {
+		const char *member_name = class_member__name(member, new_cu);
+
+		if (class__find_member_by_name(structure, cu,
+					       member_name) == NULL) {
 			char name[128];
 			struct tag *type;
 			type = cu__type(new_cu, member->tag.type);
@@ -284,7 +299,22 @@ static void diff_struct(const struct cu *new_cu, struct class *structure,
 					 new_cu, diff);
 }
 
-static int cu_find_new_tags_iterator(struct cu *new_cu, void *old_cus)
+/*
+ * The diff iterators look at the layout, sizes and type names of the structs
+ * in the other cus, so find them before walking them in parallel.
+ */
+static int cu_cache_lookups_iterator(struct cu *cu, void *cookie __unused,
+				     FILE *fp __unused, void **priv __unused)
+{
+	cu__find_class_holes(cu);
+	if (cu__resolve_types(cu) != 0 ||
+	    cu__format_type_names(cu, NULL) != 0)
+		return -ENOMEM;
+	return 0;
+}
+
+static int cu_find_new_tags_iterator(struct cu *new_cu, void *old_cus,
+				     FILE *fp __unused, void **priv __unused)
 {
 	struct cu *old_cu = cus__find_cu_by_name(old_cus, new_cu->name);
 
@@ -331,7 +361,8 @@ static int cu_find_new_tags_iterator(struct cu *new_cu, void *old_cus)
 	return 0;
 }
 
-static int cu_diff_iterator(struct cu *cu, void *new_cus)
+static int cu_diff_iterator(struct cu *cu, void *new_cus,
+			    FILE *fp __unused, void **priv __unused)
 {
 	struct cu *new_cu = cus__find_cu_by_name(new_cus, cu->name);
 
@@ -801,8 +832,17 @@ failure:
 		}
 	}
 
-	cus__for_each_cu(old_cus, cu_diff_iterator, new_cus, NULL);
-	cus__for_each_cu(new_cus, cu_find_new_tags_iterator, old_cus, NULL);
+	if (cus__for_each_cu_parallel(old_cus, 0, cu_cache_lookups_iterator,
+				      NULL, NULL, NULL, NULL) != 0 ||
+	    cus__for_each_cu_parallel(new_cus, 0, cu_cache_lookups_iterator,
+				      NULL, NULL, NULL, NULL) != 0) {
+		fputs("codiff: insufficient memory\n", stderr);
+		goto out_cus_delete_priv;
+	}
+	cus__for_each_cu_parallel(old_cus, 0, cu_diff_iterator, NULL,
+				  new_cus, NULL, NULL);
+	cus__for_each_cu_parallel(new_cus, 0, cu_find_new_tags_iterator, NULL,
+				  old_cus, NULL, NULL);
 	cus__for_each_cu(old_cus, cu_show_diffs_iterator, NULL, NULL);
 	cus__for_each_cu(new_cus, cu_show_diffs_iterator, (void *)1, NULL);
 
@@ -713,6 +713,30 @@ static const char *ctf__strings_ptr(const struct cu *self, strings_t s)
 	return ctf__string(self->priv, s);
 }
 
+/*
+ * Upper bounds, the CTF sections are compact: each type takes at least a
+ * ctf_short_type, each function at least its info and return type and each
+ * data object is a type id.
+ */
+static void cu__reserve_ctf_tables(struct cu *self, struct ctf *ctf)
+{
+	struct ctf_header *hp = ctf__get_buffer(ctf);
+	const uint32_t object_off = ctf__get32(ctf, &hp->ctf_object_off),
+		       func_off	  = ctf__get32(ctf, &hp->ctf_func_off),
+		       type_off	  = ctf__get32(ctf, &hp->ctf_type_off),
+		       str_off	  = ctf__get32(ctf, &hp->ctf_str_off);
+	uint32_t nr_types = 1 + ((str_off - type_off) /
+				 sizeof(struct ctf_short_type));
+
+	/* See ctf__load_types */
+	if (hp->ctf_parent_name || hp->ctf_parent_label)
+		nr_types += 0x8000;
+
+	cu__reserve_tables(self, nr_types,
+			   (func_off - object_off) / sizeof(uint16_t),
+			   (type_off - func_off) / (2 * sizeof(uint16_t)));
+}
+
 struct debug_fmt_ops ctf__ops;
 
 int ctf__load_file(struct cus *self, struct conf_load *conf,
@@ -724,7 +748,8 @@ int ctf__load_file(struct cus *self, struct conf_load *conf,
 	if (state == NULL)
 		return -1;
 
-	struct cu *cu = cu__new(filename, state->wordsize, NULL, 0, filename);
+	struct cu *cu = cu__new(filename, state->wordsize, NULL, 0, filename,
+				self->arena);
 	if (cu == NULL)
 		return -1;
 
@@ -736,13 +761,17 @@ int ctf__load_file(struct cus *self, struct conf_load *conf,
 	if (ctf__load(state) != 0)
 		return -1;
 
-	err = ctf__load_sections(state);
+	cu__reserve_ctf_tables(cu, state);
 
+	err = ctf__load_sections(state);
 	if (err != 0) {
 		cu__delete(cu);
 		return err;
 	}
 
+	/* Without memory for it the functions are looked up later */
+	cu__sort_functions(cu);
+
 	err = cu__fixup_ctf_bitfields(cu);
 	/*
 	 * The app stole this cu, possibly deleting it,
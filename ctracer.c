@@ -190,16 +190,16 @@ static void method__add(struct cu *cu, struct function *function, uint32_t id)
 }
 
 /*
- * We want just the function tags that have as one of its parameters
- * a pointer to the specified "class" (a struct, unions can be added later).
+ * cu__for_each_method gives us just the function tags that have as one of its
+ * parameters a pointer to the specified "class", filter out the ones we can't
+ * or don't want to probe.
  */
 static struct function *function__filter(struct function *function,
-					 struct cu *cu, uint16_t target_type_id)
+					 struct cu *cu)
 {
 	if (function__inlined(function) ||
 	    function->abstract_origin != 0 ||
 	    !list_empty(&function->tool_node) ||
-	    !ftype__has_parm_of_type(&function->proto, target_type_id, cu) ||
 	    strlist__has_entry(init_blacklist, function__name(function, cu))) {
 		return NULL;
 	}
@@ -215,8 +215,7 @@ static struct function *function__filter(struct function *function,
 static int cu_find_methods_iterator(struct cu *cu, void *cookie)
 {
 	uint16_t target_type_id;
-	uint32_t function_id;
-	struct function *function;
+	struct method_ref *method, *end;
 	struct tag *target = cu__find_struct_by_name(cu, cookie, 0,
 						     &target_type_id);
 
@@ -225,9 +224,9 @@ static int cu_find_methods_iterator(struct cu *cu, void *cookie)
 	if (target == NULL)
 		return 0;
 
-	cu__for_each_function(cu, function_id, function)
-		if (function__filter(function, cu, target_type_id))
-			method__add(cu, function, function_id);
+	cu__for_each_method(cu, target_type_id, method, end)
+		if (function__filter(method->function, cu))
+			method__add(cu, method->function, method->id);
 
 	return 0;
 }
@@ -257,7 +256,10 @@ static struct class_member *class__remove_member(struct class *self, const struc
 	size_t size = member->byte_size;
 	struct class_member *bitfield_tail = NULL;
 	struct list_head *next;
-	uint16_t member_hole = member->hole;
+	uint16_t member_hole;
+
+	class__find_holes(self);
+	member_hole = member->hole;
 
 	if (member->bitfield_size != 0) {
 		bitfield_tail = class_member__bitfield_tail(member, self);
@@ -536,16 +538,25 @@ static struct tag *pointer_filter(struct tag *tag, struct cu *cu,
  */
 static int cu_find_pointers_iterator(struct cu *cu, void *class_name)
 {
-	uint16_t target_type_id, id;
+	uint16_t target_type_id;
+	struct type_ref *pointer, *pointers_end;
 	struct tag *target = cu__find_struct_by_name(cu, class_name, 0,
-						     &target_type_id), *pos;
+						     &target_type_id);
 
 	if (target == NULL)
 		return 0;
 
-	cu__for_each_type(cu, id, pos)
-		if (pointer_filter(pos, cu, target_type_id))
-			structures__add(&pointers, pos, cu);
+	cu__for_each_type_ref(cu, target_type_id, pointer, pointers_end) {
+		struct type_ref *ref, *end;
+
+		if (pointer->from->tag != DW_TAG_pointer_type)
+			continue;
+
+		cu__for_each_type_ref(cu, pointer->id, ref, end)
+			if (ref->owner != NULL &&
+			    pointer_filter(ref->owner, cu, target_type_id))
+				structures__add(&pointers, ref->owner, cu);
+	}
 
 	return 0;
 }
@@ -591,13 +602,20 @@ static void class__find_aliases(const char *class_name);
  */
 static int cu_find_aliases_iterator(struct cu *cu, void *class_name)
 {
-	uint16_t target_type_id, id;
+	uint16_t target_type_id;
+	struct type_ref *ref, *end;
 	struct tag *target = cu__find_struct_by_name(cu, class_name, 0,
-						     &target_type_id), *pos;
+						     &target_type_id);
 	if (target == NULL)
 		return 0;
 
-	cu__for_each_type(cu, id, pos) {
+	cu__for_each_type_ref(cu, target_type_id, ref, end) {
+		struct tag *pos = ref->owner;
+
+		if (pos == NULL || !tag__has_namespace(pos) ||
+		    ref->from->node.prev != &tag__namespace(pos)->tags)
+			continue;
+
 		if (alias_filter(pos, cu, target_type_id)) {
 			const char *alias_name = class__name(tag__class(pos), cu);
 
@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 void *zalloc(const size_t size)
 {
@@ -23,6 +24,13 @@ void *zalloc(const size_t size)
 	return s;
 }
 
+int nr_cpus_online(void)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return nr_cpus > 0 ? nr_cpus : 1;
+}
+
 struct str_node *str_node__new(const char *s, bool dupstr)
 {
 	struct str_node *self = malloc(sizeof(*self));
@@ -68,6 +68,7 @@ static inline bool strlist__empty(const struct strlist *self)
 }
 
 void *zalloc(const size_t size);
+int nr_cpus_online(void);
 
 Elf_Scn *elf_section_by_name(Elf *elf, GElf_Ehdr *ep,
 			     GElf_Shdr *shp, const char *name, size_t *index);
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <libelf.h>
+#include <limits.h>
 #include <obstack.h>
 #include <search.h>
 #include <stdio.h>
@@ -153,7 +154,7 @@ static void cu__hash(struct cu *self, struct tag *tag)
 	struct hlist_head *hashtable = tag__is_tag_type(tag) ?
 							dcu->hash_types :
 							dcu->hash_tags;
-	hashtags__hash(hashtable, tag->priv);
+	hashtags__hash(hashtable, tag__priv(tag, self));
 }
 
 static struct dwarf_tag *dwarf_cu__find_tag_by_id(const struct dwarf_cu *self,
@@ -336,8 +337,11 @@ static void *__tag__alloc(struct dwarf_cu *dcu, size_t size, bool spec)
 	if (self == NULL)
 		return NULL;
 
+	self->priv_slot = 0;
+	if (tag__set_priv(self, dcu->cu, dtag) != 0)
+		return NULL;
+
 	dtag->tag = self;
-	self->priv = dtag;
 	dtag->type = 0;
 	self->type = 0;
 	self->top_level = 0;
@@ -357,7 +361,7 @@ static void *tag__alloc_with_spec(struct cu *cu, size_t size)
 
 static void tag__init(struct tag *self, struct cu *cu, Dwarf_Die *die)
 {
-	struct dwarf_tag *dtag = self->priv;
+	struct dwarf_tag *dtag = tag__priv(self, cu);
 
 	self->tag = dwarf_tag(die);
 
@@ -408,7 +412,7 @@ static struct ptr_to_member_type *ptr_to_member_type__new(Dwarf_Die *die,
 
 	if (self != NULL) {
 		tag__init(&self->tag, cu, die);
-		struct dwarf_tag *dself = self->tag.priv;
+		struct dwarf_tag *dself = tag__priv(&self->tag, cu);
 		dself->containing_type = attr_type(die, DW_AT_containing_type);
 	}
 
@@ -474,7 +478,7 @@ static void type__init(struct type *self, Dwarf_Die *die, struct cu *cu)
 	INIT_LIST_HEAD(&self->node);
 	self->size		 = attr_numeric(die, DW_AT_byte_size);
 	self->declaration	 = attr_numeric(die, DW_AT_declaration);
-	dwarf_tag__set_spec(self->namespace.tag.priv,
+	dwarf_tag__set_spec(tag__priv(&self->namespace.tag, cu),
 			    attr_type(die, DW_AT_specification));
 	self->definition_emitted = 0;
 	self->fwd_decl_emitted	 = 0;
@@ -558,7 +562,7 @@ int tag__recode_dwarf_bitfield(struct tag *self, struct cu *cu, uint16_t bit_siz
 
 	switch (self->tag) {
 	case DW_TAG_typedef: {
-		const struct dwarf_tag *dself = self->priv;
+		const struct dwarf_tag *dself = tag__priv(self, cu);
 		struct dwarf_tag *dtype = dwarf_cu__find_type_by_id(cu->priv,
 								    dself->type);
 		struct tag *type = dtype->tag;
@@ -581,7 +585,7 @@ int tag__recode_dwarf_bitfield(struct tag *self, struct cu *cu, uint16_t bit_siz
 
 	case DW_TAG_const_type:
 	case DW_TAG_volatile_type: {
-		const struct dwarf_tag *dself = self->priv;
+		const struct dwarf_tag *dself = tag__priv(self, cu);
 		struct dwarf_tag *dtype = dwarf_cu__find_type_by_id(cu->priv,
 								    dself->type);
 		struct tag *type = dtype->tag;
@@ -668,7 +672,7 @@ int tag__recode_dwarf_bitfield(struct tag *self, struct cu *cu, uint16_t bit_siz
 int class_member__dwarf_recode_bitfield(struct class_member *self,
 					struct cu *cu)
 {
-	struct dwarf_tag *dtag = self->tag.priv;
+	struct dwarf_tag *dtag = tag__priv(&self->tag, cu);
 	struct dwarf_tag *type = dwarf_cu__find_type_by_id(cu->priv, dtag->type);
 	int recoded_type_id = tag__recode_dwarf_bitfield(type->tag, cu,
 							 self->bitfield_size);
@@ -723,7 +727,7 @@ static struct inline_expansion *inline_expansion__new(Dwarf_Die *die,
 	struct inline_expansion *self = tag__alloc(cu, sizeof(*self));
 
 	if (self != NULL) {
-		struct dwarf_tag *dtag = self->ip.tag.priv;
+		struct dwarf_tag *dtag = tag__priv(&self->ip.tag, cu);
 
 		tag__init(&self->ip.tag, cu, die);
 		dtag->decl_file =
@@ -789,6 +793,7 @@ static struct class *class__new(Dwarf_Die *die, struct cu *cu)
 		  self->nr_bit_holes =
 		  self->padding =
 		  self->bit_padding = 0;
+		self->holes_searched = false;
 		self->priv = NULL;
 	}
 
@@ -862,7 +867,7 @@ static struct function *function__new(Dwarf_Die *die, struct cu *cu)
 		self->inlined  = attr_numeric(die, DW_AT_inline);
 		self->external = dwarf_hasattr(die, DW_AT_external);
 		self->abstract_origin = dwarf_hasattr(die, DW_AT_abstract_origin);
-		dwarf_tag__set_spec(self->proto.tag.priv,
+		dwarf_tag__set_spec(tag__priv(&self->proto.tag, cu),
 				    attr_type(die, DW_AT_specification));
 		self->accessibility   = attr_numeric(die, DW_AT_accessibility);
 		self->virtuality      = attr_numeric(die, DW_AT_virtuality);
@@ -1011,7 +1016,7 @@ static struct tag *die__create_new_typedef(Dwarf_Die *die, struct cu *cu)
 		return NULL;
 
 	if (dwarf_haschildren(die)) {
-		struct dwarf_tag *dtag = tdef->namespace.tag.priv;
+		struct dwarf_tag *dtag = tag__priv(&tdef->namespace.tag, cu);
 		fprintf(stderr, "%s: DW_TAG_typedef %llx WITH children!\n",
 			__func__, (unsigned long long)dtag->id);
 	}
@@ -1148,7 +1153,7 @@ static struct tag *die__create_new_subroutine_type(Dwarf_Die *die,
 			goto out_delete_tag;
 hash:
 		cu__hash(cu, tag);
-		struct dwarf_tag *dtag = tag->priv;
+		struct dwarf_tag *dtag = tag__priv(tag, cu);
 		dtag->small_id = id;
 	} while (dwarf_siblingof(die, die) == 0);
 out:
@@ -1230,7 +1235,8 @@ static int die__process_class(Dwarf_Die *die, struct type *class,
 					return -ENOMEM;
 				}
 
-				struct dwarf_tag *dtag = member->tag.priv;
+				struct dwarf_tag *dtag = tag__priv(&member->tag,
+								   cu);
 				dtag->small_id = id;
 			}
 
@@ -1251,7 +1257,7 @@ static int die__process_class(Dwarf_Die *die, struct type *class,
 				return -ENOMEM;
 			}
 
-			struct dwarf_tag *dtag = tag->priv;
+			struct dwarf_tag *dtag = tag__priv(tag, cu);
 			dtag->small_id = id;
 
 			namespace__add_tag(&class->namespace, tag);
@@ -1283,7 +1289,7 @@ static int die__process_namespace(Dwarf_Die *die, struct namespace *namespace,
 		if (cu__table_add_tag(cu, tag, &id) < 0)
 			goto out_delete_tag;
 
-		struct dwarf_tag *dtag = tag->priv;
+		struct dwarf_tag *dtag = tag__priv(tag, cu);
 		dtag->small_id = id;
 
 		namespace__add_tag(namespace, tag);
@@ -1371,7 +1377,7 @@ static int die__process_inline_expansion(Dwarf_Die *die, struct cu *cu)
 			goto out_delete_tag;
 hash:
 		cu__hash(cu, tag);
-		struct dwarf_tag *dtag = tag->priv;
+		struct dwarf_tag *dtag = tag__priv(tag, cu);
 		dtag->small_id = id;
 	} while (dwarf_siblingof(die, die) == 0);
 
@@ -1463,7 +1469,7 @@ static int die__process_function(Dwarf_Die *die, struct ftype *ftype,
 			goto out_delete_tag;
 hash:
 		cu__hash(cu, tag);
-		struct dwarf_tag *dtag = tag->priv;
+		struct dwarf_tag *dtag = tag__priv(tag, cu);
 		dtag->small_id = id;
 	} while (dwarf_siblingof(die, die) == 0);
 
@@ -1547,23 +1553,24 @@ static int die__process_unit(Dwarf_Die *die, struct cu *cu)
 		long id = -1;
 		cu__add_tag(cu, tag, &id);
 		cu__hash(cu, tag);
-		struct dwarf_tag *dtag = tag->priv;
+		struct dwarf_tag *dtag = tag__priv(tag, cu);
 		dtag->small_id = id;
 	} while (dwarf_siblingof(die, die) == 0);
 
 	return 0;
 }
 
-static void __tag__print_type_not_found(struct tag *self, const char *func)
+static void __tag__print_type_not_found(struct tag *self, struct cu *cu,
+					const char *func)
 {
-	struct dwarf_tag *dtag = self->priv;
+	struct dwarf_tag *dtag = tag__priv(self, cu);
 	fprintf(stderr, "%s: couldn't find %#llx type for %#llx (%s)!\n", func,
 		(unsigned long long)dtag->type, (unsigned long long)dtag->id,
 		dwarf_tag_name(self->tag));
 }
 
-#define tag__print_type_not_found(self) \
-	__tag__print_type_not_found(self, __func__)
+#define tag__print_type_not_found(self, cu) \
+	__tag__print_type_not_found(self, cu, __func__)
 
 static void ftype__recode_dwarf_types(struct tag *self, struct cu *cu);
 
@@ -1575,7 +1582,7 @@ static int namespace__recode_dwarf_types(struct tag *self, struct cu *cu)
 
 	namespace__for_each_tag(ns, pos) {
 		struct dwarf_tag *dtype;
-		struct dwarf_tag *dpos = pos->priv;
+		struct dwarf_tag *dpos = tag__priv(pos, cu);
 
 		if (tag__has_namespace(pos)) {
 			if (namespace__recode_dwarf_types(pos, cu))
@@ -1618,7 +1625,7 @@ find_type:
 		dtype = dwarf_cu__find_type_by_id(dcu, dpos->type);
 check_type:
 		if (dtype == NULL) {
-			tag__print_type_not_found(pos);
+			tag__print_type_not_found(pos, cu);
 			continue;
 		}
 next:
@@ -1631,7 +1638,7 @@ static void type__recode_dwarf_specification(struct tag *self, struct cu *cu)
 {
 	struct dwarf_tag *dtype;
 	struct type *t = tag__type(self);
-	Dwarf_Off specification = dwarf_tag__spec(self->priv);
+	Dwarf_Off specification = dwarf_tag__spec(tag__priv(self, cu));
 
 	if (t->namespace.name != 0 || specification == 0)
 		return;
@@ -1640,7 +1647,7 @@ static void type__recode_dwarf_specification(struct tag *self, struct cu *cu)
 	if (dtype != NULL)
 		t->namespace.name = tag__namespace(dtype->tag)->name;
 	else {
-		struct dwarf_tag *dtag = self->priv;
+		struct dwarf_tag *dtag = tag__priv(self, cu);
 
 		fprintf(stderr,
 			"%s: couldn't find name for "
@@ -1651,9 +1658,10 @@ static void type__recode_dwarf_specification(struct tag *self, struct cu *cu)
 }
 
 static void __tag__print_abstract_origin_not_found(struct tag *self,
+						   struct cu *cu,
 						   const char *func)
 {
-	struct dwarf_tag *dtag = self->priv;
+	struct dwarf_tag *dtag = tag__priv(self, cu);
 	fprintf(stderr,
 		"%s: couldn't find %#llx abstract_origin for %#llx (%s)!\n",
 		func, (unsigned long long)dtag->abstract_origin,
@@ -1661,8 +1669,8 @@ static void __tag__print_abstract_origin_not_found(struct tag *self,
 		dwarf_tag_name(self->tag));
 }
 
-#define tag__print_abstract_origin_not_found(self ) \
-	__tag__print_abstract_origin_not_found(self, __func__)
+#define tag__print_abstract_origin_not_found(self, cu) \
+	__tag__print_abstract_origin_not_found(self, cu, __func__)
 
 static void ftype__recode_dwarf_types(struct tag *self, struct cu *cu)
 {
@@ -1671,7 +1679,7 @@ static void ftype__recode_dwarf_types(struct tag *self, struct cu *cu)
 	struct ftype *type = tag__ftype(self);
 
 	ftype__for_each_parameter(type, pos) {
-		struct dwarf_tag *dpos = pos->tag.priv;
+		struct dwarf_tag *dpos = tag__priv(&pos->tag, cu);
 		struct dwarf_tag *dtype;
 
 		if (dpos->type == 0) {
@@ -1682,7 +1690,8 @@ static void ftype__recode_dwarf_types(struct tag *self, struct cu *cu)
 			}
 			dtype = dwarf_cu__find_tag_by_id(dcu, dpos->abstract_origin);
 			if (dtype == NULL) {
-				tag__print_abstract_origin_not_found(&pos->tag);
+				tag__print_abstract_origin_not_found(&pos->tag,
+								     cu);
 				continue;
 			}
 			pos->name = tag__parameter(dtype->tag)->name;
@@ -1692,7 +1701,7 @@ static void ftype__recode_dwarf_types(struct tag *self, struct cu *cu)
 
 		dtype = dwarf_cu__find_type_by_id(dcu, dpos->type);
 		if (dtype == NULL) {
-			tag__print_type_not_found(&pos->tag);
+			tag__print_type_not_found(&pos->tag, cu);
 			continue;
 		}
 		pos->tag.type = dtype->small_id;
@@ -1705,7 +1714,7 @@ static void lexblock__recode_dwarf_types(struct lexblock *self, struct cu *cu)
 	struct dwarf_cu *dcu = cu->priv;
 
 	list_for_each_entry(pos, &self->tags, node) {
-		struct dwarf_tag *dpos = pos->priv;
+		struct dwarf_tag *dpos = tag__priv(pos, cu);
 		struct dwarf_tag *dtype;
 
 		switch (pos->tag) {
@@ -1715,7 +1724,7 @@ static void lexblock__recode_dwarf_types(struct lexblock *self, struct cu *cu)
 		case DW_TAG_inlined_subroutine:
 			dtype = dwarf_cu__find_tag_by_id(dcu, dpos->type);
 			if (dtype == NULL) {
-				tag__print_type_not_found(pos);
+				tag__print_type_not_found(pos, cu);
 				continue;
 			}
 			ftype__recode_dwarf_types(dtype->tag, cu);
@@ -1729,7 +1738,7 @@ static void lexblock__recode_dwarf_types(struct lexblock *self, struct cu *cu)
 			dtype = dwarf_cu__find_tag_by_id(dcu,
 							 dpos->abstract_origin);
 			if (dtype == NULL) {
-				tag__print_abstract_origin_not_found(pos);
+				tag__print_abstract_origin_not_found(pos, cu);
 				continue;
 			}
 			fp->name = tag__parameter(dtype->tag)->name;
@@ -1754,7 +1763,7 @@ static void lexblock__recode_dwarf_types(struct lexblock *self, struct cu *cu)
 			dtype = dwarf_cu__find_tag_by_id(dcu,
 							 dpos->abstract_origin);
 			if (dtype == NULL) {
-				tag__print_abstract_origin_not_found(pos);
+				tag__print_abstract_origin_not_found(pos, cu);
 				continue;
 			}
 			var->name = tag__variable(dtype->tag)->name;
@@ -1771,14 +1780,14 @@ static void lexblock__recode_dwarf_types(struct lexblock *self, struct cu *cu)
 			if (dtype != NULL)
 				l->name = tag__label(dtype->tag)->name;
 			else
-				tag__print_abstract_origin_not_found(pos);
+				tag__print_abstract_origin_not_found(pos, cu);
 		}
 			continue;
 		}
 
 		dtype = dwarf_cu__find_type_by_id(dcu, dpos->type);
 		if (dtype == NULL) {
-			tag__print_type_not_found(pos);
+			tag__print_type_not_found(pos, cu);
 			continue;
 		}
 		pos->type = dtype->small_id;
@@ -1787,7 +1796,7 @@ static void lexblock__recode_dwarf_types(struct lexblock *self, struct cu *cu)
 
 static int tag__recode_dwarf_type(struct tag *self, struct cu *cu)
 {
-	struct dwarf_tag *dtag = self->priv;
+	struct dwarf_tag *dtag = tag__priv(self, cu);
 	struct dwarf_tag *dtype;
 
 	/* Check if this is an already recoded bitfield */
@@ -1887,7 +1896,7 @@ find_type:
 	dtype = dwarf_cu__find_type_by_id(cu->priv, dtag->type);
 check_type:
 	if (dtype == NULL) {
-		tag__print_type_not_found(self);
+		tag__print_type_not_found(self, cu);
 		return 0;
 	}
 out:
@@ -1915,13 +1924,15 @@ static int cu__recode_dwarf_types(struct cu *self)
 	    cu__recode_dwarf_types_table(self, &self->tags_table, 0) ||
 	    cu__recode_dwarf_types_table(self, &self->functions_table, 0))
 		return -1;
+	/* tag->type changed from DWARF offsets to cu ids */
+	cu__invalidate_resolved_types(self);
 	return 0;
 }
 
 static const char *dwarf_tag__decl_file(const struct tag *self,
 					const struct cu *cu)
 {
-	struct dwarf_tag *dtag = self->priv;
+	struct dwarf_tag *dtag = tag__priv(self, cu);
 	return cu->extra_dbg_info ?
 			strings__ptr(strings, dtag->decl_file) : NULL;
 }
@@ -1929,21 +1940,21 @@ static const char *dwarf_tag__decl_file(const struct tag *self,
 static uint32_t dwarf_tag__decl_line(const struct tag *self,
 				     const struct cu *cu)
 {
-	struct dwarf_tag *dtag = self->priv;
+	struct dwarf_tag *dtag = tag__priv(self, cu);
 	return cu->extra_dbg_info ? dtag->decl_line : 0;
 }
 
 static unsigned long long dwarf_tag__orig_id(const struct tag *self,
 					       const struct cu *cu)
 {
-	struct dwarf_tag *dtag = self->priv;
+	struct dwarf_tag *dtag = tag__priv(self, cu);
 	return cu->extra_dbg_info ? dtag->id : 0;
 }
 
 static unsigned long long dwarf_tag__orig_type(const struct tag *self,
 					       const struct cu *cu)
 {
-	struct dwarf_tag *dtag = self->priv;
+	struct dwarf_tag *dtag = tag__priv(self, cu);
 	return cu->extra_dbg_info ? dtag->type : 0;
 }
 
@@ -2039,6 +2050,44 @@ check_volatile:
 	return 0;
 }
 
+/*
+ * Size hints for cu__reserve_tables, in .debug_info bytes per table entry.
+ * On the low side, as the tables grow as needed, while reserving too much
+ * is just wasted memory.
+ */
+#define DWARF__CU_BYTES_PER_TYPE     64
+#define DWARF__CU_BYTES_PER_TAG	     256
+#define DWARF__CU_BYTES_PER_FUNCTION 256
+
+static void cu__reserve_dwarf_tables(struct cu *self, Dwarf_Off size)
+{
+	Dwarf_Off nr_types = size / DWARF__CU_BYTES_PER_TYPE;
+
+	/* type ids are uint16_t */
+	if (nr_types > UINT16_MAX + 1)
+		nr_types = UINT16_MAX + 1;
+
+	cu__reserve_tables(self, nr_types, size / DWARF__CU_BYTES_PER_TAG,
+			   size / DWARF__CU_BYTES_PER_FUNCTION);
+}
+
+/*
+ * The strings table will have at most what is in .debug_str, less what is
+ * already there from other modules or files, plus the decl_file names.
+ */
+static void strings__reserve_debug_str(struct strings *self, Elf *elf)
+{
+	GElf_Ehdr ehdr;
+	GElf_Shdr shdr;
+
+	if (gelf_getehdr(elf, &ehdr) == NULL ||
+	    elf_section_by_name(elf, &ehdr, &shdr, ".debug_str", NULL) == NULL)
+		return;
+
+	if (shdr.sh_size < UINT_MAX - strings__size(self))
+		strings__reserve(self, strings__size(self) + shdr.sh_size);
+}
+
 static int cus__load_module(struct cus *self, struct conf_load *conf,
 			    Dwfl_Module *mod, Dwarf *dw, Elf *elf,
 			    const char *filename)
@@ -2053,6 +2102,8 @@ static int cus__load_module(struct cus *self, struct conf_load *conf,
 #else
 	int build_id_len = 0;
 #endif
+	strings__reserve_debug_str(strings, elf);
+
 	while (dwarf_nextcu(dw, off, &noff, &cuhl, NULL, NULL, NULL) == 0) {
 		Dwarf_Die die_mem, tmp;
 		Dwarf_Die *cu_die = dwarf_offdie(dw, off + cuhl, &die_mem);
@@ -2066,9 +2117,11 @@ static int cus__load_module(struct cus *self, struct conf_load *conf,
 		 */
 		const char *name = attr_string(cu_die, DW_AT_name);
 		struct cu *cu = cu__new(name ?: "", pointer_size,
-					build_id, build_id_len, filename);
+					build_id, build_id_len, filename,
+					self->arena);
 		if (cu == NULL)
 			return DWARF_CB_ABORT;
+		cu__reserve_dwarf_tables(cu, noff - off);
 		cu->uses_global_strings = true;
 		cu->elf = elf;
 		cu->dwfl = mod;
@@ -2086,6 +2139,8 @@ static int cus__load_module(struct cus *self, struct conf_load *conf,
 			return DWARF_CB_ABORT;
 		base_type_name_to_size_table__init(strings);
 		cu__for_all_tags(cu, class_member__cache_byte_size, conf);
+		/* Without memory for it the functions are looked up later */
+		cu__sort_functions(cu);
 		off = noff;
 		if (conf && conf->steal) {
 			switch (conf->steal(cu, conf)) {
@@ -2102,8 +2157,10 @@ static int cus__load_module(struct cus *self, struct conf_load *conf,
 			}
 		}
 
-		if (!cu->extra_dbg_info)
+		if (!cu->extra_dbg_info) {
+			cu__delete_tags_priv(cu);
 			obstack_free(&dcu.obstack, NULL);
+		}
 
 		cus__add(self, cu);
 	}
@@ -2208,6 +2265,10 @@ static int dwarf__load_file(struct cus *self, struct conf_load *conf,
 
 	elf_version(EV_CURRENT);
 
+	/* The stolen cus get their names from it while we load the others */
+	if (conf && conf->threaded_steal)
+		strings__share(strings);
+
 	fd = open(filename, O_RDONLY);
 
 	if (fd == -1)
@@ -16,6 +16,7 @@
 #include <fcntl.h>
 #include <fnmatch.h>
 #include <libelf.h>
+#include <pthread.h>
 #include <search.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -71,6 +72,16 @@ int __tag__has_type_loop(const struct tag *self, const struct tag *type,
 	return 0;
 }
 
+/*
+ * For the tag deleting functions: the caches keyed by tag, the type names and
+ * expanded types printed, would find the ones allocated later where @obj is.
+ */
+static void cu__free(struct cu *self, void *obj)
+{
+	cu__invalidate_resolved_types(self);
+	obstack_free(&self->obstack, obj);
+}
+
 static void lexblock__delete_tags(struct tag *tself, struct cu *cu)
 {
 	struct lexblock *self = tag__lexblock(tself);
@@ -85,7 +96,7 @@ static void lexblock__delete_tags(struct tag *tself, struct cu *cu)
 void lexblock__delete(struct lexblock *self, struct cu *cu)
 {
 	lexblock__delete_tags(&self->ip.tag, cu);
-	obstack_free(&cu->obstack, self);
+	cu__free(cu, self);
 }
 
 void tag__delete(struct tag *self, struct cu *cu)
@@ -107,7 +118,7 @@ void tag__delete(struct tag *self, struct cu *cu)
 	case DW_TAG_lexical_block:
 		lexblock__delete(tag__lexblock(self), cu);	break;
 	default:
-		obstack_free(&cu->obstack, self);
+		cu__free(cu, self);
 	}
 }
 
@@ -118,14 +129,36 @@ void tag__not_found_die(const char *file, int line, const char *func)
 	exit(1);
 }
 
-struct tag *tag__follow_typedef(const struct tag *tag, const struct cu *cu)
+static struct resolved_type *cu__resolved_type(const struct cu *cu,
+					       uint16_t id);
+
+static uint16_t cu__follow_typedef(const struct cu *cu, uint16_t id)
 {
-	struct tag *type = cu__type(cu, tag->type);
+	struct resolved_type *rt = cu__resolved_type(cu, id);
+	const uint16_t from = id;
+	struct tag *type;
+
+	if (rt != NULL && rt->has_canonical)
+		return rt->canonical;
 
-	if (type != NULL && tag__is_typedef(type))
-		return tag__follow_typedef(type, cu);
+	type = cu__type(cu, id);
+	while (type != NULL && tag__is_typedef(type)) {
+		id = type->type;
+		type = cu__type(cu, id);
+	}
+
+	rt = cu__resolved_type(cu, from);
+	if (rt != NULL) {
+		rt->canonical	  = id;
+		rt->has_canonical = 1;
+	}
+
+	return id;
+}
 
-	return type;
+struct tag *tag__follow_typedef(const struct tag *tag, const struct cu *cu)
+{
+	return cu__type(cu, cu__follow_typedef(cu, tag->type));
 }
 
 size_t __tag__id_not_found_fprintf(FILE *fp, uint16_t id,
@@ -329,7 +362,15 @@ reevaluate:
 	return result;
 }
 
-static void cu__find_class_holes(struct cu *self)
+/**
+ * cu__find_class_holes - find the holes in all the structs in a cu
+ * @self: the cu
+ *
+ * The holes are found on demand, by class__find_holes, this is for tools
+ * that will look at the layout of classes in other cus from several
+ * threads, see cus__for_each_cu_parallel.
+ */
+void cu__find_class_holes(struct cu *self)
 {
 	uint16_t id;
 	struct class *pos;
@@ -341,7 +382,6 @@ static void cu__find_class_holes(struct cu *self)
 void cus__add(struct cus *self, struct cu *cu)
 {
 	list_add_tail(&cu->node, &self->cus);
-	cu__find_class_holes(cu);
 }
 
 static void ptr_table__init(struct ptr_table *self)
@@ -356,21 +396,49 @@ static void ptr_table__exit(struct ptr_table *self)
 	self->entries = NULL;
 }
 
+static int ptr_table__reserve(struct ptr_table *self, uint32_t nr_entries)
+{
+	void *entries;
+
+	if (nr_entries <= self->allocated_entries)
+		return 0;
+
+	entries = realloc(self->entries, sizeof(void *) * nr_entries);
+	if (entries == NULL)
+		return -ENOMEM;
+
+	self->allocated_entries = nr_entries;
+	self->entries = entries;
+	return 0;
+}
+
+/*
+ * Grow geometrically, so that a table with N entries takes O(log N)
+ * reallocs, each copying the whole table, instead of O(N / 256).
+ */
+static int ptr_table__grow(struct ptr_table *self, uint32_t nr_entries)
+{
+	uint32_t allocated_entries = self->allocated_entries ?: 256;
+
+	while (allocated_entries < nr_entries) {
+		if (allocated_entries > UINT32_MAX / 2) {
+			allocated_entries = nr_entries;
+			break;
+		}
+		allocated_entries *= 2;
+	}
+
+	return ptr_table__reserve(self, allocated_entries);
+}
+
 static long ptr_table__add(struct ptr_table *self, void *ptr)
 {
 	const uint32_t nr_entries = self->nr_entries + 1;
 	const long rc = self->nr_entries;
 
-	if (nr_entries > self->allocated_entries) {
-		uint32_t allocated_entries = self->allocated_entries + 256;
-		void *entries = realloc(self->entries,
-					sizeof(void *) * allocated_entries);
-		if (entries == NULL)
-			return -ENOMEM;
-
-		self->allocated_entries = allocated_entries;
-		self->entries = entries;
-	}
+	if (nr_entries > self->allocated_entries &&
+	    ptr_table__grow(self, nr_entries) < 0)
+		return -ENOMEM;
 
 	self->entries[rc] = ptr;
 	self->nr_entries = nr_entries;
@@ -381,16 +449,9 @@ static int ptr_table__add_with_id(struct ptr_table *self, void *ptr,
 				  uint32_t id)
 {
 	/* Assume we won't be fed with the same id more than once */
-	if (id >= self->allocated_entries) {
-		uint32_t allocated_entries = roundup(id + 1, 256);
-		void *entries = realloc(self->entries,
-					sizeof(void *) * allocated_entries);
-		if (entries == NULL)
-			return -ENOMEM;
-
-		self->allocated_entries = allocated_entries;
-		self->entries = entries;
-	}
+	if (id >= self->allocated_entries &&
+	    ptr_table__grow(self, id + 1) < 0)
+		return -ENOMEM;
 
 	self->entries[id] = ptr;
 	++self->nr_entries;
@@ -402,6 +463,56 @@ static void *ptr_table__entry(const struct ptr_table *self, uint32_t id)
 	return id >= self->nr_entries ? NULL : self->entries[id];
 }
 
+/**
+ * tag__set_priv - set the loader extra data for a tag
+ * @self: the tag, with priv_slot zeroed when it was allocated
+ * @cu: the cu @self belongs to
+ * @priv: the data
+ *
+ * Slots are handed out on the first call for a tag, slot 0 meaning none.
+ * Tags copied with memcpy, as class__clone does, share the slot.
+ *
+ * Returns 0 on success, -ENOMEM or -ERANGE if the cu has more than
+ * TAG__MAX_PRIV_SLOT tags with extra data.
+ */
+int tag__set_priv(struct tag *self, struct cu *cu, void *priv)
+{
+	struct ptr_table *pt = &cu->tags_priv;
+	long slot;
+
+	if (self->priv_slot != 0 && self->priv_slot < pt->nr_entries) {
+		pt->entries[self->priv_slot] = priv;
+		return 0;
+	}
+
+	if (pt->nr_entries == 0 && ptr_table__add(pt, NULL) < 0)
+		return -ENOMEM;
+
+	if (pt->nr_entries > TAG__MAX_PRIV_SLOT)
+		return -ERANGE;
+
+	slot = ptr_table__add(pt, priv);
+	if (slot < 0)
+		return slot;
+
+	self->priv_slot = slot;
+	return 0;
+}
+
+/**
+ * cu__delete_tags_priv - drop the side table with the tags extra data
+ * @self: the cu
+ *
+ * For the loader to call when it is done with its per tag data, after
+ * this tag__priv returns NULL for all the tags in @self and the slots
+ * they have are stale, so tag__set_priv shouldn't be used anymore.
+ */
+void cu__delete_tags_priv(struct cu *self)
+{
+	ptr_table__exit(&self->tags_priv);
+	ptr_table__init(&self->tags_priv);
+}
+
 static void cu__insert_function(struct cu *self, struct tag *tag)
 {
 	struct function *function = tag__function(tag);
@@ -421,15 +532,145 @@ static void cu__insert_function(struct cu *self, struct tag *tag)
         rb_insert_color(&function->rb_node, &self->functions);
 }
 
+static int function_addr__cmp(const void *a, const void *b)
+{
+	const struct function_addr *fa = a, *fb = b;
+
+	if (fa->low != fb->low)
+		return fa->low < fb->low ? -1 : 1;
+	if (fa->size != fb->size)
+		return fa->size < fb->size ? -1 : 1;
+	return fa->id < fb->id ? -1 : fa->id > fb->id;
+}
+
+/**
+ * cu__sort_functions - index the functions in a cu by address
+ * @self: the cu
+ *
+ * For the loaders to call when they are done adding tags to @self, builds
+ * the array, sorted by address, that cu__find_function_at_addr searches.
+ * Functions without an address range, such as declarations and abstract
+ * instances of inlines, are left out. Adding a function to @self after this
+ * drops the array and makes cu__find_function_at_addr use the
+ * cu->functions rbtree, that is only built for cus mutated after load.
+ *
+ * Returns 0 or -ENOMEM, that the loaders ignore, as then
+ * cu__find_function_at_addr tries again and, failing that, looks at all the
+ * functions, one by one.
+ */
+int cu__sort_functions(struct cu *self)
+{
+	struct function_addr *addrs;
+	struct function *pos;
+	uint32_t id, nr = 0;
+
+	if (self->functions_sorted || self->functions_mutated)
+		return 0;
+
+	addrs = malloc((self->functions_table.nr_entries ?: 1) *
+		       sizeof(*addrs));
+	if (addrs == NULL)
+		return -ENOMEM;
+
+	cu__for_each_function(self, id, pos) {
+		if (pos->lexblock.size == 0)
+			continue;
+		addrs[nr].low  = pos->lexblock.ip.addr;
+		addrs[nr].size = pos->lexblock.size;
+		addrs[nr].id   = id;
+		++nr;
+	}
+
+	qsort(addrs, nr, sizeof(*addrs), function_addr__cmp);
+	free(self->function_addrs);
+	self->function_addrs	= addrs;
+	self->nr_function_addrs = nr;
+	self->functions_sorted	= 1;
+	return 0;
+}
+
+static void cu__unsort_functions(struct cu *self)
+{
+	struct function *pos;
+	uint32_t id;
+
+	free(self->function_addrs);
+	self->function_addrs	= NULL;
+	self->nr_function_addrs = 0;
+	self->functions_sorted	= 0;
+	self->functions_mutated = 1;
+
+	cu__for_each_function(self, id, pos)
+		cu__insert_function(self, function__tag(pos));
+}
+
+static enum type_kind tag__type_kind(const struct tag *self)
+{
+	if (tag__is_struct(self))
+		return TYPE_KIND__STRUCT;
+
+	switch (self->tag) {
+	case DW_TAG_union_type:		return TYPE_KIND__UNION;
+	case DW_TAG_enumeration_type:	return TYPE_KIND__ENUMERATION;
+	case DW_TAG_typedef:		return TYPE_KIND__TYPEDEF;
+	case DW_TAG_base_type:		return TYPE_KIND__BASE;
+	case DW_TAG_pointer_type:	return TYPE_KIND__POINTER;
+	case DW_TAG_array_type:		return TYPE_KIND__ARRAY;
+	case DW_TAG_subroutine_type:	return TYPE_KIND__SUBROUTINE;
+	}
+
+	return TYPE_KIND__OTHER;
+}
+
+static int cu__add_type_kind(struct cu *self, struct tag *tag, uint32_t id)
+{
+	struct type_id_list *list = &self->types_by_kind[tag__type_kind(tag)];
+
+	/* cu__type() and the iterators only deal with uint16_t ids */
+	if (id > UINT16_MAX)
+		return 0;
+
+	if (id >= self->allocated_types_next) {
+		uint32_t allocated_entries = self->types_table.allocated_entries;
+		uint16_t *entries = realloc(self->types_next,
+					    sizeof(uint16_t) * allocated_entries);
+		if (entries == NULL)
+			return -ENOMEM;
+
+		self->allocated_types_next = allocated_entries;
+		self->types_next = entries;
+	}
+
+	self->types_next[id] = 0;
+	if (list->last != 0)
+		self->types_next[list->last] = id;
+	else
+		list->first = id;
+	list->last = id;
+	++list->nr_entries;
+	return 0;
+}
+
 int cu__table_add_tag(struct cu *self, struct tag *tag, long *id)
 {
 	struct ptr_table *pt = &self->tags_table;
 
-	if (tag__is_tag_type(tag))
+	if (self->type_refs != NULL)
+		cu__delete_type_refs(self);
+
+	if (tag__is_tag_type(tag)) {
 		pt = &self->types_table;
-	else if (tag__is_function(tag)) {
+		if (self->first_typedef_of != NULL) {
+			free(self->first_typedef_of);
+			self->first_typedef_of = NULL;
+		}
+		cu__invalidate_resolved_types(self);
+	} else if (tag__is_function(tag)) {
 		pt = &self->functions_table;
-		cu__insert_function(self, tag);
+		if (self->functions_sorted)
+			cu__unsort_functions(self);
+		if (self->functions_mutated)
+			cu__insert_function(self, tag);
 	}
 
 	if (*id < 0) {
@@ -438,11 +679,37 @@ int cu__table_add_tag(struct cu *self, struct tag *tag, long *id)
 			return -ENOMEM;
 	} else if (ptr_table__add_with_id(pt, tag, *id) < 0)
 		return -ENOMEM;
+
+	if (pt == &self->types_table)
+		return cu__add_type_kind(self, tag, *id);
+	return 0;
+}
+
+/**
+ * cu__reserve_tables - size hints for the cu tag tables
+ * @self: the cu
+ * @nr_types: expected number of types, see tag__is_tag_type
+ * @nr_tags: expected number of other top level tags
+ * @nr_functions: expected number of functions
+ *
+ * For loaders that can estimate how many tags will be added, say from
+ * the size of the debug info for the cu, so that the tables don't get
+ * grown, and copied, several times while loading. Estimating low is fine,
+ * the tables will grow as needed.
+ */
+int cu__reserve_tables(struct cu *self, uint32_t nr_types, uint32_t nr_tags,
+		       uint32_t nr_functions)
+{
+	if (ptr_table__reserve(&self->types_table, nr_types) ||
+	    ptr_table__reserve(&self->tags_table, nr_tags) ||
+	    ptr_table__reserve(&self->functions_table, nr_functions))
+		return -ENOMEM;
 	return 0;
 }
 
 int cu__table_nullify_type_entry(struct cu *self, uint32_t id)
 {
+	cu__invalidate_resolved_types(self);
 	return ptr_table__add_with_id(&self->types_table, NULL, id);
 }
 
@@ -458,7 +725,7 @@ int cu__add_tag(struct cu *self, struct tag *tag, long *id)
 
 struct cu *cu__new(const char *name, uint8_t addr_size,
 		   const unsigned char *build_id, int build_id_len,
-		   const char *filename)
+		   const char *filename, struct arena *arena)
 {
 	struct cu *self = malloc(sizeof(*self) + build_id_len);
 
@@ -468,10 +735,12 @@ struct cu *cu__new(const char *name, uint8_t addr_size,
 		if (self->name == NULL || self->filename == NULL)
 			goto out_free;
 
-		obstack_init(&self->obstack);
+		if (!arena__obstack_init(arena, &self->obstack))
+			goto out_free_name;
 		ptr_table__init(&self->tags_table);
 		ptr_table__init(&self->types_table);
 		ptr_table__init(&self->functions_table);
+		ptr_table__init(&self->tags_priv);
 		/*
 		 * the first entry is historically associated with void,
 		 * so make sure we don't use it
@@ -479,7 +748,30 @@ struct cu *cu__new(const char *name, uint8_t addr_size,
 		if (ptr_table__add(&self->types_table, NULL) < 0)
 			goto out_free_name;
 
+		memset(self->types_by_kind, 0, sizeof(self->types_by_kind));
+		self->types_next	   = NULL;
+		self->allocated_types_next = 0;
+		self->first_typedef_of	   = NULL;
+		self->nr_first_typedef_of  = 0;
+		self->resolved_types	   = NULL;
+		self->nr_resolved_types	   = 0;
+		self->resolved_types_generation = 1;
+		self->type_names	   = NULL;
+		self->nr_type_names	   = 0;
+		self->allocated_type_names = 0;
+		self->type_names_generation = 0;
+		self->expanded_types	    = NULL;
+		self->nr_expanded_types	    = 0;
+		self->nr_expanded_buckets   = 0;
+		self->expanded_types_generation = 0;
+		self->expanded_types_bytes  = 0;
+
+		self->function_addrs	    = NULL;
+		self->nr_function_addrs	    = 0;
+		self->functions_sorted	    = 0;
+		self->functions_mutated	    = 0;
 		self->functions = RB_ROOT;
+		self->type_refs = NULL;
 
 		self->dfops	= NULL;
 		INIT_LIST_HEAD(&self->tags);
@@ -512,9 +804,16 @@ out_free:
 
 void cu__delete(struct cu *self)
 {
+	cu__delete_type_refs(self);
+	free(self->first_typedef_of);
+	free(self->resolved_types);
+	cu__delete_type_caches(self);
+	free(self->function_addrs);
+	free(self->types_next);
 	ptr_table__exit(&self->tags_table);
 	ptr_table__exit(&self->types_table);
 	ptr_table__exit(&self->functions_table);
+	ptr_table__exit(&self->tags_priv);
 	if (self->dfops && self->dfops->cu__delete)
 		self->dfops->cu__delete(self);
 	obstack_free(&self->obstack, NULL);
@@ -545,20 +844,49 @@ struct tag *cu__type(const struct cu *self, const uint16_t id)
 	return self ? ptr_table__entry(&self->types_table, id) : NULL;
 }
 
-struct tag *cu__find_first_typedef_of_type(const struct cu *self,
-					   const uint16_t type)
+/*
+ * Can't be kept up to date in cu__table_add_tag as the DWARF loader only
+ * recodes tag->type after all the tags are added, so build it on the first
+ * lookup and drop it when new types are added.
+ */
+static int cu__build_first_typedef_of(struct cu *self)
 {
-	uint16_t id;
+	const uint32_t nr_entries = self->types_table.nr_entries;
+	uint16_t *first_typedef_of = zalloc(sizeof(uint16_t) * nr_entries);
 	struct tag *pos;
+	uint16_t id;
+
+	if (first_typedef_of == NULL)
+		return -ENOMEM;
+
+	cu__for_each_type_of_kind(self, TYPE_KIND__TYPEDEF, id, pos) {
+		if (pos->type == 0 || pos->type >= nr_entries)
+			continue;
+		if (first_typedef_of[pos->type] == 0 ||
+		    first_typedef_of[pos->type] > id)
+			first_typedef_of[pos->type] = id;
+	}
+
+	self->first_typedef_of	  = first_typedef_of;
+	self->nr_first_typedef_of = nr_entries;
+	return 0;
+}
 
+struct tag *cu__find_first_typedef_of_type(const struct cu *self,
+					   const uint16_t type)
+{
 	if (self == NULL || type == 0)
 		return NULL;
 
-	cu__for_each_type(self, id, pos)
-		if (tag__is_typedef(pos) && pos->type == type)
-			return pos;
+	if (self->first_typedef_of == NULL &&
+	    cu__build_first_typedef_of((struct cu *)self) != 0)
+		return NULL;
 
-	return NULL;
+	if (type >= self->nr_first_typedef_of ||
+	    self->first_typedef_of[type] == 0)
+		return NULL;
+
+	return cu__type(self, self->first_typedef_of[type]);
 }
 
 struct tag *cu__find_base_type_by_name(const struct cu *self,
@@ -727,15 +1055,10 @@ struct tag *cus__find_struct_by_name(const struct cus *self,
 	return NULL;
 }
 
-struct function *cu__find_function_at_addr(const struct cu *self,
-					   uint64_t addr)
+static struct function *cu__find_function_in_rbtree(const struct cu *self,
+						    uint64_t addr)
 {
-        struct rb_node *n;
-
-        if (self == NULL)
-                return NULL;
-
-        n = self->functions.rb_node;
+        struct rb_node *n = self->functions.rb_node;
 
         while (n) {
                 struct function *f = rb_entry(n, struct function, rb_node);
@@ -749,7 +1072,67 @@ struct function *cu__find_function_at_addr(const struct cu *self,
         }
 
         return NULL;
+}
+
+static struct function *cu__find_function_one_by_one(const struct cu *self,
+						     uint64_t addr)
+{
+	struct function *pos;
+	uint32_t id;
+
+	cu__for_each_function(self, id, pos)
+		if (addr >= pos->lexblock.ip.addr &&
+		    addr - pos->lexblock.ip.addr < pos->lexblock.size)
+			return pos;
+
+	return NULL;
+}
+
+/**
+ * cu__find_function_at_addr - find the function whose code has an address
+ * @self: the cu
+ * @addr: the address
+ *
+ * Uses the array built by cu__sort_functions, building it on first use if
+ * the loader didn't, or the cu->functions rbtree if functions were added
+ * after that.
+ */
+struct function *cu__find_function_at_addr(const struct cu *self,
+					   uint64_t addr)
+{
+	const struct function_addr *base;
+	uint32_t nr;
 
+	if (self == NULL)
+		return NULL;
+
+	if (self->functions_mutated)
+		return cu__find_function_in_rbtree(self, addr);
+
+	if (!self->functions_sorted &&
+	    cu__sort_functions((struct cu *)self) != 0)
+		return cu__find_function_one_by_one(self, addr);
+
+	nr = self->nr_function_addrs;
+	if (nr == 0)
+		return NULL;
+	/*
+	 * Look for the last entry starting at or before addr, the compiler
+	 * turns the ternary into a conditional move. Entries with the same
+	 * start are sorted by size, so that is the largest of them.
+	 */
+	base = self->function_addrs;
+	while (nr > 1) {
+		const uint32_t half = nr / 2;
+
+		base = base[half].low <= addr ? base + half : base;
+		nr -= half;
+	}
+
+	if (addr < base->low || addr - base->low >= base->size)
+		return NULL;
+
+	return tag__function(self->functions_table.entries[base->id]);
 }
 
 struct function *cus__find_function_at_addr(const struct cus *self,
@@ -807,6 +1190,101 @@ static size_t array_type__nr_entries(const struct array_type *self)
 	return nr_entries;
 }
 
+/*
+ * The results of tag__size and tag__follow_typedef only depend on the type
+ * id being looked up and on the types in the cu, so they are cached per id.
+ *
+ * This is a cache, filled as a side effect of lookups, like
+ * cu__find_first_typedef_of_type, hence the const being cast away.
+ */
+static struct resolved_type *cu__resolved_type(const struct cu *cu,
+					       uint16_t id)
+{
+	struct cu *self = (struct cu *)cu;
+	struct resolved_type *rt;
+
+	if (id == 0 || id >= self->types_table.nr_entries)
+		return NULL;
+
+	if (id >= self->nr_resolved_types) {
+		const uint32_t nr_entries = self->types_table.allocated_entries;
+
+		rt = realloc(self->resolved_types, sizeof(*rt) * nr_entries);
+		if (rt == NULL)
+			return NULL;
+		memset(rt + self->nr_resolved_types, 0,
+		       sizeof(*rt) * (nr_entries - self->nr_resolved_types));
+		self->resolved_types	= rt;
+		self->nr_resolved_types = nr_entries;
+	}
+
+	rt = &self->resolved_types[id];
+	if (rt->generation != self->resolved_types_generation) {
+		rt->generation	  = self->resolved_types_generation;
+		rt->has_size	  = 0;
+		rt->has_canonical = 0;
+	}
+
+	return rt;
+}
+
+/**
+ * cu__invalidate_resolved_types - forget the cached type sizes and typedefs
+ * @self: the cu
+ *
+ * For when types are changed in place, as pahole does when changing the
+ * word size, cu__table_add_tag does it when types are added. The type names
+ * cached by tag__name and the expanded types cached by class__fprintf are
+ * forgotten too.
+ */
+void cu__invalidate_resolved_types(struct cu *self)
+{
+	if (++self->resolved_types_generation == 0) {
+		memset(self->resolved_types, 0,
+		       sizeof(*self->resolved_types) * self->nr_resolved_types);
+		self->resolved_types_generation = 1;
+		self->type_names_generation = 0;
+		self->expanded_types_generation = 0;
+	}
+}
+
+/**
+ * cu__resolve_types - fill the cache used by tag__size and tag__follow_typedef
+ * @self: the cu
+ *
+ * They fill it on demand, this is for when the types are going to be
+ * looked up from several threads, so that they only read from it.
+ *
+ * Returns 0 or -ENOMEM.
+ */
+int cu__resolve_types(struct cu *self)
+{
+	struct resolved_type *rt;
+	struct tag *type;
+	uint32_t id;
+
+	for (id = 1; id < self->types_table.nr_entries && id <= UINT16_MAX; ++id) {
+		type = cu__type(self, id);
+		/* Loops are reported when the type is looked up for real */
+		if (type == NULL || type->type == id)
+			continue;
+
+		if (cu__resolved_type(self, id) == NULL)
+			return -ENOMEM;
+
+		cu__follow_typedef(self, id);
+		const size_t size = tag__size(type, self);
+
+		rt = cu__resolved_type(self, id);
+		if (size != (size_t)-1 && !rt->has_size) {
+			rt->size     = size;
+			rt->has_size = 1;
+		}
+	}
+
+	return 0;
+}
+
 size_t tag__size(const struct tag *self, const struct cu *cu)
 {
 	size_t size;
@@ -835,13 +1313,27 @@ size_t tag__size(const struct tag *self, const struct cu *cu)
 			size = tag__type(self)->size;
 	} else {
 		const struct tag *type = cu__type(cu, self->type);
+		struct resolved_type *rt = cu__resolved_type(cu, self->type);
 
-		if (type == NULL) {
+		if (rt != NULL && rt->has_size)
+			size = rt->size;
+		else if (type == NULL) {
 			tag__id_not_found_fprintf(stderr, self->type);
 			return -1;
 		} else if (tag__has_type_loop(self, type, NULL, 0, NULL))
 			return -1;
-		size = tag__size(type, cu);
+		else {
+			size = tag__size(type, cu);
+			/*
+			 * Only successful lookups are cached, the lookup for
+			 * 'type' may have realloc'ed the cache, so get it again
+			 */
+			rt = cu__resolved_type(cu, self->type);
+			if (rt != NULL && size != (size_t)-1) {
+				rt->size     = size;
+				rt->has_size = 1;
+			}
+		}
 	}
 
 	if (self->tag == DW_TAG_array_type)
@@ -867,7 +1359,7 @@ const char *variable__type_name(const struct variable *self,
 
 void class_member__delete(struct class_member *self, struct cu *cu)
 {
-	obstack_free(&cu->obstack, self);
+	cu__free(cu, self);
 }
 
 static struct class_member *class_member__clone(const struct class_member *from,
@@ -896,18 +1388,18 @@ void class__delete(struct class *self, struct cu *cu)
 	if (self->type.namespace.sname != NULL)
 		free(self->type.namespace.sname);
 	type__delete_class_members(&self->type, cu);
-	obstack_free(&cu->obstack, self);
+	cu__free(cu, self);
 }
 
 void type__delete(struct type *self, struct cu *cu)
 {
 	type__delete_class_members(self, cu);
-	obstack_free(&cu->obstack, self);
+	cu__free(cu, self);
 }
 
 static void enumerator__delete(struct enumerator *self, struct cu *cu)
 {
-	obstack_free(&cu->obstack, self);
+	cu__free(cu, self);
 }
 
 void enumeration__delete(struct type *self, struct cu *cu)
@@ -1011,7 +1503,7 @@ const char *function__name(struct function *self, const struct cu *cu)
 
 static void parameter__delete(struct parameter *self, struct cu *cu)
 {
-	obstack_free(&cu->obstack, self);
+	cu__free(cu, self);
 }
 
 void ftype__delete(struct ftype *self, struct cu *cu)
@@ -1025,7 +1517,7 @@ void ftype__delete(struct ftype *self, struct cu *cu)
 		list_del_init(&pos->tag.node);
 		parameter__delete(pos, cu);
 	}
-	obstack_free(&cu->obstack, self);
+	cu__free(cu, self);
 }
 
 void function__delete(struct function *self, struct cu *cu)
@@ -1098,6 +1590,13 @@ const struct class_member *class__find_bit_hole(const struct class *self,
 	return NULL;
 }
 
+/**
+ * class__find_holes - find the holes, bit holes and padding in a class
+ * @self: the class
+ *
+ * Done only once, the results are kept in the class and in its members,
+ * use class__refind_holes after changing its layout.
+ */
 void class__find_holes(struct class *self)
 {
 	const struct type *ctype = &self->type;
@@ -1106,6 +1605,10 @@ void class__find_holes(struct class *self)
 	uint32_t bit_sum = 0;
 	uint32_t bitfield_real_offset = 0;
 
+	if (self->holes_searched)
+		return;
+
+	self->holes_searched = true;
 	self->nr_holes = 0;
 	self->nr_bit_holes = 0;
 
@@ -1189,6 +1692,12 @@ void class__find_holes(struct class *self)
 		self->padding = 0;
 }
 
+void class__refind_holes(struct class *self)
+{
+	self->holes_searched = false;
+	class__find_holes(self);
+}
+
 /** class__has_hole_ge - check if class has a hole greater or equal to @size
  * @self - class instance
  * @size - hole size to check
@@ -1236,6 +1745,91 @@ uint32_t type__nr_members_of_type(const struct type *self, const uint16_t type)
 	return nr_members_of_type;
 }
 
+/* FNV-1a, good enough to tell layouts apart */
+#define LAYOUT_HASH__INIT 0xcbf29ce484222325ULL
+
+static uint64_t layout_hash__add(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len-- != 0)
+		hash = (hash ^ *p++) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+static uint64_t layout_hash__add_u64(uint64_t hash, uint64_t value)
+{
+	return layout_hash__add(hash, &value, sizeof(value));
+}
+
+static uint64_t layout_hash__add_str(uint64_t hash, const char *s)
+{
+	/* Include the NUL, so that "ab", "c" and "a", "bc" differ */
+	return layout_hash__add(hash, s ?: "", s ? strlen(s) + 1 : 1);
+}
+
+static uint64_t type__layout_hash(const struct type *self, const struct cu *cu,
+				  uint64_t hash)
+{
+	struct class_member *pos;
+
+	hash = layout_hash__add_u64(hash, self->namespace.tag.tag);
+	hash = layout_hash__add_u64(hash, self->size);
+
+	type__for_each_member(self, pos) {
+		struct tag *type = cu__type(cu, pos->tag.type);
+		char bf[1024];
+
+		hash = layout_hash__add_u64(hash, pos->tag.tag);
+		hash = layout_hash__add_str(hash, class_member__name(pos, cu));
+		hash = layout_hash__add_u64(hash, pos->byte_offset);
+		hash = layout_hash__add_u64(hash, pos->byte_size);
+		hash = layout_hash__add_u64(hash, pos->bitfield_offset);
+		hash = layout_hash__add_u64(hash, pos->bitfield_size);
+
+		if (type != NULL && type->tag == DW_TAG_array_type) {
+			const struct array_type *at = tag__array_type(type);
+			int i;
+
+			for (i = 0; i < at->dimensions; ++i)
+				hash = layout_hash__add_u64(hash,
+							    at->nr_entries[i]);
+			type = cu__type(cu, type->type);
+		}
+		/*
+		 * Anonymous structs and unions are spelled the same, look at
+		 * what is inside them.
+		 */
+		if (type != NULL &&
+		    (tag__is_struct(type) || tag__is_union(type)) &&
+		    tag__namespace(type)->name == 0)
+			hash = type__layout_hash(tag__type(type), cu, hash);
+		else
+			hash = layout_hash__add_str(hash, tag__name(type, cu,
+								   bf, sizeof(bf),
+								   NULL));
+	}
+
+	return hash;
+}
+
+/**
+ * class__layout_hash - hash the layout of a struct, class or union
+ * @self: the class
+ * @cu: the cu where @self is
+ *
+ * Looks at the size and at the name, type, offset and size of each data
+ * member, recursing into the anonymous structs and unions used as member
+ * types, but not at the name of the class itself, so that two definitions of
+ * a type found in different cus, possibly built with different settings,
+ * can be compared.
+ */
+uint64_t class__layout_hash(const struct class *self, const struct cu *cu)
+{
+	return type__layout_hash(&self->type, cu, LAYOUT_HASH__INIT);
+}
+
 static void lexblock__account_inline_expansions(struct lexblock *self,
 						const struct cu *cu)
 {
@@ -1279,52 +1873,146 @@ void cu__account_inline_expansions(struct cu *self)
 	}
 }
 
-static int list__for_all_tags(struct list_head *self, struct cu *cu,
-			      int (*iterator)(struct tag *tag,
-					      struct cu *cu, void *cookie),
-			      void *cookie)
+/*
+ * Returns the nth list of children of a tag, NULL when there are no more.
+ */
+static struct list_head *tag__children(struct tag *self, int nr)
 {
-	struct tag *pos, *n;
+	if (tag__has_namespace(self)) {
+		struct namespace *space = tag__namespace(self);
 
-	list_for_each_entry_safe_reverse(pos, n, self, node) {
-		if (tag__has_namespace(pos)) {
-			struct namespace *space = tag__namespace(pos);
+		/*
+		 * See comment in type__for_each_enumerator, the
+		 * enumerators (enum entries) are shared, but the
+		 * enumeration tag must be deleted.
+		 *
+		 * vtable functions are already in the class tags list
+		 */
+		return nr == 0 && !space->shared_tags ? &space->tags : NULL;
+	} else if (tag__is_function(self)) {
+		if (nr == 0)
+			return &tag__ftype(self)->parms;
+		if (nr == 1)
+			return &tag__function(self)->lexblock.tags;
+	} else if (self->tag == DW_TAG_subroutine_type) {
+		if (nr == 0)
+			return &tag__ftype(self)->parms;
+	} else if (self->tag == DW_TAG_lexical_block) {
+		if (nr == 0)
+			return &tag__lexblock(self)->tags;
+	}
 
-			/*
-			 * See comment in type__for_each_enumerator, the
-			 * enumerators (enum entries) are shared, but the
-			 * enumeration tag must be deleted.
-			 */
-			if (!space->shared_tags &&
-			    list__for_all_tags(&space->tags, cu,
-					       iterator, cookie))
-				return 1;
-			/*
-			 * vtable functions are already in the class tags list
-			 */
-		} else if (tag__is_function(pos)) {
-			if (list__for_all_tags(&tag__ftype(pos)->parms,
-					       cu, iterator, cookie))
-				return 1;
-			if (list__for_all_tags(&tag__function(pos)->lexblock.tags,
-					       cu, iterator, cookie))
-				return 1;
-		} else if (pos->tag == DW_TAG_subroutine_type) {
-			if (list__for_all_tags(&tag__ftype(pos)->parms,
-					       cu, iterator, cookie))
-				return 1;
-		} else if (pos->tag == DW_TAG_lexical_block) {
-			if (list__for_all_tags(&tag__lexblock(pos)->tags,
-					       cu, iterator, cookie))
-				return 1;
+	return NULL;
+}
+
+/** struct tag_walk_frame - a list being walked by tag_walk__run
+ *
+ * @head - where to stop
+ * @pos - current tag
+ * @next - the one after it, saved so that the iterator can delete @pos
+ * @nr_children - how many of the lists of children of @pos were pushed
+ */
+struct tag_walk_frame {
+	struct list_head *head;
+	struct list_head *pos;
+	struct list_head *next;
+	int		 nr_children;
+};
+
+struct tag_walk {
+	struct tag_walk_frame *frames;
+	uint32_t	      nr_frames;
+	uint32_t	      allocated_frames;
+};
+
+static int tag_walk__push(struct tag_walk *self, struct list_head *head,
+			  struct list_head *pos)
+{
+	struct tag_walk_frame *frame;
+
+	if (self->nr_frames == self->allocated_frames) {
+		uint32_t allocated_frames = self->allocated_frames + 64;
+		void *frames = realloc(self->frames,
+				       sizeof(*frame) * allocated_frames);
+		if (frames == NULL)
+			return -ENOMEM;
+
+		self->allocated_frames = allocated_frames;
+		self->frames = frames;
+	}
+
+	frame = &self->frames[self->nr_frames++];
+	frame->head	   = head;
+	frame->pos	   = pos;
+	frame->next	   = pos->prev;
+	frame->nr_children = 0;
+	return 0;
+}
+
+/*
+ * Walks the tags using an explicit stack instead of recursing, so that deeply
+ * nested C++ namespaces/classes or lexblocks can't overflow the C stack.
+ *
+ * The lists are walked backwards and the children are visited before their
+ * parent, so that the iterator can delete the tags it is passed, this is what
+ * cu__for_all_tags has always done.
+ *
+ * Returns 1 if the iterator asked to stop, -ENOMEM or 0 otherwise.
+ */
+static int tag_walk__run(struct tag_walk *self, struct cu *cu,
+			 int (*iterator)(struct tag *tag,
+					 struct cu *cu, void *cookie),
+			 void *cookie)
+{
+	while (self->nr_frames != 0) {
+		struct tag_walk_frame *frame = &self->frames[self->nr_frames - 1];
+		struct list_head *children;
+		struct tag *pos;
+
+		if (frame->pos == frame->head) {
+			--self->nr_frames;
+			continue;
+		}
+
+		pos = list_entry(frame->pos, struct tag, node);
+		children = tag__children(pos, frame->nr_children++);
+		if (children != NULL) {
+			if (list_empty(children))
+				continue;
+			if (tag_walk__push(self, children, children->prev))
+				return -ENOMEM;
+			continue;
 		}
 
+		frame->pos = frame->next;
+		frame->next = frame->pos->prev;
+		frame->nr_children = 0;
+
 		if (iterator(pos, cu, cookie))
 			return 1;
 	}
+
 	return 0;
 }
 
+static int list__for_all_tags(struct list_head *self, struct cu *cu,
+			      int (*iterator)(struct tag *tag,
+					      struct cu *cu, void *cookie),
+			      void *cookie)
+{
+	struct tag_walk walk = { .frames = NULL, };
+	int err = 0;
+
+	if (!list_empty(self)) {
+		err = tag_walk__push(&walk, self, self->prev);
+		if (err == 0)
+			err = tag_walk__run(&walk, cu, iterator, cookie);
+	}
+
+	free(walk.frames);
+	return err;
+}
+
 int cu__for_all_tags(struct cu *self,
 		     int (*iterator)(struct tag *tag,
 				     struct cu *cu, void *cookie),
@@ -1333,6 +2021,264 @@ int cu__for_all_tags(struct cu *self,
 	return list__for_all_tags(&self->tags, self, iterator, cookie);
 }
 
+static void type_refs__add(struct type_refs *self, const uint16_t type,
+			   struct tag *from, struct tag *owner, uint32_t id)
+{
+	struct type_ref *ref;
+
+	if (type == 0 || type >= self->nr_types)
+		return;
+	/*
+	 * First pass, just count how many references each type has
+	 */
+	if (self->entries == NULL) {
+		++self->first[type + 1];
+		return;
+	}
+
+	ref = &self->entries[self->first[type]++];
+	ref->from  = from;
+	ref->owner = owner;
+	ref->id	   = id;
+}
+
+static void ftype__add_type_refs(struct ftype *self, struct type_refs *refs,
+				 uint32_t id)
+{
+	struct parameter *pos;
+
+	ftype__for_each_parameter(self, pos)
+		type_refs__add(refs, pos->tag.type, &pos->tag, &self->tag, id);
+}
+
+static void cu__add_type_refs(struct cu *self, struct type_refs *refs)
+{
+	struct function *function;
+	struct tag *pos;
+	uint32_t function_id;
+	uint16_t id;
+
+	cu__for_each_type(self, id, pos) {
+		if (tag__is_struct(pos) || tag__is_union(pos)) {
+			struct class_member *member;
+
+			type__for_each_member(tag__type(pos), member)
+				type_refs__add(refs, member->tag.type,
+					       &member->tag, pos, id);
+			continue;
+		}
+
+		if (tag__is_enumeration(pos))
+			continue;
+
+		if (pos->tag == DW_TAG_subroutine_type)
+			ftype__add_type_refs(tag__ftype(pos), refs, id);
+
+		type_refs__add(refs, pos->type, pos, NULL, id);
+	}
+
+	cu__for_each_function(self, function_id, function)
+		ftype__add_type_refs(&function->proto, refs, function_id);
+}
+
+/*
+ * Build, in two passes over the types and functions tables, the index of
+ * who references each type: the structs and unions that have it as a member
+ * (containers), the pointers, typedefs and other types that refer to it, and
+ * the functions and subroutine types that have it as a parameter.
+ */
+int cu__build_type_refs(struct cu *self)
+{
+	struct type_refs *refs;
+	uint32_t i;
+
+	if (self->type_refs != NULL)
+		return 0;
+
+	refs = zalloc(sizeof(*refs));
+	if (refs == NULL)
+		return -ENOMEM;
+
+	refs->nr_types = self->types_table.nr_entries;
+	refs->first = zalloc((refs->nr_types + 1) * sizeof(uint32_t));
+	if (refs->first == NULL)
+		goto out_free;
+
+	cu__add_type_refs(self, refs);
+
+	for (i = 1; i <= refs->nr_types; ++i)
+		refs->first[i] += refs->first[i - 1];
+
+	refs->nr_entries = refs->first[refs->nr_types];
+	refs->entries = malloc((refs->nr_entries ?: 1) *
+			       sizeof(struct type_ref));
+	if (refs->entries == NULL)
+		goto out_free_first;
+
+	cu__add_type_refs(self, refs);
+	/*
+	 * The second pass left first[N] pointing to where the references
+	 * to N + 1 start, shift it back.
+	 */
+	for (i = refs->nr_types; i > 0; --i)
+		refs->first[i] = refs->first[i - 1];
+	refs->first[0] = 0;
+
+	self->type_refs = refs;
+	return 0;
+out_free_first:
+	free(refs->first);
+out_free:
+	free(refs);
+	return -ENOMEM;
+}
+
+void cu__delete_type_refs(struct cu *self)
+{
+	struct type_refs *refs = self->type_refs;
+
+	if (refs != NULL) {
+		free(refs->methods);
+		free(refs->methods_first);
+		free(refs->entries);
+		free(refs->first);
+		free(refs);
+		self->type_refs = NULL;
+	}
+}
+
+struct type_ref *cu__type_refs(struct cu *self, const uint16_t type,
+			       struct type_ref **end)
+{
+	struct type_refs *refs;
+
+	*end = NULL;
+	if (cu__build_type_refs(self) != 0)
+		return NULL;
+
+	refs = self->type_refs;
+	if (type == 0 || type >= refs->nr_types)
+		return NULL;
+
+	*end = refs->entries + refs->first[type + 1];
+	return refs->entries + refs->first[type];
+}
+
+/*
+ * Called for each type in two passes, the first counting the methods for
+ * @type, the second filling them. @last is indexed by function id and has,
+ * in the first pass, the last type the function was counted for and, in the
+ * second, the index + 1 of the last methods entry it got.
+ */
+static void type_refs__add_methods(struct type_refs *self, uint32_t *last,
+				   const uint16_t type)
+{
+	const uint32_t start = self->methods_first[type];
+	struct type_ref *pointer = self->entries + self->first[type],
+			*pointers_end = self->entries + self->first[type + 1];
+
+	for (; pointer != pointers_end; ++pointer) {
+		struct type_ref *ref, *end;
+
+		if (pointer->from->tag != DW_TAG_pointer_type)
+			continue;
+
+		ref = self->entries + self->first[pointer->id];
+		end = self->entries + self->first[pointer->id + 1];
+
+		for (; ref != end; ++ref) {
+			struct method_ref *method;
+			uint32_t idx;
+
+			if (ref->owner == NULL || !tag__is_function(ref->owner))
+				continue;
+
+			if (self->methods == NULL) {
+				if (last[ref->id] != type) {
+					last[ref->id] = type;
+					++self->methods_first[type + 1];
+				}
+				continue;
+			}
+
+			if (last[ref->id] > start) {
+				++self->methods[last[ref->id] - 1].nr_parms;
+				continue;
+			}
+
+			idx = self->methods_first[type]++;
+			method = &self->methods[idx];
+			method->function = tag__function(ref->owner);
+			method->id	 = ref->id;
+			method->nr_parms = 1;
+			last[ref->id] = idx + 1;
+		}
+	}
+}
+
+static int type_refs__build_methods(struct type_refs *self, struct cu *cu)
+{
+	const uint32_t nr_functions = cu->functions_table.nr_entries;
+	uint32_t *last = zalloc((nr_functions ?: 1) * sizeof(uint32_t));
+	uint32_t i, nr_methods;
+
+	if (last == NULL)
+		return -ENOMEM;
+
+	self->methods_first = zalloc((self->nr_types + 1) * sizeof(uint32_t));
+	if (self->methods_first == NULL)
+		goto out_free_last;
+
+	for (i = 1; i < self->nr_types; ++i)
+		type_refs__add_methods(self, last, i);
+
+	for (i = 1; i <= self->nr_types; ++i)
+		self->methods_first[i] += self->methods_first[i - 1];
+
+	nr_methods = self->methods_first[self->nr_types];
+	self->methods = malloc((nr_methods ?: 1) * sizeof(struct method_ref));
+	if (self->methods == NULL)
+		goto out_free_methods_first;
+
+	memset(last, 0, (nr_functions ?: 1) * sizeof(uint32_t));
+	for (i = 1; i < self->nr_types; ++i)
+		type_refs__add_methods(self, last, i);
+
+	for (i = self->nr_types; i > 0; --i)
+		self->methods_first[i] = self->methods_first[i - 1];
+	self->methods_first[0] = 0;
+
+	free(last);
+	return 0;
+out_free_methods_first:
+	free(self->methods_first);
+	self->methods_first = NULL;
+out_free_last:
+	free(last);
+	return -ENOMEM;
+}
+
+struct method_ref *cu__methods(struct cu *self, const uint16_t type,
+			       struct method_ref **end)
+{
+	struct type_refs *refs;
+
+	*end = NULL;
+	if (cu__build_type_refs(self) != 0)
+		return NULL;
+
+	refs = self->type_refs;
+	if (refs->methods == NULL &&
+	    type_refs__build_methods(refs, self) != 0)
+		return NULL;
+
+	if (type == 0 || type >= refs->nr_types)
+		return NULL;
+
+	*end = refs->methods + refs->methods_first[type + 1];
+	return refs->methods + refs->methods_first[type];
+}
+
 void cus__for_each_cu(struct cus *self,
 		      int (*iterator)(struct cu *cu, void *cookie),
 		      void *cookie,
@@ -1352,6 +2298,537 @@ void cus__for_each_cu(struct cus *self,
 	}
 }
 
+struct cu_job {
+	struct cu *cu;
+	char	  *output;
+	size_t	  output_size;
+	void	  *priv;
+	int	  ret;
+	bool	  done;
+};
+
+/*
+ * Each worker starts with a contiguous range of jobs, taking them from the
+ * head, when it runs out of work it steals from the tail of the others.
+ */
+struct cu_job_queue {
+	pthread_mutex_t lock;
+	uint32_t	head;
+	uint32_t	tail;
+};
+
+struct cus_parallel {
+	struct cu_job	    *jobs;
+	uint32_t	    nr_jobs;
+	struct cu_job_queue *queues;
+	int		    nr_queues;
+	pthread_mutex_t	    flush_lock;
+	uint32_t	    next_flush;
+	int		    stop;	/* only touched with flush_lock held */
+	int		    ret;
+	int		    (*iterator)(struct cu *cu, void *cookie,
+					FILE *fp, void **priv);
+	int		    (*merge)(struct cu *cu, void *cookie, void *priv);
+	void		    *cookie;
+	FILE		    *fp;
+};
+
+struct cus_parallel_worker {
+	pthread_t	   thread;
+	struct cus_parallel *parallel;
+	int		   nr;
+};
+
+static struct cu_job *cus_parallel__get_job(struct cus_parallel *self, int nr)
+{
+	struct cu_job_queue *queue = &self->queues[nr];
+	struct cu_job *job = NULL;
+	int i;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head < queue->tail)
+		job = &self->jobs[queue->head++];
+	pthread_mutex_unlock(&queue->lock);
+
+	for (i = 1; job == NULL && i < self->nr_queues; ++i) {
+		queue = &self->queues[(nr + i) % self->nr_queues];
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head < queue->tail)
+			job = &self->jobs[--queue->tail];
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	return job;
+}
+
+/*
+ * Writes the output and calls ->merge for all the jobs that are done and
+ * have all the ones before them done as well.
+ */
+static void cus_parallel__flush(struct cus_parallel *self)
+{
+	while (self->next_flush < self->nr_jobs && !self->stop) {
+		struct cu_job *job = &self->jobs[self->next_flush];
+
+		if (!job->done)
+			break;
+
+		++self->next_flush;
+		if (job->output_size != 0 &&
+		    fwrite(job->output, job->output_size, 1, self->fp) != 1)
+			job->ret = -errno ?: -EIO;
+		free(job->output);
+		job->output = NULL;
+
+		if (job->ret == 0 && self->merge != NULL)
+			job->ret = self->merge(job->cu, self->cookie, job->priv);
+
+		if (job->ret != 0) {
+			self->ret = job->ret;
+			self->stop = 1;
+		}
+	}
+}
+
+static void *cus_parallel__worker(void *arg)
+{
+	struct cus_parallel_worker *self = arg;
+	struct cus_parallel *parallel = self->parallel;
+	struct cu_job *job;
+	int stop = 0;
+
+	while (!stop &&
+	       (job = cus_parallel__get_job(parallel, self->nr)) != NULL) {
+		FILE *fp = NULL;
+
+		if (parallel->fp != NULL) {
+			fp = open_memstream(&job->output, &job->output_size);
+			if (fp == NULL)
+				job->ret = -ENOMEM;
+		}
+
+		if (job->ret == 0)
+			job->ret = parallel->iterator(job->cu, parallel->cookie,
+						      fp, &job->priv);
+		if (fp != NULL)
+			fclose(fp);
+
+		pthread_mutex_lock(&parallel->flush_lock);
+		job->done = true;
+		cus_parallel__flush(parallel);
+		stop = parallel->stop;
+		pthread_mutex_unlock(&parallel->flush_lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * cus__for_each_cu_parallel - run an iterator over the cus using several threads
+ * @self: struct cus instance
+ * @nr_threads: number of worker threads, <= 0 means one per online CPU
+ * @iterator: called from a worker thread for each cu, @fp is a per cu
+ *	      in-memory stream, NULL if @fp is NULL, and @priv can be used to
+ *	      pass a per cu result to @merge
+ * @merge: called, one at a time and in cu order, after @iterator is done for
+ *	   a cu and for all the ones before it, can be NULL
+ * @cookie: passed to @iterator and @merge
+ * @fp: where the per cu output is written, in cu order
+ * @filter: same as in cus__for_each_cu
+ *
+ * A non zero return from @iterator or @merge stops the walk after that cu: the
+ * output for the cus that come after it is discarded and @merge is not called
+ * for them, i.e. the output is the same as with the sequential version.
+ *
+ * While the iterators run the core data structures are shared without
+ * locking, so @iterator can change the cu it is passed and its tags, but must
+ * treat the other cus as read only, without calling, on them, the functions
+ * that build indexes on first use (cu__type_refs, cu__methods,
+ * cu__find_first_typedef_of_type, tag__size, tag__follow_typedef, tag__name)
+ * or compute the class layout on first use (class__find_holes,
+ * class__fprintf): build them before, if needed, for instance with
+ * cu__find_class_holes, cu__resolve_types and cu__format_type_names. State
+ * shared by all cus, such as tool wide lists and trees, must only be touched
+ * from @merge.
+ *
+ * Returns what @iterator or @merge returned when stopping the walk, 0 if all
+ * cus were processed or a negative errno if it couldn't get started.
+ */
+int cus__for_each_cu_parallel(struct cus *self, int nr_threads,
+			      int (*iterator)(struct cu *cu, void *cookie,
+					      FILE *fp, void **priv),
+			      int (*merge)(struct cu *cu, void *cookie,
+					   void *priv),
+			      void *cookie, FILE *fp,
+			      struct cu *(*filter)(struct cu *cu))
+{
+	struct cus_parallel parallel = {
+		.iterator = iterator,
+		.merge	  = merge,
+		.cookie	  = cookie,
+		.fp	  = fp,
+	};
+	struct cus_parallel_worker *workers = NULL;
+	int i, nr_started = 0, err = -ENOMEM;
+	uint32_t nr_jobs = 0, start;
+	struct cu *pos;
+
+	list_for_each_entry(pos, &self->cus, node)
+		++nr_jobs;
+
+	if (nr_jobs == 0)
+		return 0;
+
+	parallel.jobs = zalloc(sizeof(struct cu_job) * nr_jobs);
+	if (parallel.jobs == NULL)
+		goto out;
+
+	list_for_each_entry(pos, &self->cus, node) {
+		struct cu *cu = pos;
+
+		if (filter != NULL) {
+			cu = filter(pos);
+			if (cu == NULL)
+				continue;
+		}
+		parallel.jobs[parallel.nr_jobs++].cu = cu;
+	}
+
+	if (nr_threads <= 0)
+		nr_threads = nr_cpus_online();
+	if ((uint32_t)nr_threads > parallel.nr_jobs)
+		nr_threads = parallel.nr_jobs ?: 1;
+
+	parallel.queues = zalloc(sizeof(struct cu_job_queue) * nr_threads);
+	workers = zalloc(sizeof(struct cus_parallel_worker) * nr_threads);
+	if (parallel.queues == NULL || workers == NULL)
+		goto out_free;
+
+	parallel.nr_queues = nr_threads;
+	pthread_mutex_init(&parallel.flush_lock, NULL);
+	for (i = 0, start = 0; i < nr_threads; ++i) {
+		struct cu_job_queue *queue = &parallel.queues[i];
+
+		pthread_mutex_init(&queue->lock, NULL);
+		queue->head = start;
+		start += parallel.nr_jobs / nr_threads +
+			 ((uint32_t)i < parallel.nr_jobs % nr_threads);
+		queue->tail = start;
+	}
+
+	for (i = 0; i < nr_threads; ++i) {
+		workers[i].parallel = &parallel;
+		workers[i].nr	    = i;
+		/* The ones started will steal the jobs of the others */
+		if (pthread_create(&workers[i].thread, NULL,
+				   cus_parallel__worker, &workers[i]) != 0)
+			break;
+		++nr_started;
+	}
+
+	if (nr_started == 0)
+		cus_parallel__worker(&workers[0]);
+
+	for (i = 0; i < nr_started; ++i)
+		pthread_join(workers[i].thread, NULL);
+
+	err = parallel.ret;
+
+	for (i = 0; i < nr_threads; ++i)
+		pthread_mutex_destroy(&parallel.queues[i].lock);
+	pthread_mutex_destroy(&parallel.flush_lock);
+	for (start = 0; start < parallel.nr_jobs; ++start)
+		free(parallel.jobs[start].output);
+out_free:
+	free(workers);
+	free(parallel.queues);
+	free(parallel.jobs);
+out:
+	return err;
+}
+
+struct cu_pipeline_job {
+	struct cu *cu;
+	void	  *priv;
+	int	  ret;
+	bool	  done;
+};
+
+struct cu_pipeline {
+	pthread_mutex_t	       lock;
+	pthread_cond_t	       work;	/* job added or closing */
+	pthread_cond_t	       room;	/* a job was merged */
+	pthread_mutex_t	       merge_lock;
+	struct cu_pipeline_job *jobs;	/* ring of max_pending jobs */
+	uint32_t	       max_pending;
+	uint32_t	       nr_added;
+	uint32_t	       next_job;
+	uint32_t	       next_merge;
+	bool		       closing;
+	int		       stop;	/* only touched with lock held */
+	int		       ret;
+	int		       nr_threads;
+	pthread_t	       *threads;
+	int		       (*iterator)(struct cu *cu, uint32_t nr,
+					   void *cookie, void **priv);
+	int		       (*merge)(void *cookie, void *priv);
+	void		       (*priv__delete)(void *priv);
+	void		       *cookie;
+};
+
+static struct cu_pipeline_job *cu_pipeline__job(struct cu_pipeline *self,
+						uint32_t nr)
+{
+	return &self->jobs[nr % self->max_pending];
+}
+
+/*
+ * Calls ->merge for the jobs that are done and have all the ones before
+ * them merged, one thread at a time.
+ */
+static void cu_pipeline__merge(struct cu_pipeline *self)
+{
+	pthread_mutex_lock(&self->merge_lock);
+
+	for (;;) {
+		struct cu_pipeline_job *job = NULL;
+		int stop;
+
+		pthread_mutex_lock(&self->lock);
+		if (self->next_merge != self->nr_added &&
+		    cu_pipeline__job(self, self->next_merge)->done)
+			job = cu_pipeline__job(self, self->next_merge);
+		stop = self->stop;
+		pthread_mutex_unlock(&self->lock);
+
+		if (job == NULL)
+			break;
+
+		if (!stop && job->ret == 0 && self->merge != NULL)
+			job->ret = self->merge(self->cookie, job->priv);
+		else if (job->priv != NULL && self->priv__delete != NULL)
+			self->priv__delete(job->priv);
+
+		pthread_mutex_lock(&self->lock);
+		if (job->ret != 0 && !self->stop) {
+			self->ret  = job->ret;
+			self->stop = 1;
+			pthread_cond_broadcast(&self->work);
+		}
+		job->done = false;
+		++self->next_merge;
+		pthread_cond_broadcast(&self->room);
+		pthread_mutex_unlock(&self->lock);
+	}
+
+	pthread_mutex_unlock(&self->merge_lock);
+}
+
+static void cu_pipeline__run_job(struct cu_pipeline *self,
+				 struct cu_pipeline_job *job, uint32_t nr)
+{
+	int stop;
+
+	pthread_mutex_lock(&self->lock);
+	stop = self->stop;
+	pthread_mutex_unlock(&self->lock);
+
+	if (!stop)
+		job->ret = self->iterator(job->cu, nr, self->cookie,
+					  &job->priv);
+	cu__delete(job->cu);
+	job->cu = NULL;
+
+	pthread_mutex_lock(&self->lock);
+	job->done = true;
+	pthread_mutex_unlock(&self->lock);
+
+	cu_pipeline__merge(self);
+}
+
+static void *cu_pipeline__worker(void *arg)
+{
+	struct cu_pipeline *self = arg;
+
+	pthread_mutex_lock(&self->lock);
+	for (;;) {
+		struct cu_pipeline_job *job;
+		uint32_t nr;
+
+		while (self->next_job == self->nr_added && !self->closing)
+			pthread_cond_wait(&self->work, &self->lock);
+
+		if (self->next_job == self->nr_added)
+			break;
+
+		nr  = self->next_job++;
+		job = cu_pipeline__job(self, nr);
+		pthread_mutex_unlock(&self->lock);
+		cu_pipeline__run_job(self, job, nr);
+		pthread_mutex_lock(&self->lock);
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+/**
+ * cu_pipeline__new - process cus in worker threads while others are loaded
+ * @nr_threads: number of worker threads, <= 0 means one per online CPU
+ * @iterator: called from a worker thread for each cu added, @nr is the order
+ *	      in which it was added, @priv can be used to pass a per cu result
+ *	      to @merge
+ * @merge: called, one at a time and in the order the cus were added, after
+ *	   @iterator is done for a cu and for all the ones before it
+ * @priv__delete: releases what @iterator left in @priv for the cus that
+ *		  don't get to @merge, can be NULL
+ * @cookie: passed to @iterator and @merge
+ * @max_pending: how many cus can be in the pipeline, cu_pipeline__add waits
+ *		 for @merge to be done with the oldest after that, 0 means
+ *		 four per worker thread
+ *
+ * The streaming counterpart of cus__for_each_cu_parallel, for loaders
+ * stealers: the cus are handed to cu_pipeline__add as they are loaded and
+ * the pipeline owns them from then on, deleting each one after @iterator is
+ * done with it. While @iterator runs no cu is shared with other threads, but
+ * for the strings table, see conf_load->threaded_steal, and state shared by
+ * all cus, such as tool wide lists and trees, that has to be locked or only
+ * touched from @merge.
+ *
+ * A non zero return from @iterator or @merge stops the pipeline after that
+ * cu, i.e. @merge is not called for the cus after it, as in the sequential
+ * version.
+ *
+ * Returns NULL if it couldn't get started. If no thread could be created the
+ * cus are processed in the caller.
+ */
+struct cu_pipeline *cu_pipeline__new(int nr_threads,
+				     int (*iterator)(struct cu *cu,
+						     uint32_t nr, void *cookie,
+						     void **priv),
+				     int (*merge)(void *cookie, void *priv),
+				     void (*priv__delete)(void *priv),
+				     void *cookie, uint32_t max_pending)
+{
+	struct cu_pipeline *self = zalloc(sizeof(*self));
+	int i;
+
+	if (self == NULL)
+		return NULL;
+
+	if (nr_threads <= 0)
+		nr_threads = nr_cpus_online();
+	if (max_pending == 0)
+		max_pending = nr_threads * 4;
+
+	self->iterator	   = iterator;
+	self->merge	   = merge;
+	self->priv__delete = priv__delete;
+	self->cookie	   = cookie;
+	self->max_pending  = max_pending;
+	self->jobs	   = zalloc(sizeof(*self->jobs) * max_pending);
+	self->threads	   = zalloc(sizeof(*self->threads) * nr_threads);
+	if (self->jobs == NULL || self->threads == NULL)
+		goto out_free;
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_mutex_init(&self->merge_lock, NULL);
+	pthread_cond_init(&self->work, NULL);
+	pthread_cond_init(&self->room, NULL);
+
+	for (i = 0; i < nr_threads; ++i) {
+		if (pthread_create(&self->threads[i], NULL,
+				   cu_pipeline__worker, self) != 0)
+			break;
+		++self->nr_threads;
+	}
+
+	return self;
+out_free:
+	free(self->threads);
+	free(self->jobs);
+	free(self);
+	return NULL;
+}
+
+/**
+ * cu_pipeline__add - queue a cu for the pipeline worker threads
+ * @self: the pipeline
+ * @cu: the cu, owned by the pipeline from now on
+ *
+ * Waits if there are already max_pending cus in the pipeline.
+ *
+ * Returns 0 or, if the pipeline was stopped, what stopped it, in which case
+ * @cu is just deleted.
+ */
+int cu_pipeline__add(struct cu_pipeline *self, struct cu *cu)
+{
+	struct cu_pipeline_job *job;
+	uint32_t nr;
+	int ret;
+
+	pthread_mutex_lock(&self->lock);
+	while (!self->stop &&
+	       self->nr_added - self->next_merge == self->max_pending)
+		pthread_cond_wait(&self->room, &self->lock);
+
+	ret = self->ret;
+	if (self->stop) {
+		pthread_mutex_unlock(&self->lock);
+		cu__delete(cu);
+		return ret;
+	}
+
+	nr	  = self->nr_added++;
+	job	  = cu_pipeline__job(self, nr);
+	job->cu	  = cu;
+	job->priv = NULL;
+	job->ret  = 0;
+	job->done = false;
+	if (self->nr_threads != 0) {
+		pthread_cond_signal(&self->work);
+		pthread_mutex_unlock(&self->lock);
+		return 0;
+	}
+
+	self->next_job = self->nr_added;
+	pthread_mutex_unlock(&self->lock);
+	cu_pipeline__run_job(self, job, nr);
+	return self->ret;
+}
+
+/**
+ * cu_pipeline__delete - wait for the cus in the pipeline and release it
+ * @self: the pipeline
+ *
+ * Returns what @iterator or @merge returned when stopping the pipeline, 0 if
+ * all cus were processed.
+ */
+int cu_pipeline__delete(struct cu_pipeline *self)
+{
+	int i, ret;
+
+	pthread_mutex_lock(&self->lock);
+	self->closing = true;
+	pthread_cond_broadcast(&self->work);
+	pthread_mutex_unlock(&self->lock);
+
+	for (i = 0; i < self->nr_threads; ++i)
+		pthread_join(self->threads[i], NULL);
+
+	cu_pipeline__merge(self);
+	ret = self->ret;
+
+	pthread_cond_destroy(&self->room);
+	pthread_cond_destroy(&self->work);
+	pthread_mutex_destroy(&self->merge_lock);
+	pthread_mutex_destroy(&self->lock);
+	free(self->threads);
+	free(self->jobs);
+	free(self);
+	return ret;
+}
+
 int cus__load_dir(struct cus *self, struct conf_load *conf,
 		  const char *dirname, const char *filename_mask,
 		  const int recursive)
@@ -1404,10 +2881,14 @@ out:
 /*
  * This should really do demand loading of DSOs, STABS anyone? 8-)
  */
-extern struct debug_fmt_ops dwarf__ops, ctf__ops;
+extern struct debug_fmt_ops dwarf__ops, ctf__ops, snapshot__ops;
 
+/*
+ * snapshot before ctf, that complains about files that are not ELF
+ */
 static struct debug_fmt_ops *debug_fmt_table[] = {
 	&dwarf__ops,
+	&snapshot__ops,
 	&ctf__ops,
 	NULL,
 };
@@ -1487,8 +2968,14 @@ struct cus *cus__new(void)
 {
 	struct cus *self = malloc(sizeof(*self));
 
-	if (self != NULL)
+	if (self != NULL) {
 		INIT_LIST_HEAD(&self->cus);
+		self->arena = arena__new();
+		if (self->arena == NULL) {
+			free(self);
+			self = NULL;
+		}
+	}
 
 	return self;
 }
@@ -1505,6 +2992,7 @@ void cus__delete(struct cus *self)
 		cu__delete(pos);
 	}
 
+	arena__delete(self->arena);
 	free(self);
 }
 
@@ -16,6 +16,7 @@
 #include <dwarf.h>
 #include <elfutils/libdwfl.h>
 
+#include "arena.h"
 #include "dutil.h"
 #include "list.h"
 #include "rbtree.h"
@@ -43,16 +44,25 @@ struct conf_load {
 	bool			extra_dbg_info;
 	bool			fixup_silly_bitfields;
 	bool			get_addr_info;
+	bool			threaded_steal;
 };
 
+struct class_member;
+
 /** struct conf_fprintf - hints to the __fprintf routines
  *
+ * @member_annotate - called after each member of a struct is printed, not for
+ *		      the ones of the types expanded inline in it, to add e.g.
+ *		      a comment with profiling data, gets @annotate_priv
  * @flat_arrays - a->foo[10][2] becomes a->foo[20]
  * @classes_as_structs - class f becomes struct f, CTF doesn't have a "class"
  */
 struct conf_fprintf {
 	const char *prefix;
 	const char *suffix;
+	size_t	   (*member_annotate)(const struct class_member *member,
+				      void *priv, FILE *fp);
+	void	   *annotate_priv;
 	int32_t	   type_spacing;
 	int32_t	   name_spacing;
 	uint32_t   base_offset;
@@ -75,6 +85,7 @@ struct conf_fprintf {
 
 struct cus {
 	struct list_head      cus;
+	struct arena	      *arena;
 };
 
 struct cus *cus__new(void);
@@ -100,6 +111,25 @@ void cus__for_each_cu(struct cus *self, int (*iterator)(struct cu *cu,
 							void *cookie),
 		      void *cookie,
 		      struct cu *(*filter)(struct cu *cu));
+int cus__for_each_cu_parallel(struct cus *self, int nr_threads,
+			      int (*iterator)(struct cu *cu, void *cookie,
+					      FILE *fp, void **priv),
+			      int (*merge)(struct cu *cu, void *cookie,
+					   void *priv),
+			      void *cookie, FILE *fp,
+			      struct cu *(*filter)(struct cu *cu));
+
+struct cu_pipeline;
+
+struct cu_pipeline *cu_pipeline__new(int nr_threads,
+				     int (*iterator)(struct cu *cu,
+						     uint32_t nr, void *cookie,
+						     void **priv),
+				     int (*merge)(void *cookie, void *priv),
+				     void (*priv__delete)(void *priv),
+				     void *cookie, uint32_t max_pending);
+int cu_pipeline__add(struct cu_pipeline *self, struct cu *cu);
+int cu_pipeline__delete(struct cu_pipeline *self);
 
 struct ptr_table {
 	void	 **entries;
@@ -107,10 +137,37 @@ struct ptr_table {
 	uint32_t allocated_entries;
 };
 
+enum type_kind {
+	TYPE_KIND__STRUCT,
+	TYPE_KIND__UNION,
+	TYPE_KIND__ENUMERATION,
+	TYPE_KIND__TYPEDEF,
+	TYPE_KIND__BASE,
+	TYPE_KIND__POINTER,
+	TYPE_KIND__ARRAY,
+	TYPE_KIND__SUBROUTINE,
+	TYPE_KIND__OTHER,
+	TYPE_KIND__NR,
+};
+
+/** struct type_id_list - ids of the types of a kind, in the order added
+ *
+ * @first - first id, 0 if there are none, the next ones are linked thru
+ *	    cu->types_next
+ * @last - last id, where the next one will be linked
+ */
+struct type_id_list {
+	uint16_t first;
+	uint16_t last;
+	uint32_t nr_entries;
+};
+
+struct expanded_type;
 struct function;
 struct tag;
 struct cu;
 struct variable;
+struct type_refs;
 
 /* Same as DW_LANG, so that we don't have to include dwarf.h in CTF */
 enum dwarf_languages {
@@ -172,6 +229,43 @@ struct debug_fmt_ops {
 	void		   (*cu__delete)(struct cu *self);
 };
 
+/** struct resolved_type - cached results of lookups on a type id
+ * @size: tag__size for the type
+ * @canonical: id tag__follow_typedef returns for tags with this type
+ * @generation: entry valid only if equal to cu->resolved_types_generation
+ */
+struct resolved_type {
+	size_t	 size;
+	uint32_t generation;
+	uint16_t canonical;
+	uint8_t	 has_size:1;
+	uint8_t	 has_canonical:1;
+};
+
+/** struct function_addr - address range of a function, see cu__sort_functions
+ * @low: lexblock.ip.addr of the function
+ * @size: lexblock.size of the function
+ * @id: the function slot in cu->functions_table
+ */
+struct function_addr {
+	uint64_t low;
+	uint32_t size;
+	uint32_t id;
+};
+
+/** struct type_name - a type spelled by tag__name, interned per cu
+ * @tag: the type
+ * @name: how it is spelled, malloc'ed
+ * @len: strlen(@name)
+ * @flags: TYPE_NAME__ bits for the conf_fprintf options used to spell it
+ */
+struct type_name {
+	const struct tag *tag;
+	const char	 *name;
+	uint32_t	 len;
+	uint32_t	 flags;
+};
+
 struct cu {
 	struct list_head node;
 	struct list_head tags;
@@ -179,7 +273,28 @@ struct cu {
 	struct ptr_table types_table;
 	struct ptr_table functions_table;
 	struct ptr_table tags_table;
+	struct ptr_table tags_priv;
+	struct type_id_list types_by_kind[TYPE_KIND__NR];
+	uint16_t	 *types_next;
+	uint32_t	 allocated_types_next;
+	uint16_t	 *first_typedef_of;
+	uint32_t	 nr_first_typedef_of;
+	struct resolved_type *resolved_types;
+	uint32_t	 nr_resolved_types;
+	uint32_t	 resolved_types_generation;
+	struct type_name *type_names;
+	uint32_t	 nr_type_names;
+	uint32_t	 allocated_type_names;
+	uint32_t	 type_names_generation;
+	struct expanded_type **expanded_types;
+	uint32_t	 nr_expanded_types;
+	uint32_t	 nr_expanded_buckets;
+	uint32_t	 expanded_types_generation;
+	size_t		 expanded_types_bytes;
+	struct function_addr *function_addrs;
+	uint32_t	 nr_function_addrs;
 	struct rb_root	 functions;
+	struct type_refs *type_refs;
 	char		 *name;
 	char		 *filename;
 	void 		 *priv;
@@ -192,6 +307,8 @@ struct cu {
 	uint8_t		 extra_dbg_info:1;
 	uint8_t		 has_addr_info:1;
 	uint8_t		 uses_global_strings:1;
+	uint8_t		 functions_sorted:1;
+	uint8_t		 functions_mutated:1;
 	uint16_t	 language;
 	unsigned long	 nr_inline_expansions;
 	size_t		 size_inline_expansions;
@@ -206,7 +323,7 @@ struct cu {
 
 struct cu *cu__new(const char *name, uint8_t addr_size,
 		   const unsigned char *build_id, int build_id_len,
-		   const char *filename);
+		   const char *filename, struct arena *arena);
 void cu__delete(struct cu *self);
 
 const char *cu__string(const struct cu *self, strings_t s);
@@ -252,6 +369,20 @@ static inline __pure bool cu__is_c_plus_plus(const struct cu *self)
 			continue;				\
 		else
 
+/**
+ * cu__for_each_type_of_kind - iterate thru all the type tags of a kind
+ * @cu: struct cu instance to iterate
+ * @kind: enum type_kind
+ * @id: uint16_t tag id
+ * @pos: struct tag iterator
+ */
+#define cu__for_each_type_of_kind(cu, kind, id, pos)			\
+	for (id = cu->types_by_kind[kind].first; id != 0;		\
+	     id = cu->types_next[id])					\
+		if (!(pos = cu->types_table.entries[id]))		\
+			continue;					\
+		else
+
 /**
  * cu__for_each_struct - iterate thru all the struct tags
  * @cu: struct cu instance to iterate
@@ -259,7 +390,8 @@ static inline __pure bool cu__is_c_plus_plus(const struct cu *self)
  * @id: uint16_t tag id
  */
 #define cu__for_each_struct(cu, id, pos)				\
-	for (id = 1; id < cu->types_table.nr_entries; ++id)		\
+	for (id = cu->types_by_kind[TYPE_KIND__STRUCT].first; id != 0;	\
+	     id = cu->types_next[id])					\
 		if (!(pos = tag__class(cu->types_table.entries[id])) || \
 		    !tag__is_struct(class__tag(pos)))			\
 			continue;					\
@@ -292,7 +424,10 @@ static inline __pure bool cu__is_c_plus_plus(const struct cu *self)
 
 int cu__add_tag(struct cu *self, struct tag *tag, long *id);
 int cu__table_add_tag(struct cu *self, struct tag *tag, long *id);
+int cu__reserve_tables(struct cu *self, uint32_t nr_types, uint32_t nr_tags,
+		       uint32_t nr_functions);
 int cu__table_nullify_type_entry(struct cu *self, uint32_t id);
+int cu__sort_functions(struct cu *self);
 struct tag *cu__find_base_type_by_name(const struct cu *self, const char *name,
 				       uint16_t *id);
 struct tag *cu__find_base_type_by_sname_and_size(const struct cu *self,
@@ -322,20 +457,115 @@ int cu__for_all_tags(struct cu *self,
 				     struct cu *cu, void *cookie),
 		     void *cookie);
 
+/** struct type_ref - a reference to a type, as found in the type_refs index
+ *
+ * @from - the referencing tag: a struct/union member or inheritance entry,
+ *	   a type (pointer, typedef, array, const, etc) or a parameter
+ * @owner - the struct/union for members, the function or subroutine type
+ *	    for parameters, NULL when @from is a type
+ * @id - the id of @owner in the functions_table for function parameters,
+ *	 in the types_table for everything else (@from when @owner is NULL)
+ */
+struct type_ref {
+	struct tag *from;
+	struct tag *owner;
+	uint32_t   id;
+};
+
+/** struct method_ref - a function that has a pointer to a type as a parameter
+ *
+ * @function - the function
+ * @id - its id in the functions_table
+ * @nr_parms - how many of its parameters are pointers to the type
+ */
+struct method_ref {
+	struct function *function;
+	uint32_t	id;
+	uint16_t	nr_parms;
+};
+
+/** struct type_refs - reverse index of the references to each type in a cu
+ *
+ * The references to type id N are at entries[first[N]..first[N + 1]), in
+ * types_table order, followed by the function parameters, in
+ * functions_table order, so members of the same struct are contiguous.
+ *
+ * The methods of type id N, i.e. the functions that have a pointer to N as a
+ * parameter, are at methods[methods_first[N]..methods_first[N + 1]), this is
+ * only built when first asked for, see cu__methods.
+ */
+struct type_refs {
+	uint32_t	  *first;
+	struct type_ref	  *entries;
+	uint32_t	  *methods_first;
+	struct method_ref *methods;
+	uint32_t	  nr_types;
+	uint32_t	  nr_entries;
+};
+
+int cu__build_type_refs(struct cu *self);
+void cu__delete_type_refs(struct cu *self);
+struct type_ref *cu__type_refs(struct cu *self, const uint16_t type,
+			       struct type_ref **end);
+struct method_ref *cu__methods(struct cu *self, const uint16_t type,
+			       struct method_ref **end);
+
+/**
+ * cu__for_each_type_ref - iterate thru all the references to a type
+ * @cu: struct cu instance
+ * @type: uint16_t id of the referenced type
+ * @pos: struct type_ref iterator
+ * @end: struct type_ref pointer used to hold the end of the list
+ *
+ * The index is built on first use and dropped when tags are added to @cu.
+ */
+#define cu__for_each_type_ref(cu, type, pos, end) \
+	for (pos = cu__type_refs(cu, type, &end); pos != end; ++pos)
+
+/**
+ * cu__for_each_method - iterate thru all the functions with a pointer to a type
+ * @cu: struct cu instance
+ * @type: uint16_t id of the type
+ * @pos: struct method_ref iterator
+ * @end: struct method_ref pointer used to hold the end of the list
+ */
+#define cu__for_each_method(cu, type, pos, end) \
+	for (pos = cu__methods(cu, type, &end); pos != end; ++pos)
+
 /** struct tag - basic representation of a debug info element
- * @priv - extra data, for instance, DWARF offset, id, decl_{file,line}
+ * @priv_slot - index in cu->tags_priv of the loader extra data, for instance,
+ *		DWARF offset, id, decl_{file,line}, 0 if none, see tag__priv
  * @top_level -
  */
 struct tag {
 	struct list_head node;
 	uint16_t	 type;
 	uint16_t	 tag;
-	bool		 visited;
-	bool		 top_level;
-	uint16_t	 recursivity_level;
-	void		 *priv;
+	uint32_t	 visited:1;
+	uint32_t	 top_level:1;
+	uint32_t	 recursivity_level:6;
+	uint32_t	 priv_slot:24;
 };
 
+#define TAG__MAX_PRIV_SLOT ((1U << 24) - 1)
+
+/**
+ * tag__priv - loader extra data for a tag
+ * @self: the tag
+ * @cu: the cu @self belongs to
+ *
+ * Kept in a side table in the cu, not in struct tag, so that it can go
+ * away once the loader is done, see cu__delete_tags_priv.
+ */
+static inline void *tag__priv(const struct tag *self, const struct cu *cu)
+{
+	return self->priv_slot < cu->tags_priv.nr_entries ?
+		cu->tags_priv.entries[self->priv_slot] : NULL;
+}
+
+int tag__set_priv(struct tag *self, struct cu *cu, void *priv);
+void cu__delete_tags_priv(struct cu *self);
+
 void tag__delete(struct tag *self, struct cu *cu);
 
 static inline int tag__is_enumeration(const struct tag *self)
@@ -462,6 +692,8 @@ size_t tag__fprintf(struct tag *self, const struct cu *cu,
 
 const char *tag__name(const struct tag *self, const struct cu *cu,
 		      char *bf, size_t len, const struct conf_fprintf *conf);
+int cu__format_type_names(struct cu *self, const struct conf_fprintf *conf);
+void cu__delete_type_caches(struct cu *self);
 void tag__not_found_die(const char *file, int line, const char *func);
 
 #define tag__assert_search_result(tag) \
@@ -469,6 +701,8 @@ void tag__not_found_die(const char *file, int line, const char *func);
 					  __LINE__, __func__); } while (0)
 
 size_t tag__size(const struct tag *self, const struct cu *cu);
+int cu__resolve_types(struct cu *self);
+void cu__invalidate_resolved_types(struct cu *self);
 size_t tag__nr_cachelines(const struct tag *self, const struct cu *cu);
 struct tag *tag__follow_typedef(const struct tag *tag, const struct cu *cu);
 
@@ -969,6 +1203,7 @@ struct class {
 	uint8_t		 nr_bit_holes;
 	uint16_t	 padding;
 	uint8_t		 bit_padding;
+	bool		 holes_searched;
 	void		 *priv;
 };
 
@@ -1015,7 +1250,10 @@ static inline int class__is_struct(const struct class *self)
 }
 
 void class__find_holes(struct class *self);
+void class__refind_holes(struct class *self);
+void cu__find_class_holes(struct cu *self);
 int class__has_hole_ge(const struct class *self, const uint16_t size);
+uint64_t class__layout_hash(const struct class *self, const struct cu *cu);
 size_t class__fprintf(struct class *self, const struct cu *cu,
 		      const struct conf_fprintf *conf, FILE *fp);
 
@@ -1119,6 +1357,8 @@ size_t enumeration__fprintf(const struct tag *tag_self, const struct cu *cu,
 
 int dwarves__init(uint16_t user_cacheline_size);
 void dwarves__exit(void);
+int dwarves__fprintf_set_buffer(FILE *fp);
+size_t dwarves__cacheline_size(void);
 
 const char *dwarf_tag_name(const uint32_t tag);
 
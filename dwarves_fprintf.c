@@ -12,11 +12,13 @@
 #include <dwarf.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "dwarves.h"
+#include "hash.h"
 
 static const char *dwarf_tag_names[] = {
 	[DW_TAG_array_type]		  = "array_type",
@@ -128,6 +130,74 @@ static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
 
 static size_t cacheline_size;
 
+/*
+ * The struct and function bodies are printed a few bytes at a time, the
+ * most common pieces, indentation, padding and the offset/size numbers in
+ * the member comments, are written with these instead of going thru the
+ * fprintf format parser for each of them.
+ */
+static size_t fprintf__indent(FILE *fp, int indent)
+{
+	if (indent <= 0)
+		return 0;
+	if (indent > (int)sizeof(tabs) - 1)
+		indent = sizeof(tabs) - 1;
+	return fwrite(tabs, 1, indent, fp);
+}
+
+/* Same as fprintf(fp, "%*s", width, " ") */
+static size_t fprintf__pad(FILE *fp, int width)
+{
+	static const char spaces[] = "                                ";
+	size_t printed = 0;
+
+	if (width < 0)
+		width = -width;
+	if (width == 0)
+		width = 1;
+
+	while (width > 0) {
+		const int n = width < (int)sizeof(spaces) - 1 ?
+				width : (int)sizeof(spaces) - 1;
+		printed += fwrite(spaces, 1, n, fp);
+		width -= n;
+	}
+
+	return printed;
+}
+
+static size_t fprintf__str(FILE *fp, const char *s)
+{
+	return fwrite(s, 1, strlen(s), fp);
+}
+
+/* Same as fprintf(fp, hex ? "%#*x" : "%*u", width, value), width > 0 */
+static size_t fprintf__uint(FILE *fp, uint32_t value, int width, bool hex)
+{
+	char bf[32], *s = bf + sizeof(bf);
+
+	if (value == 0)
+		*--s = '0';
+	else if (hex) {
+		do {
+			*--s = "0123456789abcdef"[value & 0xf];
+			value >>= 4;
+		} while (value != 0);
+		*--s = 'x';
+		*--s = '0';
+	} else {
+		do {
+			*--s = '0' + value % 10;
+			value /= 10;
+		} while (value != 0);
+	}
+
+	while (bf + sizeof(bf) - s < width && s > bf)
+		*--s = ' ';
+
+	return fwrite(s, 1, bf + sizeof(bf) - s, fp);
+}
+
 size_t tag__nr_cachelines(const struct tag *self, const struct cu *cu)
 {
 	return (tag__size(self, cu) + cacheline_size - 1) / cacheline_size;
@@ -361,6 +431,156 @@ static const char *tag__prefix(const struct cu *cu, const uint32_t tag,
 	return "";
 }
 
+/*
+ * Spelling a type, "const struct foo *", a function pointer, etc, is done
+ * over and over for the same types when printing, so the result is
+ * interned, in a hash table keyed by the type and by the conf_fprintf
+ * options that change how it is spelled.
+ *
+ * The table is only valid for the resolved_types_generation it was filled
+ * in, i.e. cu__invalidate_resolved_types forgets it too, as deleting tags
+ * does, their memory being reused for others. The names are malloc'ed, not
+ * in the cu obstack, that class__delete and friends free back to them.
+ */
+enum type_name_flags {
+	TYPE_NAME__CLASSES_AS_STRUCTS = 1 << 0,
+	TYPE_NAME__NO_PARM_NAMES      = 1 << 1,
+};
+
+#define CU__TYPE_NAMES_MIN 256
+
+/* Longer names are not cached, they are spelled every time */
+#define TYPE_NAME__MAX_LEN 1024
+
+static uint32_t conf_fprintf__type_name_flags(const struct conf_fprintf *conf)
+{
+	return (conf->classes_as_structs ? TYPE_NAME__CLASSES_AS_STRUCTS : 0) |
+	       (conf->no_parm_names ? TYPE_NAME__NO_PARM_NAMES : 0);
+}
+
+static bool tag__has_cached_name(const struct tag *self)
+{
+	switch (self->tag) {
+	case DW_TAG_subprogram:
+	case DW_TAG_member:
+	case DW_TAG_variable:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Returns the entry for @tag + @flags or the empty one where it should go,
+ * the table is never more than half full, so there is always one.
+ */
+static struct type_name *cu__type_name_slot(const struct cu *self,
+					    const struct tag *tag,
+					    uint32_t flags)
+{
+	const uint32_t mask = self->allocated_type_names - 1;
+	uint32_t i = hash_long((unsigned long)tag ^ flags,
+			       __builtin_ctz(self->allocated_type_names));
+	struct type_name *pos;
+
+	while ((pos = &self->type_names[i])->tag != NULL) {
+		if (pos->tag == tag && pos->flags == flags)
+			break;
+		i = (i + 1) & mask;
+	}
+
+	return pos;
+}
+
+static const struct type_name *cu__find_type_name(const struct cu *self,
+						  const struct tag *tag,
+						  uint32_t flags)
+{
+	const struct type_name *tn;
+
+	if (self->nr_type_names == 0 ||
+	    self->type_names_generation != self->resolved_types_generation)
+		return NULL;
+
+	tn = cu__type_name_slot(self, tag, flags);
+	return tn->tag != NULL ? tn : NULL;
+}
+
+static void cu__drop_type_names(struct cu *self)
+{
+	uint32_t i;
+
+	if (self->nr_type_names == 0)
+		return;
+
+	for (i = 0; i < self->allocated_type_names; ++i)
+		free((char *)self->type_names[i].name);
+	memset(self->type_names, 0,
+	       sizeof(*self->type_names) * self->allocated_type_names);
+	self->nr_type_names = 0;
+}
+
+static int cu__reserve_type_names(struct cu *self, uint32_t nr_entries)
+{
+	struct type_name *old;
+	uint32_t nr_old, allocated, i;
+
+	if (self->type_names_generation != self->resolved_types_generation) {
+		cu__drop_type_names(self);
+		self->type_names_generation = self->resolved_types_generation;
+	}
+
+	old	  = self->type_names;
+	nr_old	  = self->allocated_type_names;
+	allocated = nr_old ?: CU__TYPE_NAMES_MIN;
+
+	while (allocated < nr_entries * 2)
+		allocated *= 2;
+
+	if (allocated == nr_old)
+		return 0;
+
+	self->type_names = calloc(allocated, sizeof(struct type_name));
+	if (self->type_names == NULL) {
+		self->type_names = old;
+		return -ENOMEM;
+	}
+	self->allocated_type_names = allocated;
+
+	for (i = 0; i < nr_old; ++i)
+		if (old[i].tag != NULL)
+			*cu__type_name_slot(self, old[i].tag,
+					    old[i].flags) = old[i];
+	free(old);
+	return 0;
+}
+
+/*
+ * This is a cache, filled as a side effect of tag__name, like the one
+ * used by tag__size, hence the const being cast away.
+ */
+static void cu__add_type_name(const struct cu *cu, const struct tag *tag,
+			      uint32_t flags, const char *name, size_t len)
+{
+	struct cu *self = (struct cu *)cu;
+	struct type_name *tn;
+
+	if (cu__reserve_type_names(self, self->nr_type_names + 1) != 0)
+		return;
+
+	tn = cu__type_name_slot(self, tag, flags);
+	if (tn->tag != NULL)
+		return;
+
+	tn->name = strndup(name, len);
+	if (tn->name == NULL)
+		return;
+	tn->tag	  = tag;
+	tn->len	  = len;
+	tn->flags = flags;
+	++self->nr_type_names;
+}
+
 static const char *__tag__name(const struct tag *self, const struct cu *cu,
 			       char *bf, size_t len,
 			       const struct conf_fprintf *conf);
@@ -390,9 +610,9 @@ static const char *tag__ptr_name(const struct tag *self, const struct cu *cu,
 	return bf;
 }
 
-static const char *__tag__name(const struct tag *self, const struct cu *cu,
-			       char *bf, size_t len,
-			       const struct conf_fprintf *conf)
+static const char *tag__spell_name(const struct tag *self,
+				   const struct cu *cu, char *bf, size_t len,
+				   const struct conf_fprintf *conf)
 {
 	struct tag *type;
 	const struct conf_fprintf *pconf = conf ?: &conf_fprintf__defaults;
@@ -486,6 +706,74 @@ static const char *__tag__name(const struct tag *self, const struct cu *cu,
 	return bf;
 }
 
+static const char *__tag__name(const struct tag *self, const struct cu *cu,
+			       char *bf, size_t len,
+			       const struct conf_fprintf *conf)
+{
+	const struct type_name *tn;
+	char nbf[TYPE_NAME__MAX_LEN];
+	const char *name;
+	uint32_t flags;
+	size_t name_len;
+
+	if (self == NULL || !tag__has_cached_name(self) || len == 0)
+		return tag__spell_name(self, cu, bf, len, conf);
+
+	flags = conf_fprintf__type_name_flags(conf ?: &conf_fprintf__defaults);
+	tn = cu__find_type_name(cu, self, flags);
+	if (tn != NULL) {
+		name	 = tn->name;
+		name_len = tn->len;
+	} else {
+		name	 = tag__spell_name(self, cu, nbf, sizeof(nbf), conf);
+		name_len = strlen(name);
+		if (name_len < sizeof(nbf) - 1)
+			cu__add_type_name(cu, self, flags, name, name_len);
+	}
+
+	if (name_len >= len)
+		name_len = len - 1;
+	memcpy(bf, name, name_len);
+	bf[name_len] = '\0';
+	return bf;
+}
+
+/**
+ * cu__format_type_names - fill the cache used by tag__name
+ * @self: the cu
+ * @conf: the options tag__name will be called with, NULL for the defaults
+ *
+ * tag__name fills it on demand, this is for when the types are going to be
+ * spelled from several threads, so that they only read from it.
+ *
+ * Returns 0 or -ENOMEM.
+ */
+int cu__format_type_names(struct cu *self, const struct conf_fprintf *conf)
+{
+	const uint32_t flags = conf ? conf_fprintf__type_name_flags(conf) : 0;
+	uint32_t id, nr_entries = self->types_table.nr_entries;
+	char bf[TYPE_NAME__MAX_LEN];
+	struct tag *type;
+
+	/* Pointers spell what they point to with the default options */
+	if (flags != 0)
+		nr_entries *= 2;
+
+	if (cu__reserve_type_names(self, self->nr_type_names + nr_entries))
+		return -ENOMEM;
+
+	for (id = 1; id < self->types_table.nr_entries; ++id) {
+		type = cu__type(self, id);
+		if (type == NULL)
+			continue;
+		__tag__name(type, self, bf, sizeof(bf), conf);
+		if (flags != 0)
+			__tag__name(type, self, bf, sizeof(bf), NULL);
+	}
+
+	return 0;
+}
+
 const char *tag__name(const struct tag *self, const struct cu *cu,
 		      char *bf, size_t len, const struct conf_fprintf *conf)
 {
@@ -532,6 +820,264 @@ static const char *variable__prefix(const struct variable *var)
 static size_t union__fprintf(struct type *self, const struct cu *cu,
 			     const struct conf_fprintf *conf, FILE *fp);
 
+/*
+ * With expand_types the named structs and unions are printed inline, so
+ * the big ones that are embedded in lots of others are printed over and
+ * over, the same text as long as they are at the same indentation, base
+ * offset, with the same member name, etc. So remember what was printed for
+ * each of these, per cu, for the resolved_types_generation, like the type
+ * names cached by tag__name, and, like them, malloc'ed.
+ *
+ * With expand_pointers what is printed depends on the types being printed
+ * at the time, to avoid loops, so that is not cached.
+ */
+struct expanded_type {
+	struct expanded_type *next;
+	const struct tag     *tag;
+	const char	     *suffix;
+	const char	     *text;
+	size_t		     len;
+	size_t		     printed;
+	uint32_t	     base_offset;
+	int32_t		     type_spacing;
+	int32_t		     name_spacing;
+	uint32_t	     flags;
+	uint8_t		     indent;
+};
+
+#define CU__EXPANDED_TYPES_MIN 256
+
+/* Stop caching when this much text was cached for a cu */
+#define CU__EXPANDED_TYPES_MAX_BYTES (16 * 1024 * 1024)
+
+static uint32_t conf_fprintf__flags(const struct conf_fprintf *conf)
+{
+	return conf->rel_offset				      << 0 |
+	       conf->emit_stats				      << 1 |
+	       conf->suppress_comments			      << 2 |
+	       conf->suppress_offset_comment		      << 3 |
+	       conf->show_decl_info			      << 4 |
+	       conf->show_only_data_members		      << 5 |
+	       conf->no_semicolon			      << 6 |
+	       conf->show_first_biggest_size_base_type_member << 7 |
+	       conf->flat_arrays			      << 8 |
+	       conf->no_parm_names			      << 9 |
+	       conf->classes_as_structs			      << 10 |
+	       conf->hex_fmt				      << 11;
+}
+
+static uint32_t expanded_type__hash(const struct tag *tag,
+				    const struct conf_fprintf *conf,
+				    uint32_t bits)
+{
+	return hash_long((unsigned long)tag ^
+			 ((unsigned long)conf->base_offset << 8) ^ conf->indent,
+			 bits);
+}
+
+static bool expanded_type__equal(const struct expanded_type *self,
+				 const struct tag *tag,
+				 const struct conf_fprintf *conf,
+				 uint32_t flags)
+{
+	return self->tag == tag &&
+	       self->base_offset == conf->base_offset &&
+	       self->indent == conf->indent &&
+	       self->type_spacing == conf->type_spacing &&
+	       self->name_spacing == conf->name_spacing &&
+	       self->flags == flags &&
+	       (self->suffix == NULL ?
+		conf->suffix == NULL :
+		conf->suffix != NULL && strcmp(self->suffix, conf->suffix) == 0);
+}
+
+static const struct expanded_type *
+	cu__find_expanded_type(const struct cu *self, const struct tag *tag,
+			       const struct conf_fprintf *conf, uint32_t flags)
+{
+	const struct expanded_type *pos;
+
+	if (self->nr_expanded_types == 0 ||
+	    self->expanded_types_generation != self->resolved_types_generation)
+		return NULL;
+
+	pos = self->expanded_types[expanded_type__hash(tag, conf,
+					__builtin_ctz(self->nr_expanded_buckets))];
+	while (pos != NULL && !expanded_type__equal(pos, tag, conf, flags))
+		pos = pos->next;
+
+	return pos;
+}
+
+static int cu__grow_expanded_types(struct cu *self)
+{
+	const uint32_t nr_old = self->nr_expanded_buckets;
+	const uint32_t nr_buckets = nr_old ? nr_old * 2 : CU__EXPANDED_TYPES_MIN;
+	struct expanded_type **buckets = calloc(nr_buckets, sizeof(*buckets));
+	struct expanded_type *pos, *next;
+	uint32_t i;
+
+	if (buckets == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_old; ++i)
+		for (pos = self->expanded_types[i]; pos != NULL; pos = next) {
+			const struct conf_fprintf conf = {
+				.base_offset = pos->base_offset,
+				.indent	     = pos->indent,
+			};
+			const uint32_t bucket =
+				expanded_type__hash(pos->tag, &conf,
+						    __builtin_ctz(nr_buckets));
+			next = pos->next;
+			pos->next = buckets[bucket];
+			buckets[bucket] = pos;
+		}
+
+	free(self->expanded_types);
+	self->expanded_types	  = buckets;
+	self->nr_expanded_buckets = nr_buckets;
+	return 0;
+}
+
+static void cu__drop_expanded_types(struct cu *self)
+{
+	struct expanded_type *pos, *next;
+	uint32_t i;
+
+	if (self->nr_expanded_types == 0)
+		return;
+
+	for (i = 0; i < self->nr_expanded_buckets; ++i) {
+		for (pos = self->expanded_types[i]; pos != NULL; pos = next) {
+			next = pos->next;
+			free(pos);
+		}
+		self->expanded_types[i] = NULL;
+	}
+	self->nr_expanded_types	   = 0;
+	self->expanded_types_bytes = 0;
+}
+
+/**
+ * cu__delete_type_caches - free the type names and expanded types cache
+ * @self: the cu
+ *
+ * For cu__delete, the ones cached by tag__name and class__fprintf.
+ */
+void cu__delete_type_caches(struct cu *self)
+{
+	cu__drop_type_names(self);
+	cu__drop_expanded_types(self);
+	free(self->type_names);
+	free(self->expanded_types);
+	self->type_names	    = NULL;
+	self->allocated_type_names  = 0;
+	self->expanded_types	    = NULL;
+	self->nr_expanded_buckets   = 0;
+}
+
+/*
+ * A cache, filled as a side effect of printing, hence the const being cast
+ * away, see cus__for_each_cu_parallel about printing other cus.
+ */
+static void cu__add_expanded_type(const struct cu *cu, const struct tag *tag,
+				  const struct conf_fprintf *conf,
+				  uint32_t flags, const char *text, size_t len,
+				  size_t printed)
+{
+	struct cu *self = (struct cu *)cu;
+	struct expanded_type *et;
+	size_t suffix_len;
+	uint32_t bucket;
+
+	if (self->expanded_types_generation != self->resolved_types_generation) {
+		cu__drop_expanded_types(self);
+		self->expanded_types_generation = self->resolved_types_generation;
+	}
+
+	if (self->expanded_types_bytes + len > CU__EXPANDED_TYPES_MAX_BYTES)
+		return;
+
+	if (self->nr_expanded_types >= self->nr_expanded_buckets &&
+	    cu__grow_expanded_types(self) != 0)
+		return;
+
+	/* The text and the suffix go after it, in the same allocation */
+	suffix_len = conf->suffix != NULL ? strlen(conf->suffix) + 1 : 0;
+	et = malloc(sizeof(*et) + len + suffix_len);
+	if (et == NULL)
+		return;
+
+	et->text = memcpy(et + 1, text, len);
+	et->suffix = conf->suffix != NULL ?
+		     memcpy((char *)(et + 1) + len, conf->suffix, suffix_len) :
+		     NULL;
+
+	et->tag		 = tag;
+	et->len		 = len;
+	et->printed	 = printed;
+	et->base_offset	 = conf->base_offset;
+	et->type_spacing = conf->type_spacing;
+	et->name_spacing = conf->name_spacing;
+	et->flags	 = flags;
+	et->indent	 = conf->indent;
+
+	bucket = expanded_type__hash(tag, conf,
+				     __builtin_ctz(self->nr_expanded_buckets));
+	et->next = self->expanded_types[bucket];
+	self->expanded_types[bucket] = et;
+	++self->nr_expanded_types;
+	self->expanded_types_bytes += len;
+}
+
+static size_t __type__fprintf_expanded(struct tag *type, const struct cu *cu,
+				       const struct conf_fprintf *conf,
+				       FILE *fp)
+{
+	if (tag__is_union(type))
+		return union__fprintf(tag__type(type), cu, conf, fp);
+	return class__fprintf(tag__class(type), cu, conf, fp);
+}
+
+/*
+ * Prints a struct or union inline, using the text printed before for it
+ * in the same context, if any.
+ */
+static size_t type__fprintf_expanded(struct tag *type, const struct cu *cu,
+				     const struct conf_fprintf *conf, FILE *fp)
+{
+	const struct expanded_type *et;
+	uint32_t flags;
+	char *text;
+	size_t len, printed;
+	FILE *mfp;
+
+	if (!conf->expand_types || conf->expand_pointers ||
+	    type__name(tag__type(type), cu) == NULL)
+		return __type__fprintf_expanded(type, cu, conf, fp);
+
+	flags = conf_fprintf__flags(conf);
+	et = cu__find_expanded_type(cu, type, conf, flags);
+	if (et != NULL) {
+		fwrite(et->text, 1, et->len, fp);
+		return et->printed;
+	}
+
+	mfp = open_memstream(&text, &len);
+	if (mfp == NULL)
+		return __type__fprintf_expanded(type, cu, conf, fp);
+
+	printed = __type__fprintf_expanded(type, cu, conf, mfp);
+	if (fclose(mfp) != 0)
+		return printed;
+
+	fwrite(text, 1, len, fp);
+	cu__add_expanded_type(cu, type, conf, flags, text, len, printed);
+	free(text);
+	return printed;
+}
+
 static size_t type__fprintf(struct tag *type, const struct cu *cu,
 			    const char *name, const struct conf_fprintf *conf,
 			    FILE *fp)
@@ -664,8 +1210,7 @@ static size_t type__fprintf(struct tag *type, const struct cu *cu,
 					   conf->type_spacing - 7,
 					   type__name(ctype, cu), name);
 		else
-			printed += class__fprintf(tag__class(type),
-						  cu, &tconf, fp);
+			printed += type__fprintf_expanded(type, cu, &tconf, fp);
 		break;
 	case DW_TAG_union_type:
 		ctype = tag__type(type);
@@ -675,7 +1220,7 @@ static size_t type__fprintf(struct tag *type, const struct cu *cu,
 					   conf->type_spacing - 6,
 					   type__name(ctype, cu), name);
 		else
-			printed += union__fprintf(ctype, cu, &tconf, fp);
+			printed += type__fprintf_expanded(type, cu, &tconf, fp);
 		break;
 	case DW_TAG_enumeration_type:
 		ctype = tag__type(type);
@@ -713,6 +1258,7 @@ static size_t struct_member__fprintf(struct class_member *self,
 		sconf.base_offset += self->byte_offset;
 		offset = sconf.base_offset;
 	}
+	sconf.member_annotate = NULL;
 
 	if (self->tag.tag == DW_TAG_inheritance) {
 		name = "<ancestor>";
@@ -735,12 +1281,15 @@ static size_t struct_member__fprintf(struct class_member *self,
 		if (!sconf.suppress_offset_comment) {
 			/* Check if this is a anonymous union */
 			const int slen = cm_name ? (int)strlen(cm_name) : -1;
-			printed += fprintf(fp, sconf.hex_fmt ?
-							"%*s/* %#5x %#5x */" :
-							"%*s/* %5u %5u */",
-					   (sconf.type_spacing +
-					    sconf.name_spacing - slen - 3),
-					   " ", offset, size);
+			printed += fprintf__pad(fp, sconf.type_spacing +
+						    sconf.name_spacing -
+						    slen - 3);
+			printed += fprintf__str(fp, "/* ");
+			printed += fprintf__uint(fp, offset, 5,
+						 sconf.hex_fmt);
+			printed += fprintf__str(fp, " ");
+			printed += fprintf__uint(fp, size, 5, sconf.hex_fmt);
+			printed += fprintf__str(fp, " */");
 		}
 	} else {
 		int spacing = sconf.type_spacing + sconf.name_spacing - printed;
@@ -753,21 +1302,22 @@ static size_t struct_member__fprintf(struct class_member *self,
 		if (!sconf.suppress_offset_comment) {
 			int size_spacing = 5;
 
-			printed += fprintf(fp, sconf.hex_fmt ?
-						"%*s/* %#5x" : "%*s/* %5u",
-					   spacing > 0 ? spacing : 0, " ",
-					   offset);
+			printed += fprintf__pad(fp, spacing > 0 ? spacing : 0);
+			printed += fprintf__str(fp, "/* ");
+			printed += fprintf__uint(fp, offset, 5, sconf.hex_fmt);
 
 			if (self->bitfield_size != 0) {
-				printed += fprintf(fp, sconf.hex_fmt ?
-							":%#2x" : ":%2u",
-						   self->bitfield_offset);
+				printed += fprintf__str(fp, ":");
+				printed += fprintf__uint(fp,
+							 self->bitfield_offset,
+							 2, sconf.hex_fmt);
 				size_spacing -= 3;
 			}
 
-			printed += fprintf(fp, sconf.hex_fmt ?
-						" %#*x */" : " %*u */",
-					   size_spacing, size);
+			printed += fprintf__str(fp, " ");
+			printed += fprintf__uint(fp, size, size_spacing,
+						 sconf.hex_fmt);
+			printed += fprintf__str(fp, " */");
 		}
 	}
 	return printed;
@@ -836,12 +1386,12 @@ static size_t union__fprintf(struct type *self, const struct cu *cu,
 		struct tag *type = cu__type(cu, pos->tag.type);
 
 		if (type == NULL) {
-			printed += fprintf(fp, "%.*s", uconf.indent, tabs);
+			printed += fprintf__indent(fp, uconf.indent);
 			printed += tag__id_not_found_fprintf(fp, pos->tag.type);
 			continue;
 		}
 
-		printed += fprintf(fp, "%.*s", uconf.indent, tabs);
+		printed += fprintf__indent(fp, uconf.indent);
 		printed += union_member__fprintf(pos, type, cu, &uconf, fp);
 		fputc('\n', fp);
 		++printed;
@@ -959,7 +1509,7 @@ static size_t function__tag_fprintf(const struct tag *tag, const struct cu *cu,
 			printed += tag__id_not_found_fprintf(fp, exp->ip.tag.type);
 			break;
 		}
-		printed = fprintf(fp, "%.*s", indent, tabs);
+		printed = fprintf__indent(fp, indent);
 		name = function__name(alias, cu);
 		n = fprintf(fp, "%s", name);
 		size_t namelen = 0;
@@ -980,7 +1530,7 @@ static size_t function__tag_fprintf(const struct tag *tag, const struct cu *cu,
 	}
 		break;
 	case DW_TAG_variable:
-		printed = fprintf(fp, "%.*s", indent, tabs);
+		printed = fprintf__indent(fp, indent);
 		n = fprintf(fp, "%s %s;",
 			    variable__type_name(vtag, cu, bf, sizeof(bf)),
 			    variable__name(vtag, cu));
@@ -989,7 +1539,7 @@ static size_t function__tag_fprintf(const struct tag *tag, const struct cu *cu,
 		break;
 	case DW_TAG_label: {
 		const struct label *label = vtag;
-		printed = fprintf(fp, "%.*s", indent, tabs);
+		printed = fprintf__indent(fp, indent);
 		fputc('\n', fp);
 		++printed;
 		c = fprintf(fp, "%s:", label__name(label, cu));
@@ -1002,7 +1552,7 @@ static size_t function__tag_fprintf(const struct tag *tag, const struct cu *cu,
 		fputc('\n', fp);
 		return printed + 1;
 	default:
-		printed = fprintf(fp, "%.*s", indent, tabs);
+		printed = fprintf__indent(fp, indent);
 		n = fprintf(fp, "%s <%llx>", dwarf_tag_name(tag->tag),
 			    tag__orig_id(tag, cu));
 		c += n;
@@ -1131,7 +1681,7 @@ static size_t class__fprintf_cacheline_boundary(uint32_t last_cacheline,
 			++printed;
 		}
 
-		printed += fprintf(fp, "%.*s", indent, tabs);
+		printed += fprintf__indent(fp, indent);
 
 		if (cacheline_pos == 0)
 			printed += fprintf(fp, "/* --- cacheline %u boundary "
@@ -1188,6 +1738,11 @@ size_t class__fprintf(struct class *self, const struct cu *cu,
 	struct tag *tag_pos;
 	const char *current_accessibility = NULL;
 	struct conf_fprintf cconf = conf ? *conf : conf_fprintf__defaults;
+
+	if (tag__is_struct(class__tag(self)))
+		class__find_holes(self);
+	/* Take the stream lock once, not once per fprintf call */
+	flockfile(fp);
 	const uint16_t t = tself->namespace.tag.tag;
 	size_t printed = fprintf(fp, "%s%s%s%s%s",
 				 cconf.prefix ?: "", cconf.prefix ? " " : "",
@@ -1330,17 +1885,24 @@ size_t class__fprintf(struct class *self, const struct cu *cu,
 
 		type = cu__type(cu, pos->tag.type);
 		if (type == NULL) {
-			printed += fprintf(fp, "%.*s", cconf.indent, tabs);
+			printed += fprintf__indent(fp, cconf.indent);
 			printed += tag__id_not_found_fprintf(fp, pos->tag.type);
 			continue;
 		}
 
 		size = pos->byte_size;
-		printed += fprintf(fp, "%.*s", cconf.indent, tabs);
+		printed += fprintf__indent(fp, cconf.indent);
 		printed += struct_member__fprintf(pos, type, cu, &cconf, fp);
+		if (cconf.member_annotate != NULL)
+			printed += cconf.member_annotate(pos,
+							 cconf.annotate_priv,
+							 fp);
 
 		if (tag__is_struct(type) && !cconf.suppress_comments) {
-			const uint16_t padding = tag__class(type)->padding;
+			struct class *ctype = tag__class(type);
+
+			class__find_holes(ctype);
+			const uint16_t padding = ctype->padding;
 			if (padding > 0) {
 				++nr_paddings;
 				sum_paddings += padding;
@@ -1510,8 +2072,10 @@ size_t class__fprintf(struct class *self, const struct cu *cu,
 				   tself->size - (sum + sum_holes));
 	fputc('\n', fp);
 out:
-	return printed + fprintf(fp, "%.*s}%s%s", indent, tabs,
-				 cconf.suffix ? " ": "", cconf.suffix ?: "");
+	printed += fprintf(fp, "%.*s}%s%s", indent, tabs,
+			   cconf.suffix ? " ": "", cconf.suffix ?: "");
+	funlockfile(fp);
+	return printed;
 }
 
 static size_t variable__fprintf(const struct tag *tag, const struct cu *cu,
@@ -1587,11 +2151,12 @@ size_t tag__fprintf(struct tag *self, const struct cu *cu,
 	if (pconf->expand_types)
 		++self->recursivity_level;
 
+	flockfile(fp);
 	if (pconf->show_decl_info) {
-		printed += fprintf(fp, "%.*s", pconf->indent, tabs);
+		printed += fprintf__indent(fp, pconf->indent);
 		printed += tag__fprintf_decl_info(self, cu, fp);
 	}
-	printed += fprintf(fp, "%.*s", pconf->indent, tabs);
+	printed += fprintf__indent(fp, pconf->indent);
 
 	switch (self->tag) {
 	case DW_TAG_array_type:
@@ -1645,6 +2210,7 @@ size_t tag__fprintf(struct tag *self, const struct cu *cu,
 					   function__linkage_name(fself, cu));
 	}
 
+	funlockfile(fp);
 	if (pconf->expand_types)
 		--self->recursivity_level;
 
@@ -1661,6 +2227,45 @@ void cus__print_error_msg(const char *progname, const struct cus *cus,
 		fprintf(stderr, "%s: %s\n", progname, strerror(err));
 }
 
+#define DWARVES__OUTPUT_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * dwarves__fprintf_set_buffer - use a large buffer for where the tool prints
+ * @fp: the stream, usually stdout, before anything is printed to it
+ *
+ * Dumping all the types in a big object means lots of small writes, with
+ * the default BUFSIZ buffer that is a write syscall every few structs.
+ * Streams connected to a terminal are left alone, i.e. line buffered.
+ *
+ * There is just one buffer, for the first stream this is called for.
+ *
+ * Returns 0, -EBUSY if the buffer is already used by another stream or
+ * -errno if setvbuf fails.
+ */
+int dwarves__fprintf_set_buffer(FILE *fp)
+{
+	static char buffer[DWARVES__OUTPUT_BUFFER_SIZE];
+	static FILE *buffered;
+
+	if (isatty(fileno(fp)))
+		return 0;
+
+	if (buffered != NULL)
+		return buffered == fp ? 0 : -EBUSY;
+
+	if (setvbuf(fp, buffer, _IOFBF, sizeof(buffer)) != 0)
+		return -errno;
+
+	buffered = fp;
+	return 0;
+}
+
+/* The one set by dwarves__init, found out when it was asked to */
+size_t dwarves__cacheline_size(void)
+{
+	return cacheline_size;
+}
+
 void dwarves__fprintf_init(uint16_t user_cacheline_size)
 {
 	if (user_cacheline_size == 0) {
@@ -9,6 +9,11 @@
   published by the Free Software Foundation.
 */
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #include "list.h"
 #include "dwarves_reorganize.h"
 #include "dwarves.h"
@@ -350,7 +355,7 @@ static void class__move_member(struct class *class, struct class_member *dest,
 	dest->hole = offset;
 
 	if (verbose > 1) {
-		class__find_holes(class);
+		class__refind_holes(class);
 		class__fprintf(class, cu, NULL, fp);
 		fputc('\n', fp);
 	}
@@ -427,7 +432,7 @@ static void class__move_bit_member(struct class *class, const struct cu *cu,
 	from->hole = dest->hole;
 	dest->hole = 0;
 	if (verbose > 1) {
-		class__find_holes(class);
+		class__refind_holes(class);
 		class__fprintf(class, cu, NULL, fp);
 		fputc('\n', fp);
 	}
@@ -576,7 +581,7 @@ static int class__demote_bitfields(struct class *class, const struct cu *cu,
 		if (member->bit_hole == 0)
 			--class->nr_bit_holes;
 		if (verbose > 1) {
-			class__find_holes(class);
+			class__refind_holes(class);
 			class__fprintf(class, cu, NULL, fp);
 			fputc('\n', fp);
 		}
@@ -635,7 +640,7 @@ static int class__demote_bitfields(struct class *class, const struct cu *cu,
 			}
 			some_was_demoted = 1;
 			if (verbose > 1) {
-				class__find_holes(class);
+				class__refind_holes(class);
 				class__fprintf(class, cu, NULL, fp);
 				fputc('\n', fp);
 			}
@@ -761,7 +766,7 @@ static void class__fixup_member_types(struct class *self, const struct cu *cu,
 	if (verbose && fixup_was_done) {
 		fprintf(fp, "/* bitfield types were fixed */\n");
 		if (verbose > 1) {
-			class__find_holes(self);
+			class__refind_holes(self);
 			class__fprintf(self, cu, NULL, fp);
 			fputc('\n', fp);
 		}
@@ -782,7 +787,7 @@ void class__reorganize(struct class *self, const struct cu *cu,
 	/* Now try to combine holes */
 restart:
 	alignment_size = 0;
-	class__find_holes(self);
+	class__refind_holes(self);
 	/*
 	 * It can be NULL if this class doesn't have any data members,
 	 * just inheritance entries
@@ -893,3 +898,1116 @@ restart:
 		}
 	}
 }
+
+/*
+ * Guessed from the size, as a type's alignment divides its size: the biggest
+ * power of two the size is a multiple of, an upper bound, capped at the word
+ * size, as structs and arrays of smaller members and e.g. long long on i386
+ * aren't aligned more, see class__fixup_alignment. Except for 16 byte
+ * scalars, e.g. long double and __int128, aligned to their size in the ABIs
+ * that have them. What the offsets prove is in struct forced_alignments.
+ */
+static size_t class_member__alignment(const struct class_member *self,
+				      const struct cu *cu)
+{
+	const size_t alignment = self->byte_size & -self->byte_size;
+	const struct tag *type;
+
+	if (alignment == 0)
+		return 1;
+	if (alignment <= cu->addr_size)
+		return alignment;
+
+	type = cu__type(cu, self->tag.type);
+	while (type != NULL && (tag__is_typedef(type) || tag__is_const(type) ||
+				tag__is_volatile(type)))
+		type = cu__type(cu, type->type);
+	if (type != NULL && type->tag == DW_TAG_base_type &&
+	    self->byte_size == 16)
+		return 16;
+
+	return cu->addr_size;
+}
+
+/*
+ * Members aligned more than their size says, e.g. ____cacheline_aligned
+ * ones in the Linux kernel, that have before them a hole where they would
+ * fit, get the smallest alignment that explains the hole, if their offset
+ * and the struct size are multiples of it.
+ */
+struct forced_alignments {
+	const struct class_member **members;
+	uint32_t		  *alignments;
+	uint32_t		  nr;
+};
+
+static void forced_alignments__exit(struct forced_alignments *self)
+{
+	free(self->members);
+	free(self->alignments);
+	self->members	 = NULL;
+	self->alignments = NULL;
+	self->nr	 = 0;
+}
+
+/* With the original offsets, before the members are moved */
+static int forced_alignments__init(struct forced_alignments *self,
+				   struct class *class,
+				   const struct cu *cu)
+{
+	const struct class_member *pos;
+	uint32_t nr_members = 0, end = 0;
+
+	self->nr = 0;
+	list_for_each_entry(pos, class__tags(class), tag.node) {
+		if (pos->tag.tag == DW_TAG_member)
+			++nr_members;
+		else if (pos->tag.tag == DW_TAG_inheritance &&
+			 pos->byte_offset + pos->byte_size > end)
+			end = pos->byte_offset + pos->byte_size;
+	}
+
+	self->members	 = malloc(nr_members * sizeof(*self->members));
+	self->alignments = malloc(nr_members * sizeof(*self->alignments));
+	if (self->members == NULL || self->alignments == NULL) {
+		forced_alignments__exit(self);
+		return -ENOMEM;
+	}
+
+	type__for_each_data_member(&class->type, pos) {
+		if (pos->byte_size != 0 && pos->byte_offset > end &&
+		    pos->byte_offset - end >= class_member__alignment(pos,
+								       cu)) {
+			uint32_t alignment = 1;
+
+			/* The smallest that would leave that hole */
+			while (alignment <= pos->byte_offset - end)
+				alignment *= 2;
+			/*
+			 * Else it isn't what made it, e.g. explicit padding,
+			 * the struct is aligned at least as much as its members
+			 */
+			if ((pos->byte_offset & (alignment - 1)) == 0 &&
+			    (class->type.size & (alignment - 1)) == 0) {
+				self->members[self->nr]	     = pos;
+				self->alignments[self->nr++] = alignment;
+			}
+		}
+		if (pos->byte_offset + pos->byte_size > end)
+			end = pos->byte_offset + pos->byte_size;
+	}
+
+	return 0;
+}
+
+static size_t
+	class_member__layout_alignment(const struct class_member *self,
+				       const struct cu *cu,
+				       const struct forced_alignments *forced)
+{
+	uint32_t i;
+
+	for (i = 0; i < forced->nr; ++i)
+		if (forced->members[i] == self)
+			return forced->alignments[i];
+
+	return class_member__alignment(self, cu);
+}
+
+/**
+ * class__isolate_members - move some data members to cachelines of their own
+ * @self: the class, usually a clone, see class__clone
+ * @cu: the cu @self is in
+ * @isolate: says which members to move, looking at their original offsets
+ * @priv: passed to @isolate
+ * @cacheline_size: the cacheline size
+ *
+ * The data members @isolate picks, with the other members in the same
+ * bitfield, are moved after the others, starting at a new cacheline, and
+ * the struct is padded to a multiple of @cacheline_size, so that e.g.
+ * members written by one CPU don't share a cacheline with the ones used by
+ * others, i.e. to avoid false sharing. The offsets are then recalculated,
+ * as tight as the member alignments allow.
+ *
+ * Returns the number of members moved.
+ */
+uint32_t class__isolate_members(struct class *self, const struct cu *cu,
+				bool (*isolate)(const struct class_member *member,
+						void *priv),
+				void *priv, size_t cacheline_size)
+{
+	struct forced_alignments forced;
+	struct class_member *pos, *next, *first_isolated, *group = NULL;
+	uint32_t offset = 0, group_offset = 0, nr_isolated = 0;
+	size_t alignment = 1;
+	bool isolate_group = false;
+	LIST_HEAD(isolated);
+	LIST_HEAD(others);
+
+	/* Without the memory for it, just what the sizes say is used */
+	forced_alignments__init(&forced, self, cu);
+
+	/* Each bitfield, i.e. members at the same offset, moves as a whole */
+	type__for_each_member_safe(&self->type, pos, next) {
+		if (group == NULL || pos->byte_offset != group->byte_offset) {
+			struct class_member *gpos = pos;
+
+			group = pos;
+			isolate_group = false;
+			list_for_each_entry_from(gpos, class__tags(self),
+						 tag.node) {
+				if (gpos->tag.tag != DW_TAG_member)
+					continue;
+				if (gpos->byte_offset != group->byte_offset)
+					break;
+				if (isolate(gpos, priv))
+					isolate_group = true;
+			}
+		}
+
+		list_move_tail(&pos->tag.node,
+			       isolate_group ? &isolated : &others);
+		nr_isolated += isolate_group;
+	}
+
+	first_isolated = list_empty(&isolated) ? NULL :
+			 list_first_entry(&isolated, struct class_member,
+					  tag.node);
+	list_splice(&others, class__tags(self)->prev);
+	list_splice(&isolated, class__tags(self)->prev);
+
+	if (nr_isolated == 0)
+		goto out;
+
+	/* The ancestors stay where they are, the data members go after them */
+	list_for_each_entry(pos, class__tags(self), tag.node)
+		if (pos->tag.tag == DW_TAG_inheritance &&
+		    pos->byte_offset + pos->byte_size > offset)
+			offset = pos->byte_offset + pos->byte_size;
+
+	group = NULL;
+	type__for_each_data_member(&self->type, pos) {
+		const size_t member_alignment =
+			class_member__layout_alignment(pos, cu, &forced);
+
+		if (group == NULL || pos->byte_offset != group_offset) {
+			if (group != NULL)
+				offset = group->byte_offset + group->byte_size;
+			if (pos == first_isolated)
+				offset = roundup(offset, cacheline_size);
+			offset = roundup(offset, member_alignment);
+			group = pos;
+			group_offset = pos->byte_offset;
+		} else if (pos->byte_size > group->byte_size)
+			group = pos;
+
+		if (member_alignment > alignment)
+			alignment = member_alignment;
+		pos->byte_offset  = offset;
+		pos->hole	  = 0;
+		pos->bit_hole	  = 0;
+		pos->bitfield_end = 0;
+	}
+
+	if (group != NULL)
+		offset = group->byte_offset + group->byte_size;
+	self->type.size = roundup(roundup(offset, alignment), cacheline_size);
+	self->padding = self->bit_padding = 0;
+	class__refind_holes(self);
+out:
+	forced_alignments__exit(&forced);
+	return nr_isolated;
+}
+
+static bool names__find(const char * const *names, size_t nr_names,
+			const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nr_names; ++i)
+		if (strcmp(names[i], name) == 0)
+			return true;
+
+	return false;
+}
+
+/*
+ * Locks, atomics, refcounts, etc, written by many CPUs, going by the type
+ * name, as there is nothing else to tell them apart from other structs.
+ * Arrays of them too, but not pointers to them, those being read mostly.
+ */
+static bool class_member__is_sync(const struct class_member *self,
+				  const struct cu *cu)
+{
+	static const char * const sync_typedefs[] = {
+		"spinlock_t", "raw_spinlock_t", "arch_spinlock_t",
+		"rwlock_t", "arch_rwlock_t", "seqlock_t", "seqcount_t",
+		"atomic_t", "atomic64_t", "atomic_long_t", "refcount_t",
+		"local_t", "local64_t",
+		"pthread_mutex_t", "pthread_spinlock_t", "pthread_rwlock_t",
+		"sem_t",
+	};
+	static const char * const sync_structs[] = {
+		"mutex", "rw_semaphore", "semaphore", "qspinlock", "qrwlock",
+		"kref",
+	};
+	struct tag *type = cu__type(cu, self->tag.type);
+
+	while (type != NULL) {
+		const char *name;
+
+		if (tag__is_const(type) || tag__is_volatile(type) ||
+		    type->tag == DW_TAG_array_type) {
+			type = cu__type(cu, type->type);
+			continue;
+		}
+
+		if (!tag__is_type(type))
+			return false;
+
+		name = type__name(tag__type(type), cu);
+		if (name == NULL)
+			return false;
+		if (tag__is_struct(type))
+			return names__find(sync_structs,
+					   sizeof(sync_structs) /
+					   sizeof(sync_structs[0]), name);
+		if (names__find(sync_typedefs,
+				sizeof(sync_typedefs) /
+				sizeof(sync_typedefs[0]), name))
+			return true;
+
+		/* typedef'ed again, e.g. "typedef spinlock_t foo_lock_t;" */
+		if (!tag__is_typedef(type))
+			return false;
+		type = cu__type(cu, type->type);
+	}
+
+	return false;
+}
+
+/*
+ * A data member or a bitfield, i.e. the members at the same offset, that
+ * move together, the ones in @members from @first, @offset being the new one.
+ */
+struct layout_unit {
+	uint32_t first;
+	uint32_t nr_members;
+	uint32_t size;
+	uint32_t alignment;
+	uint32_t offset;
+	int	 group;
+	bool	 sync;
+};
+
+/*
+ * A cacheline, from @fill on still free, with @sync members, the ones of
+ * one access group, or others.
+ */
+struct layout_bin {
+	uint32_t fill;
+	bool	 sync;
+};
+
+struct layout {
+	struct layout_bin  *bins;
+	uint32_t	   nr_bins;
+	uint32_t	   nr_allocated;
+	uint32_t	   cacheline_size;
+};
+
+static struct layout_bin *layout__new_bin(struct layout *self, bool sync)
+{
+	struct layout_bin *bin;
+
+	if (self->nr_bins == self->nr_allocated) {
+		const uint32_t nr = self->nr_allocated ?
+				    self->nr_allocated * 2 : 16;
+		struct layout_bin *bins = realloc(self->bins,
+						  nr * sizeof(*bins));
+		if (bins == NULL)
+			return NULL;
+		self->bins	   = bins;
+		self->nr_allocated = nr;
+	}
+
+	bin = &self->bins[self->nr_bins];
+	bin->fill = self->nr_bins++ * self->cacheline_size;
+	bin->sync = sync;
+	return bin;
+}
+
+/*
+ * Where the @nr_units in @units end if laid out one after the other from
+ * @offset, without updating them unless @commit.
+ */
+static uint32_t layout_units__place(struct layout_unit **units,
+				    uint32_t nr_units, uint32_t offset,
+				    bool commit)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr_units; ++i) {
+		offset = roundup(offset, units[i]->alignment);
+		if (commit)
+			units[i]->offset = offset;
+		offset += units[i]->size;
+	}
+
+	return offset;
+}
+
+/*
+ * Puts @units in the first cacheline of the same kind where all of them fit
+ * or else in new ones, the sync ones always in new ones.
+ */
+static int layout__place(struct layout *self, struct layout_unit **units,
+			 uint32_t nr_units, bool sync)
+{
+	const uint32_t cacheline_size = self->cacheline_size;
+	struct layout_bin *bin;
+	uint32_t i, end;
+
+	if (nr_units == 0)
+		return 0;
+
+	for (i = 0; !sync && i < self->nr_bins; ++i) {
+		bin = &self->bins[i];
+		if (bin->sync)
+			continue;
+		end = layout_units__place(units, nr_units, bin->fill, false);
+		if (end <= (i + 1) * cacheline_size) {
+			bin->fill = layout_units__place(units, nr_units,
+							bin->fill, true);
+			return 0;
+		}
+	}
+
+	bin = layout__new_bin(self, sync);
+	if (bin == NULL)
+		return -ENOMEM;
+
+	end = layout_units__place(units, nr_units, bin->fill, true);
+	/* The cachelines it takes, the last one may have room */
+	for (;;) {
+		bin->fill = end < self->nr_bins * cacheline_size ?
+			    end : self->nr_bins * cacheline_size;
+		if (end <= self->nr_bins * cacheline_size)
+			break;
+		bin = layout__new_bin(self, sync);
+		if (bin == NULL)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Hottest group first, then the most aligned, then the biggest */
+static int layout_unit__cmp(const void *a, const void *b)
+{
+	const struct layout_unit *ua = *(const struct layout_unit **)a,
+				 *ub = *(const struct layout_unit **)b;
+	const uint32_t ga = ua->group, gb = ub->group; /* -1 goes last */
+
+	if (ga != gb)
+		return ga < gb ? -1 : 1;
+	if (ua->alignment != ub->alignment)
+		return ua->alignment > ub->alignment ? -1 : 1;
+	if (ua->size != ub->size)
+		return ua->size > ub->size ? -1 : 1;
+	return ua->first < ub->first ? -1 : 1;
+}
+
+static int layout_unit__offset_cmp(const void *a, const void *b)
+{
+	const struct layout_unit *ua = *(const struct layout_unit **)a,
+				 *ub = *(const struct layout_unit **)b;
+
+	if (ua->offset != ub->offset)
+		return ua->offset < ub->offset ? -1 : 1;
+	return ua->first < ub->first ? -1 : 1;
+}
+
+/**
+ * class__hot_cold_layout - lay out the hot members in the fewest cachelines
+ * @self: the class, usually a clone, see class__clone
+ * @cu: the cu @self is in
+ * @member_group: the hottest access group, i.e. members used together, a
+ *		  member is in, 0 being the hottest, -1 if in none, i.e. cold
+ * @priv: passed to @member_group
+ * @cacheline_size: the cacheline size
+ *
+ * The access groups, hottest first, go each to the first cacheline where
+ * they fit or to new ones, so that each touches the fewest cachelines.
+ * Their locks, atomics and refcounts, written by many CPUs, go to new
+ * cachelines, apart from the read-mostly members. The cold members then
+ * fill the space left. The alignment used is the one class__fixup_alignment
+ * assumes, the members of a bitfield stay together.
+ *
+ * Returns 0 or -ENOMEM.
+ */
+int class__hot_cold_layout(struct class *self, const struct cu *cu,
+			   int (*member_group)(const struct class_member *member,
+					       void *priv),
+			   void *priv, size_t cacheline_size)
+{
+	struct layout layout = { .cacheline_size = cacheline_size, };
+	struct forced_alignments forced = { .nr = 0, };
+	struct class_member *pos, **members = NULL;
+	struct layout_unit *units = NULL, **sorted = NULL, **sync = NULL;
+	uint32_t nr_members = 0, nr_units = 0, i, j, base = 0, end = 0;
+	size_t alignment = 1;
+	int err = -ENOMEM;
+
+	type__for_each_data_member(&self->type, pos)
+		++nr_members;
+	if (nr_members == 0)
+		return 0;
+
+	if (forced_alignments__init(&forced, self, cu) != 0)
+		return -ENOMEM;
+
+	members = malloc(nr_members * sizeof(*members));
+	units	= malloc(nr_members * sizeof(*units));
+	sorted	= malloc(nr_members * sizeof(*sorted));
+	sync	= malloc(nr_members * sizeof(*sync));
+	if (members == NULL || units == NULL || sorted == NULL || sync == NULL)
+		goto out;
+
+	nr_members = 0;
+	type__for_each_data_member(&self->type, pos) {
+		struct layout_unit *unit = nr_units ? &units[nr_units - 1] : NULL;
+		const int group = member_group(pos, priv);
+		const uint32_t size = pos->byte_size;
+		const size_t member_alignment =
+			class_member__layout_alignment(pos, cu, &forced);
+
+		if (unit == NULL ||
+		    members[unit->first]->byte_offset != pos->byte_offset) {
+			unit = &units[nr_units];
+			sorted[nr_units++] = unit;
+			unit->first	 = nr_members;
+			unit->nr_members = 0;
+			unit->size	 = 0;
+			unit->alignment	 = 1;
+			unit->group	 = -1;
+			unit->sync	 = false;
+		}
+
+		members[nr_members++] = pos;
+		++unit->nr_members;
+		if (size > unit->size)
+			unit->size = size;
+		if (member_alignment > unit->alignment)
+			unit->alignment = member_alignment;
+		if (group >= 0 && (unit->group < 0 || group < unit->group))
+			unit->group = group;
+		if (class_member__is_sync(pos, cu))
+			unit->sync = true;
+	}
+
+	/* The ancestors stay where they are, the data members go after them */
+	list_for_each_entry(pos, class__tags(self), tag.node)
+		if (pos->tag.tag == DW_TAG_inheritance &&
+		    pos->byte_offset + pos->byte_size > base)
+			base = pos->byte_offset + pos->byte_size;
+	do {
+		if (layout__new_bin(&layout, false) == NULL)
+			goto out;
+	} while (layout.nr_bins * cacheline_size < base);
+	layout.bins[layout.nr_bins - 1].fill = base;
+	for (i = 0; i + 1 < layout.nr_bins; ++i)
+		layout.bins[i].fill = (i + 1) * cacheline_size;
+
+	qsort(sorted, nr_units, sizeof(*sorted), layout_unit__cmp);
+
+	/* Each group, the read-mostly members then the sync ones */
+	for (i = 0; i < nr_units && sorted[i]->group >= 0; i = j) {
+		uint32_t nr_data = 0, nr_sync = 0;
+
+		for (j = i; j < nr_units && sorted[j]->group == sorted[i]->group;
+		     ++j) {
+			if (sorted[j]->sync)
+				sync[nr_sync++] = sorted[j];
+			else
+				sorted[i + nr_data++] = sorted[j];
+		}
+		memcpy(sorted + i + nr_data, sync, nr_sync * sizeof(*sync));
+
+		if (layout__place(&layout, sorted + i, nr_data, false) != 0 ||
+		    layout__place(&layout, sorted + i + nr_data, nr_sync,
+				  true) != 0)
+			goto out;
+	}
+
+	/* The cold ones, one by one, filling what is left */
+	for (; i < nr_units; ++i)
+		if (layout__place(&layout, sorted + i, 1, false) != 0)
+			goto out;
+
+	/* Back in offset order */
+	qsort(sorted, nr_units, sizeof(*sorted), layout_unit__offset_cmp);
+	for (i = 0; i < nr_units; ++i) {
+		const struct layout_unit *unit = sorted[i];
+
+		for (j = 0; j < unit->nr_members; ++j) {
+			pos = members[unit->first + j];
+			pos->byte_offset  = unit->offset;
+			pos->hole	  = 0;
+			pos->bit_hole	  = 0;
+			pos->bitfield_end = 0;
+			list_move_tail(&pos->tag.node, class__tags(self));
+		}
+		if (unit->offset + unit->size > end)
+			end = unit->offset + unit->size;
+		if (unit->alignment > alignment)
+			alignment = unit->alignment;
+	}
+
+	self->type.size = roundup(end, alignment);
+	self->padding = self->bit_padding = 0;
+	class__refind_holes(self);
+	err = 0;
+out:
+	forced_alignments__exit(&forced);
+	free(layout.bins);
+	free(sync);
+	free(sorted);
+	free(units);
+	free(members);
+	return err;
+}
+
+/*
+ * For class__pack: a data member or the members overlapping it, e.g. a
+ * bitfield, that move together, from @start now, to @offset.
+ */
+struct pack_unit {
+	uint32_t first;
+	uint32_t nr_members;
+	uint32_t start;
+	uint32_t size;
+	uint32_t alignment;
+	uint32_t offset;
+};
+
+/*
+ * The units with the same @alignment and the same @size modulo the struct
+ * alignment, that as far as padding goes can be swapped, in their original
+ * order, the first @nr_used of them already placed.
+ */
+struct pack_kind {
+	uint32_t *units;
+	uint32_t nr_units;
+	uint32_t nr_used;
+	uint32_t alignment;
+	uint32_t size;
+};
+
+/*
+ * @failed: hashes of the states, units placed of each kind and offset, from
+ * where no order fits in @bound, @hash being the one of the units placed.
+ */
+struct pack {
+	struct pack_unit *units;
+	struct pack_kind *kinds;
+	uint32_t	 *seq;
+	uint64_t	 *failed;
+	uint32_t	 nr_failed;
+	uint32_t	 nr_failed_allocated;
+	uint32_t	 nr_kinds;
+	uint32_t	 nr_units;
+	uint32_t	 alignment;
+	uint32_t	 bound;
+	uint64_t	 hash;
+	uint64_t	 nr_nodes;
+	struct timespec	 deadline;
+	bool		 timed_out;
+};
+
+#define PACK_MAX_FAILED (1 << 20)
+
+static uint64_t pack__mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return (x ^ (x >> 31)) ?: 1;
+}
+
+static bool pack__has_failed(const struct pack *self, uint64_t key)
+{
+	uint32_t i;
+
+	if (self->nr_failed == 0)
+		return false;
+
+	for (i = key & (self->nr_failed_allocated - 1);
+	     self->failed[i] != 0;
+	     i = (i + 1) & (self->nr_failed_allocated - 1))
+		if (self->failed[i] == key)
+			return true;
+	return false;
+}
+
+/* Just forgets it when out of memory, it is only a shortcut */
+static void pack__add_failed(struct pack *self, uint64_t key)
+{
+	uint32_t i;
+
+	if (self->nr_failed * 2 >= self->nr_failed_allocated) {
+		const uint32_t nr = self->nr_failed_allocated ?
+				    self->nr_failed_allocated * 2 : 1024;
+		uint64_t *failed;
+
+		if (nr > PACK_MAX_FAILED)
+			return;
+		failed = calloc(nr, sizeof(*failed));
+		if (failed == NULL)
+			return;
+		for (i = 0; i < self->nr_failed_allocated; ++i) {
+			uint32_t j;
+
+			if (self->failed[i] == 0)
+				continue;
+			for (j = self->failed[i] & (nr - 1); failed[j] != 0;
+			     j = (j + 1) & (nr - 1))
+				;
+			failed[j] = self->failed[i];
+		}
+		free(self->failed);
+		self->failed		  = failed;
+		self->nr_failed_allocated = nr;
+	}
+
+	for (i = key & (self->nr_failed_allocated - 1); self->failed[i] != 0;
+	     i = (i + 1) & (self->nr_failed_allocated - 1))
+		;
+	self->failed[i] = key;
+	++self->nr_failed;
+}
+
+static bool pack__timed_out(struct pack *self)
+{
+	struct timespec now;
+
+	if (self->timed_out || (++self->nr_nodes & 1023) != 0)
+		return self->timed_out;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > self->deadline.tv_sec ||
+	    (now.tv_sec == self->deadline.tv_sec &&
+	     now.tv_nsec >= self->deadline.tv_nsec))
+		self->timed_out = true;
+	return self->timed_out;
+}
+
+/*
+ * Looks for an order for the units not yet placed, from @offset on, with
+ * @remaining bytes in them, that makes the struct at most self->bound bytes
+ * long, trying first the kind with the unit that comes first now, so that
+ * the first order found is as close as possible to the original one. The
+ * kind placed at each @depth is left in self->seq.
+ *
+ * Returns the size of the struct or 0 if not found or timed out.
+ */
+static uint32_t pack__search(struct pack *self, uint32_t depth,
+			     uint32_t offset, uint32_t remaining)
+{
+	const uint64_t key = self->hash ^ pack__mix(offset);
+	int64_t last = -1;
+
+	if (roundup(offset + remaining, self->alignment) > self->bound ||
+	    pack__timed_out(self))
+		return 0;
+	if (depth == self->nr_units)
+		return roundup(offset, self->alignment);
+	if (pack__has_failed(self, key))
+		return 0;
+
+	for (;;) {
+		struct pack_kind *kind = NULL;
+		const struct pack_unit *unit;
+		uint32_t head = UINT32_MAX, size, i;
+		uint64_t kind_hash;
+
+		for (i = 0; i < self->nr_kinds; ++i) {
+			const struct pack_kind *pos = &self->kinds[i];
+			uint32_t pos_head;
+
+			if (pos->nr_used == pos->nr_units)
+				continue;
+			pos_head = pos->units[pos->nr_used];
+			if (pos_head > last && pos_head < head) {
+				head = pos_head;
+				kind = &self->kinds[i];
+			}
+		}
+		if (kind == NULL) {
+			pack__add_failed(self, key);
+			return 0;
+		}
+
+		last = head;
+		unit = &self->units[head];
+		self->seq[depth] = kind - self->kinds;
+		/* Not to be confused with the offsets */
+		kind_hash = pack__mix(UINT32_MAX + (uint64_t)self->seq[depth]);
+		++kind->nr_used;
+		self->hash += kind_hash;
+		size = pack__search(self, depth + 1,
+				    roundup(offset, unit->alignment) +
+				    unit->size, remaining - unit->size);
+		self->hash -= kind_hash;
+		--kind->nr_used;
+		if (size != 0 || self->timed_out)
+			return size;
+	}
+}
+
+/* Most aligned first, that has no padding when sizes are multiple of it */
+static int pack_kind__alignment_cmp(const void *a, const void *b)
+{
+	const struct pack_kind *ka = a, *kb = b;
+
+	if (ka->alignment != kb->alignment)
+		return ka->alignment > kb->alignment ? -1 : 1;
+	return ka->units[0] < kb->units[0] ? -1 : 1;
+}
+
+/**
+ * class__pack - find the smallest layout for a class
+ * @self: the class, a clone, see class__clone, as it is changed on failure too
+ * @cu: the cu @self is in
+ * @budget_ms: milliseconds to spend looking for it
+ * @fp: where to print the warnings, as in class__reorganize
+ *
+ * After combining bitfields as class__reorganize does, the data members,
+ * with the ones overlapping them, i.e. bitfields, as a unit, are grouped by
+ * alignment and by size modulo the struct alignment, and the orders of the
+ * groups are searched, branch and bound, for the one with the smallest
+ * struct size, taking first the groups with the members that come first,
+ * so that the layout found changes as little as possible. Ancestors stay
+ * first, zero sized members, i.e. flexible arrays, last.
+ *
+ * The alignments are the ones class__fixup_alignment assumes, except for
+ * members that have before them a hole they would fit in, that are assumed
+ * to be explicitly aligned, as much as needed to get that hole.
+ *
+ * The member types and bitfields of @self are fixed up and combined, as
+ * class__reorganize does, whatever is returned, its data members are only
+ * moved if that makes it smaller. Returns 0, -ENOMEM, -EINVAL if
+ * the layout can't be modelled, e.g. members overlapping at offsets not
+ * multiple of their alignment, or -ETIMEDOUT if the smallest layout wasn't
+ * found in @budget_ms, for class__reorganize to be used instead.
+ */
+int class__pack(struct class *self, const struct cu *cu,
+		unsigned int budget_ms, FILE *fp)
+{
+	struct pack pack = { .alignment = 1, };
+	struct forced_alignments forced = { .nr = 0, };
+	struct class_member *pos, **members = NULL;
+	uint32_t *kind_units = NULL, *best_seq = NULL;
+	const uint32_t orig_size = class__size(self);
+	uint32_t nr_members = 0, nr_units = 0, base = 0,
+		 end, sum = 0, lower_bound, best, i, j;
+	bool proven;
+	int err = -ENOMEM;
+
+	list_for_each_entry(pos, class__tags(self), tag.node) {
+		if (pos->tag.tag == DW_TAG_member)
+			++nr_members;
+		else if (pos->tag.tag == DW_TAG_inheritance) {
+			if (pos->virtuality == DW_VIRTUALITY_virtual)
+				return -EINVAL;
+			if (pos->byte_offset + pos->byte_size > base)
+				base = pos->byte_offset + pos->byte_size;
+			if (class_member__alignment(pos, cu) > pack.alignment)
+				pack.alignment = class_member__alignment(pos,
+									 cu);
+		}
+	}
+	if (nr_members == 0)
+		return 0;
+
+	/* Before class__demote_bitfields makes holes of its own */
+	if (forced_alignments__init(&forced, self, cu) != 0)
+		return -ENOMEM;
+
+	members	   = malloc(nr_members * sizeof(*members));
+	pack.units = malloc(nr_members * sizeof(*pack.units));
+	pack.kinds = malloc(nr_members * sizeof(*pack.kinds));
+	pack.seq   = malloc(nr_members * sizeof(*pack.seq));
+	best_seq   = malloc(nr_members * sizeof(*best_seq));
+	kind_units = malloc(nr_members * sizeof(*kind_units));
+	if (members == NULL || pack.units == NULL || pack.kinds == NULL ||
+	    pack.seq == NULL || best_seq == NULL || kind_units == NULL)
+		goto out;
+
+	end = base;
+	type__for_each_data_member(&self->type, pos)
+		if (pos->byte_offset + pos->byte_size > end)
+			end = pos->byte_offset + pos->byte_size;
+	/* Explicitly aligned too, e.g. with __aligned(64) */
+	if (orig_size > end && orig_size - end >= cu->addr_size &&
+	    (orig_size & -orig_size) > pack.alignment)
+		pack.alignment = orig_size & -orig_size;
+
+	class__fixup_member_types(self, cu, 0, fp);
+	while (class__demote_bitfields(self, cu, 0, fp))
+		class__reorganize_bitfields(self, cu, 0, fp);
+
+	/* By offset, keeping the list order for the same offset */
+	nr_members = 0;
+	type__for_each_data_member(&self->type, pos) {
+		for (i = nr_members++;
+		     i > 0 && members[i - 1]->byte_offset > pos->byte_offset;
+		     --i)
+			members[i] = members[i - 1];
+		members[i] = pos;
+	}
+
+	for (i = 0; i < nr_members; ++i) {
+		struct pack_unit *unit = nr_units ? &pack.units[nr_units - 1] :
+						    NULL;
+		uint32_t alignment, rel;
+
+		pos = members[i];
+		if (unit == NULL ||
+		    (pos->byte_offset >= unit->start + unit->size &&
+		     pos->byte_offset != unit->start)) {
+			unit = &pack.units[nr_units++];
+			unit->first	 = i;
+			unit->nr_members = 0;
+			unit->start	 = pos->byte_offset;
+			unit->size	 = 0;
+			unit->alignment	 = 1;
+		}
+
+		++unit->nr_members;
+		if (pos->byte_offset + pos->byte_size >
+		    unit->start + unit->size)
+			unit->size = pos->byte_offset + pos->byte_size -
+				     unit->start;
+		alignment = class_member__layout_alignment(pos, cu, &forced);
+		rel = pos->byte_offset - unit->start;
+		if (rel % alignment != 0) {
+			err = -EINVAL;
+			goto out;
+		}
+		if (alignment > unit->alignment)
+			unit->alignment = alignment;
+	}
+
+	for (i = 0; i < nr_units; ++i)
+		if (pack.units[i].alignment > pack.alignment)
+			pack.alignment = pack.units[i].alignment;
+
+	/* The kinds, the zero sized units go last, in no kind */
+	for (i = 0; i < nr_units; ++i) {
+		const struct pack_unit *unit = &pack.units[i];
+		struct pack_kind *kind = NULL;
+
+		if (unit->size == 0)
+			continue;
+		sum += unit->size;
+		++pack.nr_units;
+		for (j = 0; j < pack.nr_kinds; ++j)
+			if (pack.kinds[j].alignment == unit->alignment &&
+			    pack.kinds[j].size == unit->size % pack.alignment)
+				kind = &pack.kinds[j];
+		if (kind == NULL) {
+			kind = &pack.kinds[pack.nr_kinds++];
+			kind->nr_units	= 0;
+			kind->nr_used	= 0;
+			kind->alignment	= unit->alignment;
+			kind->size	= unit->size % pack.alignment;
+		}
+		++kind->nr_units;
+	}
+	for (i = 0, j = 0; i < pack.nr_kinds; ++i) {
+		pack.kinds[i].units = kind_units + j;
+		j += pack.kinds[i].nr_units;
+		pack.kinds[i].nr_units = 0;
+	}
+	for (i = 0; i < nr_units; ++i) {
+		const struct pack_unit *unit = &pack.units[i];
+
+		if (unit->size == 0)
+			continue;
+		for (j = 0; j < pack.nr_kinds; ++j) {
+			struct pack_kind *kind = &pack.kinds[j];
+
+			if (kind->alignment == unit->alignment &&
+			    kind->size == unit->size % pack.alignment) {
+				kind->units[kind->nr_units++] = i;
+				break;
+			}
+		}
+	}
+
+	err = 0;
+	if (pack.nr_units == 0)
+		goto out;
+
+	/* The most aligned first, to start with something good */
+	qsort(pack.kinds, pack.nr_kinds, sizeof(*pack.kinds),
+	      pack_kind__alignment_cmp);
+	end = base;
+	for (i = 0, j = 0; i < pack.nr_kinds; ++i) {
+		const struct pack_kind *kind = &pack.kinds[i];
+		uint32_t k;
+
+		for (k = 0; k < kind->nr_units; ++k) {
+			const struct pack_unit *unit =
+						&pack.units[kind->units[k]];
+
+			end = roundup(end, unit->alignment) + unit->size;
+			best_seq[j++] = i;
+		}
+	}
+	best	    = roundup(end, pack.alignment);
+	lower_bound = roundup(base + sum, pack.alignment);
+	proven	    = best == lower_bound;
+
+	clock_gettime(CLOCK_MONOTONIC, &pack.deadline);
+	pack.deadline.tv_sec  += budget_ms / 1000;
+	pack.deadline.tv_nsec += (budget_ms % 1000) * 1000000L;
+	if (pack.deadline.tv_nsec >= 1000000000L) {
+		pack.deadline.tv_nsec -= 1000000000L;
+		++pack.deadline.tv_sec;
+	}
+
+	/*
+	 * As small as the fallback but closer to the original, then smaller
+	 * ones till none is found.
+	 */
+	for (pack.bound = best; pack.bound >= lower_bound;
+	     pack.bound = best - pack.alignment) {
+		/* What doesn't fit in a bound doesn't in a smaller one */
+		const uint32_t size = pack__search(&pack, 0, base, sum);
+
+		if (size == 0) {
+			if (!pack.timed_out)
+				proven = true;
+			break;
+		}
+		best = size;
+		memcpy(best_seq, pack.seq, pack.nr_units * sizeof(*best_seq));
+		if (best == lower_bound) {
+			proven = true;
+			break;
+		}
+	}
+
+	if (!proven) {
+		err = -ETIMEDOUT;
+		goto out;
+	}
+
+	if (best >= orig_size)
+		goto out;
+
+	/* The units in the order found, the zero sized ones at the end */
+	end = base;
+	for (i = 0; i < pack.nr_units; ++i) {
+		struct pack_kind *kind = &pack.kinds[best_seq[i]];
+		struct pack_unit *unit =
+				&pack.units[kind->units[kind->nr_used++]];
+
+		unit->offset = roundup(end, unit->alignment);
+		end = unit->offset + unit->size;
+		pack.seq[i] = unit - pack.units;
+	}
+	for (i = 0, j = pack.nr_units; i < nr_units; ++i) {
+		struct pack_unit *unit = &pack.units[i];
+
+		if (unit->size != 0)
+			continue;
+		unit->alignment = unit->start & -unit->start;
+		if (unit->alignment == 0 || unit->alignment > pack.alignment)
+			unit->alignment = pack.alignment;
+		unit->offset = roundup(end, unit->alignment);
+		pack.seq[j++] = i;
+	}
+
+	for (i = 0; i < nr_units; ++i) {
+		const struct pack_unit *unit = &pack.units[pack.seq[i]];
+
+		for (j = 0; j < unit->nr_members; ++j) {
+			pos = members[unit->first + j];
+			pos->byte_offset  = unit->offset + (pos->byte_offset -
+							    unit->start);
+			pos->hole	  = 0;
+			pos->bit_hole	  = 0;
+			pos->bitfield_end = 0;
+			list_move_tail(&pos->tag.node, class__tags(self));
+		}
+	}
+
+	self->type.size = best;
+	self->padding = self->bit_padding = 0;
+	class__refind_holes(self);
+out:
+	free(pack.failed);
+	free(kind_units);
+	free(best_seq);
+	free(pack.seq);
+	free(pack.kinds);
+	free(pack.units);
+	forced_alignments__exit(&forced);
+	free(members);
+	return err;
+}
+
+/**
+ * class__size_lower_bound - the smallest size reorganizing a class can get
+ * @self: the class
+ * @cu: the cu @self is in
+ *
+ * From the bytes in the data members, the bitfields taking just the bits
+ * they use, after the ancestors and aligned to the least aligned member,
+ * rounded up to the most aligned one, as class__pack can't do better. Its
+ * holes and padding don't matter, just their members, so that it can be
+ * used to avoid cloning and reorganizing @self when it can't get smaller.
+ *
+ * Returns the bound or 0 if there is none, e.g. with virtual ancestors.
+ */
+size_t class__size_lower_bound(struct class *self, const struct cu *cu)
+{
+	size_t base = 0, bytes = 0, bits = 0, alignment = 1,
+	       min_alignment = SIZE_MAX;
+	struct class_member *pos;
+
+	list_for_each_entry(pos, class__tags(self), tag.node) {
+		const size_t member_alignment = class_member__alignment(pos,
+									cu);
+
+		if (pos->tag.tag == DW_TAG_inheritance) {
+			if (pos->virtuality == DW_VIRTUALITY_virtual)
+				return 0;
+			if (pos->byte_offset + pos->byte_size > base)
+				base = pos->byte_offset + pos->byte_size;
+		} else if (pos->tag.tag != DW_TAG_member)
+			continue;
+		else if (pos->bitfield_size != 0) {
+			/* Its type may be demoted, see class__demote_bitfields */
+			bits += pos->bitfield_size;
+			min_alignment = 1;
+			continue;
+		} else if (pos->byte_size != 0) {
+			bytes += pos->byte_size;
+			if (member_alignment < min_alignment)
+				min_alignment = member_alignment;
+		}
+
+		if (member_alignment > alignment)
+			alignment = member_alignment;
+	}
+
+	if (min_alignment == SIZE_MAX)
+		return roundup(base, alignment);
+
+	return roundup(roundup(base, min_alignment) + bytes + (bits + 7) / 8,
+		       alignment);
+}
@@ -11,6 +11,7 @@
 */
 
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -29,4 +30,19 @@ void class__fixup_alignment(struct class *self, const struct cu *cu);
 void class__reorganize(struct class *self, const struct cu *cu,
 		       const int verbose, FILE *fp);
 
+uint32_t class__isolate_members(struct class *self, const struct cu *cu,
+				bool (*isolate)(const struct class_member *member,
+						void *priv),
+				void *priv, size_t cacheline_size);
+
+int class__hot_cold_layout(struct class *self, const struct cu *cu,
+			   int (*member_group)(const struct class_member *member,
+					       void *priv),
+			   void *priv, size_t cacheline_size);
+
+int class__pack(struct class *self, const struct cu *cu,
+		unsigned int budget_ms, FILE *fp);
+
+size_t class__size_lower_bound(struct class *self, const struct cu *cu);
+
 #endif /* _DWARVES_REORGANIZE_H_ */
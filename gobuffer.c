@@ -11,17 +11,36 @@
 #include "gobuffer.h"
 
 #include <search.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <zlib.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 #include "dutil.h"
 
 #define GOBUFFER__BCHUNK (8 * 1024)
 #define GOBUFFER__ZCHUNK (8 * 1024)
+/*
+ * Buffers marked with gobuffer__use_mmap move to an anonymous mapping when
+ * they get past this size, from then on they grow with mremap, that can
+ * move the pages instead of copying them.
+ */
+#define GOBUFFER__MMAP_THRESHOLD (64 * 1024 * 1024)
+
+/*
+ * The buffers a shared gobuffer moved away from, kept until it is deleted
+ * for the threads that may still be reading them.
+ */
+struct gobuffer_old_entries {
+	struct gobuffer_old_entries *next;
+	char			    *entries;
+	unsigned int		    allocated_size;
+	bool			    mmaped;
+};
 
 void gobuffer__init(struct gobuffer *self)
 {
@@ -29,6 +48,10 @@ void gobuffer__init(struct gobuffer *self)
 	self->nr_entries = self->allocated_size = 0;
 	/* 0 == NULL */
 	self->index = 1;
+	self->use_mmap = false;
+	self->mmaped = false;
+	self->shared = false;
+	self->old_entries = NULL;
 }
 
 struct gobuffer *gobuffer__new(void)
@@ -41,9 +64,27 @@ struct gobuffer *gobuffer__new(void)
 	return self;
 }
 
+static void gobuffer__free_entries(char *entries, unsigned int allocated_size,
+				   bool mmaped)
+{
+	if (mmaped)
+		munmap(entries, allocated_size);
+	else
+		free(entries);
+}
+
 void __gobuffer__delete(struct gobuffer *self)
 {
-	free(self->entries);
+	while (self->old_entries != NULL) {
+		struct gobuffer_old_entries *old = self->old_entries;
+
+		self->old_entries = old->next;
+		gobuffer__free_entries(old->entries, old->allocated_size,
+				       old->mmaped);
+		free(old);
+	}
+	gobuffer__free_entries(self->entries, self->allocated_size,
+			       self->mmaped);
 }
 
 void gobuffer__delete(struct gobuffer *self)
@@ -52,9 +93,132 @@ void gobuffer__delete(struct gobuffer *self)
 	free(self);
 }
 
+/**
+ * gobuffer__use_mmap - allow big buffers to be backed by mmap/mremap
+ * @self: the buffer
+ *
+ * Only takes effect once the buffer grows past GOBUFFER__MMAP_THRESHOLD.
+ */
+void gobuffer__use_mmap(struct gobuffer *self)
+{
+	self->use_mmap = true;
+}
+
+/**
+ * gobuffer__share - let other threads read @self while entries are added
+ * @self: the buffer
+ *
+ * From then on growing the buffer copies it to a new one, leaving the old
+ * one in place until @self is deleted, so that the pointers gobuffer__ptr
+ * returned for entries already added stay valid. The entries must have been
+ * made visible to the readers by other means, a lock say. As the buffer
+ * grows geometrically the old ones take, at most, as much as the current one.
+ */
+void gobuffer__share(struct gobuffer *self)
+{
+	self->shared = true;
+}
+
 void *gobuffer__ptr(const struct gobuffer *self, unsigned int s)
 {
-	return s ? self->entries + s : NULL;
+	/* Pairs with the release in gobuffer__move_entries */
+	char *entries = __atomic_load_n(&self->entries, __ATOMIC_ACQUIRE);
+
+	return s ? entries + s : NULL;
+}
+
+static int gobuffer__move_entries(struct gobuffer *self,
+				  unsigned int allocated_size)
+{
+	struct gobuffer_old_entries *old = NULL;
+	bool mmaped = self->use_mmap &&
+		      allocated_size >= GOBUFFER__MMAP_THRESHOLD;
+	char *entries;
+
+	if (self->entries != NULL) {
+		old = malloc(sizeof(*old));
+		if (old == NULL)
+			return -ENOMEM;
+	}
+
+	if (mmaped) {
+		entries = mmap(NULL, allocated_size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (entries == MAP_FAILED)
+			entries = NULL;
+	} else
+		entries = malloc(allocated_size);
+
+	if (entries == NULL) {
+		free(old);
+		return -ENOMEM;
+	}
+
+	if (old != NULL) {
+		memcpy(entries, self->entries, self->index);
+		old->entries	    = self->entries;
+		old->allocated_size = self->allocated_size;
+		old->mmaped	    = self->mmaped;
+		old->next	    = self->old_entries;
+		self->old_entries   = old;
+	}
+
+	self->allocated_size = allocated_size;
+	self->mmaped	     = mmaped;
+	__atomic_store_n(&self->entries, entries, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int gobuffer__resize(struct gobuffer *self, unsigned int allocated_size)
+{
+	char *entries;
+
+	if (self->shared)
+		return gobuffer__move_entries(self, allocated_size);
+
+	if (self->mmaped) {
+		entries = mremap(self->entries, self->allocated_size,
+				 allocated_size, MREMAP_MAYMOVE);
+		if (entries == MAP_FAILED)
+			return -ENOMEM;
+	} else if (self->use_mmap &&
+		   allocated_size >= GOBUFFER__MMAP_THRESHOLD) {
+		entries = mmap(NULL, allocated_size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (entries == MAP_FAILED)
+			return -ENOMEM;
+		if (self->entries != NULL) {
+			memcpy(entries, self->entries, self->index);
+			free(self->entries);
+		}
+		self->mmaped = true;
+	} else {
+		entries = realloc(self->entries, allocated_size);
+		if (entries == NULL)
+			return -ENOMEM;
+	}
+
+	self->allocated_size = allocated_size;
+	self->entries = entries;
+	return 0;
+}
+
+/**
+ * gobuffer__reserve - make room for @size bytes in @self
+ * @self: the buffer
+ * @size: the total size to allocate, what is already in use included, it
+ *	  does nothing if at least that much is already allocated
+ *
+ * A size hint for when the final size is known or can be estimated, such
+ * as the size of the ELF section the entries come from, so that the
+ * buffer doesn't have to be grown, and copied, several times.
+ */
+int gobuffer__reserve(struct gobuffer *self, unsigned int size)
+{
+	if (size <= self->allocated_size)
+		return 0;
+
+	return gobuffer__resize(self, size);
 }
 
 int gobuffer__allocate(struct gobuffer *self, unsigned int len)
@@ -63,17 +227,19 @@ int gobuffer__allocate(struct gobuffer *self, unsigned int len)
 	const unsigned int index = self->index + len;
 
 	if (index >= self->allocated_size) {
-		unsigned int allocated_size = (self->allocated_size +
+		unsigned int allocated_size = (self->allocated_size ?:
 					       GOBUFFER__BCHUNK);
-		if (allocated_size < index)
-			allocated_size = index + GOBUFFER__BCHUNK;
-		char *entries = realloc(self->entries, allocated_size);
+		/* Grow geometrically, amortizing the copies */
+		while (allocated_size <= index) {
+			if (allocated_size > UINT_MAX / 2) {
+				allocated_size = UINT_MAX;
+				break;
+			}
+			allocated_size *= 2;
+		}
 
-		if (entries == NULL)
+		if (gobuffer__resize(self, allocated_size) < 0)
 			return -ENOMEM;
-
-		self->allocated_size = allocated_size;
-		self->entries = entries;
 	}
 
 	self->index = index;
@@ -112,14 +278,15 @@ const void *gobuffer__compress(struct gobuffer *self, unsigned int *size)
 		goto out_free;
 
 	do {
-		const unsigned int new_bf_size = bf_size + GOBUFFER__ZCHUNK;
+		const unsigned int new_bf_size = (bf_size ? bf_size * 2 :
+						  GOBUFFER__ZCHUNK);
 		void *nbf = realloc(bf, new_bf_size);
 
 		if (nbf == NULL)
 			goto out_close_and_free;
 
 		bf = nbf;
-		z.avail_out = GOBUFFER__ZCHUNK;
+		z.avail_out = new_bf_size - bf_size;
 		z.next_out  = (Bytef *)bf + bf_size;
 		bf_size	    = new_bf_size;
 		if (deflate(&z, Z_FINISH) == Z_STREAM_ERROR)
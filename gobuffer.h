@@ -8,11 +8,19 @@
   published by the Free Software Foundation.
 */
 
+#include <stdbool.h>
+
+struct gobuffer_old_entries;
+
 struct gobuffer {
 	char		*entries;
 	unsigned int	nr_entries;
 	unsigned int	index;
 	unsigned int	allocated_size;
+	bool		use_mmap;
+	bool		mmaped;
+	bool		shared;
+	struct gobuffer_old_entries *old_entries;
 };
 
 struct gobuffer *gobuffer__new(void);
@@ -21,6 +29,10 @@ void gobuffer__init(struct gobuffer *self);
 void gobuffer__delete(struct gobuffer *self);
 void __gobuffer__delete(struct gobuffer *self);
 
+void gobuffer__use_mmap(struct gobuffer *self);
+void gobuffer__share(struct gobuffer *self);
+int gobuffer__reserve(struct gobuffer *self, unsigned int size);
+
 void gobuffer__copy(const struct gobuffer *self, void *dest);
 
 int gobuffer__add(struct gobuffer *self, const void *s, unsigned int len);
@@ -10,24 +10,45 @@
 
 #include <argp.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <dwarf.h>
 #include <search.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include "dwarves_reorganize.h"
 #include "dwarves.h"
 #include "dutil.h"
 #include "ctf_encoder.h"
+#include "hash.h"
+#include "snapshot.h"
 
 static bool ctf_encode;
+static char *snapshot_filename;
+static struct snapshot_writer *snapshot_writer;
 static bool first_obj_only;
+static bool dedup_layouts;
+static char *instances_filename;
+static char *accesses_filename;
+static char *c2c_filename;
+static char *access_groups_filename;
+static char *serve_socket;
+static char *client_socket;
 
 static uint8_t class__include_anonymous;
 static uint8_t class__include_nested_anonymous;
-static uint8_t word_size, original_word_size;
+static uint8_t word_size;
 
 static char *class__exclude_prefix;
 static size_t class__exclude_prefix_len;
@@ -54,9 +75,15 @@ static int reorganize;
 static bool show_private_classes;
 static bool defined_in;
 static int show_reorg_steps;
+static unsigned int reorg_budget_ms = 10;
+static bool reorg_benchmark;
 static char *class_name;
 static struct strlist *class_names;
+/* Just the structs in class_names, from -C or --access_groups */
+static bool filter_classes;
 static char separator = '\t';
+static int nr_jobs;
+static struct cu_pipeline *cu_pipeline;
 
 static struct conf_fprintf conf = {
 	.emit_stats = 1,
@@ -64,15 +91,45 @@ static struct conf_fprintf conf = {
 
 static struct conf_load conf_load;
 
+/*
+ * @layout: class__layout_hash, with --dedup_layouts, 0 otherwise
+ * @first_cu: the first cu, in load order, found to have this struct by the
+ *	      formatter threads, see structures__claim
+ * @nr_cus: number of cus where it was found, @last_cu is the last of them
+ * @nr_layouts: number of layouts found for @name, see print_layouts
+ * @reorg_cu: the cu where @size to @new_nr_cachelines come from, with -R
+ *	      and no -C or with --instances, see structure__reorganize
+ * @wasted: bytes in holes and padding
+ * @greedy_size: with --reorg_benchmark, the size class__reorganize gets,
+ *		 @new_size being the one class__pack gets, in @pack_ns, or,
+ *		 with @pack_fallback, class__reorganize after it timed out
+ */
 struct structure {
 	struct list_head  node;
 	struct rb_node	  rb_node;
 	char		  *name;
+	uint64_t	  layout;
 	uint32_t	  nr_files;
 	uint32_t	  nr_methods;
+	uint32_t	  first_cu;
+	uint32_t	  nr_cus;
+	uint32_t	  last_cu;
+	uint32_t	  nr_layouts;
+	uint32_t	  reorg_cu;
+	uint32_t	  size;
+	uint32_t	  new_size;
+	uint32_t	  wasted;
+	uint16_t	  nr_holes;
+	uint16_t	  nr_bit_holes;
+	uint16_t	  nr_cachelines;
+	uint16_t	  new_nr_cachelines;
+	uint32_t	  greedy_size;
+	bool		  pack_fallback;
+	uint64_t	  greedy_ns;
+	uint64_t	  pack_ns;
 };
 
-static struct structure *structure__new(const char *name)
+static struct structure *structure__new(const char *name, uint64_t layout)
 {
 	struct structure *self = malloc(sizeof(*self));
 
@@ -82,8 +139,14 @@ static struct structure *structure__new(const char *name)
 			free(self);
 			return NULL;
 		}
-		self->nr_files   = 1;
+		self->layout	 = layout;
+		self->nr_files   = 0;
 		self->nr_methods = 0;
+		self->first_cu	 = UINT32_MAX;
+		self->nr_cus	 = 0;
+		self->last_cu	 = 0;
+		self->nr_layouts = 1;
+		self->reorg_cu	 = UINT32_MAX;
 	}
 
 	return self;
@@ -95,59 +158,158 @@ static void structure__delete(struct structure *self)
 	free(self);
 }
 
-static struct rb_root structures__tree = RB_ROOT;
+/*
+ * The formatter threads look up structs by name concurrently, so the set is
+ * split in several trees, each with its own lock.
+ */
+#define STRUCTURES__BITS 6
+#define STRUCTURES__NR_TREES (1 << STRUCTURES__BITS)
+
+static struct structures_tree {
+	pthread_mutex_t lock;
+	struct rb_root	root;
+} structures__trees[STRUCTURES__NR_TREES];
+
+/* Only touched from the loader thread or, in cu order, when merging */
 static LIST_HEAD(structures__list);
 
-static struct structure *structures__add(struct class *class,
-					 const struct cu *cu,
-					 bool *existing_entry)
+static void structures__init(void)
+{
+	int i;
+
+	for (i = 0; i < STRUCTURES__NR_TREES; ++i) {
+		pthread_mutex_init(&structures__trees[i].lock, NULL);
+		structures__trees[i].root = RB_ROOT;
+	}
+}
+
+static struct structures_tree *structures__find_tree(const char *name)
+{
+	uint32_t hash = 0;
+
+	while (*name != '\0')
+		hash = hash * 31 + *name++;
+
+	return &structures__trees[hash_32(hash, STRUCTURES__BITS)];
+}
+
+static int structure__cmp(const struct structure *self, const char *name,
+			  uint64_t layout)
+{
+	int rc = strcmp(self->name, name);
+
+	if (rc != 0)
+		return rc;
+	if (self->layout != layout)
+		return self->layout > layout ? 1 : -1;
+	return 0;
+}
+
+/**
+ * structures__claim - find or add a struct, possibly from a formatter thread
+ * @new_class_name: the struct name
+ * @layout: its class__layout_hash, with --dedup_layouts, 0 otherwise
+ * @nr: the number, in load order, of the cu where the struct is
+ * @printed_before: if the struct will be printed for a cu before cu @nr
+ *
+ * When @printed_before is false it may still be printed for a cu before
+ * cu @nr that is being processed by another thread, merging the output in
+ * cu order sorts it out, see pahole_merge.
+ */
+static struct structure *structures__claim(const char *new_class_name,
+					   uint64_t layout, uint32_t nr,
+					   bool *printed_before)
 {
-        struct rb_node **p = &structures__tree.rb_node;
+	struct structures_tree *tree = structures__find_tree(new_class_name);
+        struct rb_node **p = &tree->root.rb_node;
         struct rb_node *parent = NULL;
 	struct structure *str;
-	const char *new_class_name = class__name(class, cu);
+
+	pthread_mutex_lock(&tree->lock);
 
         while (*p != NULL) {
 		int rc;
 
                 parent = *p;
                 str = rb_entry(parent, struct structure, rb_node);
-		rc = strcmp(str->name, new_class_name);
+		rc = structure__cmp(str, new_class_name, layout);
 
 		if (rc > 0)
                         p = &(*p)->rb_left;
                 else if (rc < 0)
                         p = &(*p)->rb_right;
-		else {
-			*existing_entry = true;
-			return str;
-		}
+		else
+			goto out;
         }
 
-	str = structure__new(new_class_name);
+	str = structure__new(new_class_name, layout);
 	if (str == NULL)
-		return NULL;
+		goto out_unlock;
 
-	*existing_entry = false;
         rb_link_node(&str->rb_node, parent, p);
-        rb_insert_color(&str->rb_node, &structures__tree);
+        rb_insert_color(&str->rb_node, &tree->root);
+out:
+	*printed_before = str->first_cu < nr;
+	if (nr < str->first_cu)
+		str->first_cu = nr;
+out_unlock:
+	pthread_mutex_unlock(&tree->lock);
+	return str;
+}
+
+/*
+ * To be called in cu order, @nr being the cu number: the first time a struct
+ * is seen it is added to structures__list, for linear traversals. Returns if
+ * it was seen before.
+ */
+static bool structure__seen(struct structure *self, uint32_t nr)
+{
+	if (self->nr_files != 0) {
+		if (self->last_cu != nr) {
+			++self->nr_cus;
+			self->last_cu = nr;
+		}
+		return true;
+	}
+
+	self->nr_files = self->nr_cus = 1;
+	self->last_cu  = nr;
+	list_add_tail(&self->node, &structures__list);
+	return false;
+}
+
+static struct structure *structures__add(struct class *class,
+					 const struct cu *cu,
+					 bool *existing_entry)
+{
+	bool printed_before;
+	struct structure *str = structures__claim(class__name(class, cu), 0,
+						  0, &printed_before);
 
-	/* For linear traversals */
-	list_add_tail(&str->node, &structures__list);
+	if (str != NULL)
+		*existing_entry = structure__seen(str, 0);
 
 	return str;
 }
 
 void structures__delete(void)
 {
-	struct rb_node *next = rb_first(&structures__tree);
-
-	while (next) {
-		struct structure *pos = rb_entry(next, struct structure, rb_node);
-		next = rb_next(&pos->rb_node);
-		rb_erase(&pos->rb_node, &structures__tree);
-		structure__delete(pos);
+	int i;
+
+	for (i = 0; i < STRUCTURES__NR_TREES; ++i) {
+		struct rb_root *root = &structures__trees[i].root;
+		struct rb_node *next = rb_first(root);
+
+		while (next) {
+			struct structure *pos = rb_entry(next, struct structure,
+							 rb_node);
+			next = rb_next(&pos->rb_node);
+			rb_erase(&pos->rb_node, root);
+			structure__delete(pos);
+		}
+		pthread_mutex_destroy(&structures__trees[i].lock);
 	}
+	INIT_LIST_HEAD(&structures__list);
 }
 
 static void nr_definitions_formatter(struct structure *self)
@@ -155,11 +317,11 @@ static void nr_definitions_formatter(struct structure *self)
 	printf("%s%c%u\n", self->name, separator, self->nr_files);
 }
 
-static void nr_members_formatter(struct class *self,
-				 struct cu *cu, uint16_t id __unused)
+static void nr_members_formatter(struct class *self, struct cu *cu,
+				 uint16_t id __unused, FILE *fp)
 {
-	printf("%s%c%u\n", class__name(self, cu), separator,
-	       class__nr_members(self));
+	fprintf(fp, "%s%c%u\n", class__name(self, cu), separator,
+		class__nr_members(self));
 }
 
 static void nr_methods_formatter(struct structure *self)
@@ -167,28 +329,31 @@ static void nr_methods_formatter(struct structure *self)
 	printf("%s%c%u\n", self->name, separator, self->nr_methods);
 }
 
-static void size_formatter(struct class *self,
-			   struct cu *cu, uint16_t id __unused)
+static void size_formatter(struct class *self, struct cu *cu,
+			   uint16_t id __unused, FILE *fp)
 {
-	printf("%s%c%d%c%u\n", class__name(self, cu), separator,
-	       class__size(self), separator, self->nr_holes);
+	fprintf(fp, "%s%c%d%c%u\n", class__name(self, cu), separator,
+		class__size(self), separator, self->nr_holes);
 }
 
 static void class_name_len_formatter(struct class *self, struct cu *cu,
-				     uint16_t id __unused)
+				     uint16_t id __unused, FILE *fp)
 {
 	const char *name = class__name(self, cu);
-	printf("%s%c%zd\n", name, separator, strlen(name));
+	fprintf(fp, "%s%c%zd\n", name, separator, strlen(name));
 }
 
-static void class_name_formatter(struct class *self,
-				 struct cu *cu, uint16_t id __unused)
+static void class_name_formatter(struct class *self, struct cu *cu,
+				 uint16_t id __unused, FILE *fp)
 {
-	puts(class__name(self, cu));
+	fprintf(fp, "%s\n", class__name(self, cu));
 }
 
-static void class_formatter(struct class *self, struct cu *cu, uint16_t id)
+static void class_formatter(struct class *self, struct cu *cu, uint16_t id,
+			    FILE *fp)
 {
+	/* Per call, as this runs in the formatter threads */
+	struct conf_fprintf cconf = conf;
 	struct tag *typedef_alias = NULL;
 	struct tag *tag = class__tag(self);
 	const char *name = class__name(self, cu);
@@ -214,17 +379,18 @@ static void class_formatter(struct class *self, struct cu *cu, uint16_t id)
 	if (typedef_alias != NULL) {
 		struct type *tdef = tag__type(typedef_alias);
 
-		conf.prefix = "typedef";
-		conf.suffix = type__name(tdef, cu);
+		cconf.prefix = "typedef";
+		cconf.suffix = type__name(tdef, cu);
 	} else
-		conf.prefix = conf.suffix = NULL;
+		cconf.prefix = cconf.suffix = NULL;
 
-	tag__fprintf(tag, cu, &conf, stdout);
+	tag__fprintf(tag, cu, &cconf, fp);
 
-	putchar('\n');
+	fputc('\n', fp);
 }
 
-static void print_packable_info(struct class *c, struct cu *cu, uint16_t id)
+static void print_packable_info(struct class *c, struct cu *cu, uint16_t id,
+				FILE *fp)
 {
 	const struct tag *t = class__tag(c);
 	const size_t orig_size = class__size(c);
@@ -241,19 +407,19 @@ static void print_packable_info(struct class *c, struct cu *cu, uint16_t id)
 			name = class__name(tag__class(tdef), cu);
 	}
 	if (name != NULL)
-		printf("%s%c%zd%c%zd%c%zd\n",
-		       name, separator,
-		       orig_size, separator,
-		       new_size, separator,
-		       savings);
+		fprintf(fp, "%s%c%zd%c%zd%c%zd\n",
+			name, separator,
+			orig_size, separator,
+			new_size, separator,
+			savings);
 	else
-		printf("%s(%d)%c%zd%c%zd%c%zd\n",
-		       tag__decl_file(t, cu),
-		       tag__decl_line(t, cu),
-		       separator,
-		       orig_size, separator,
-		       new_size, separator,
-		       savings);
+		fprintf(fp, "%s(%d)%c%zd%c%zd%c%zd\n",
+			tag__decl_file(t, cu),
+			tag__decl_line(t, cu),
+			separator,
+			orig_size, separator,
+			new_size, separator,
+			savings);
 }
 
 static void (*stats_formatter)(struct structure *self) = NULL;
@@ -266,230 +432,1795 @@ static void print_stats(void)
 		stats_formatter(pos);
 }
 
-static struct class *class__filter(struct class *class, struct cu *cu,
-				   uint16_t tag_id);
+/*
+ * The layouts of a struct are next to each other in its tree, count them in
+ * all of them, leaving out the ones that were filtered out after being
+ * claimed.
+ */
+static uint32_t structures__count_layouts(void)
+{
+	uint32_t nr_odr = 0;
+	int i;
+
+	for (i = 0; i < STRUCTURES__NR_TREES; ++i) {
+		struct rb_node *next = rb_first(&structures__trees[i].root);
+
+		while (next != NULL) {
+			struct structure *first = rb_entry(next,
+							   struct structure,
+							   rb_node);
+			struct rb_node *end = next;
+			uint32_t nr_layouts = 0;
+
+			do {
+				struct structure *pos = rb_entry(end,
+							struct structure,
+							rb_node);
+				if (strcmp(pos->name, first->name) != 0)
+					break;
+				nr_layouts += pos->nr_files != 0;
+				end = rb_next(end);
+			} while (end != NULL);
+
+			if (nr_layouts > 1 && first->name[0] != '\0')
+				++nr_odr;
 
-static void (*formatter)(struct class *self,
-			 struct cu *cu, uint16_t id) = class_formatter;
+			for (; next != end; next = rb_next(next))
+				rb_entry(next, struct structure,
+					 rb_node)->nr_layouts = nr_layouts;
+		}
+	}
+
+	return nr_odr;
+}
 
-static void print_classes(struct cu *cu)
+/*
+ * For --dedup_layouts: the layouts printed, in the order they were found,
+ * with the number of cus that have each and the number of layouts found for
+ * the same name, more than one meaning an ODR violation or cus built with
+ * different settings.
+ */
+static void print_layouts(void)
 {
-	uint16_t id;
-	struct class *pos;
+	const uint32_t nr_odr = structures__count_layouts();
+	struct structure *pos;
 
-	cu__for_each_struct(cu, id, pos) {
-		bool existing_entry;
-		struct structure *str;
+	list_for_each_entry(pos, &structures__list, node)
+		printf("%s%c%u%c%016" PRIx64 "%c%u\n",
+		       pos->name[0] != '\0' ? pos->name : "(anonymous)",
+		       separator, pos->nr_cus, separator, pos->layout,
+		       separator, pos->nr_layouts);
+
+	if (nr_odr != 0)
+		fprintf(stderr, "pahole: %u structs have more than one "
+			"layout\n", nr_odr);
+}
 
-		if (pos->type.namespace.name == 0 &&
-		    !(class__include_anonymous ||
-		      class__include_nested_anonymous))
-			continue;
+/*
+ * For -R without -C: most bytes saved first, then most cachelines saved,
+ * then most holes.
+ */
+static int structure__savings_cmp(const void *a, const void *b)
+{
+	const struct structure *sa = *(const struct structure **)a,
+			       *sb = *(const struct structure **)b;
+	const int32_t saved_a = sa->size - sa->new_size,
+		      saved_b = sb->size - sb->new_size;
+	const int cachelines_a = sa->nr_cachelines - sa->new_nr_cachelines,
+		  cachelines_b = sb->nr_cachelines - sb->new_nr_cachelines;
+
+	if (saved_a != saved_b)
+		return saved_a > saved_b ? -1 : 1;
+	if (cachelines_a != cachelines_b)
+		return cachelines_a > cachelines_b ? -1 : 1;
+	if (sa->nr_holes != sb->nr_holes)
+		return sa->nr_holes > sb->nr_holes ? -1 : 1;
+	return strcmp(sa->name, sb->name);
+}
 
-		if (!class__filter(pos, cu, id))
+/*
+ * For -R without -C: the structs that can be made smaller, the ones worth
+ * fixing first at the top, with their size before and after being
+ * reorganized, the bytes and cachelines saved and the number of holes and
+ * bit holes, after a header row naming those columns. Then, on stderr, how
+ * many of the structs looked at that is and what they save in total.
+ */
+static int print_reorg_report(void)
+{
+	struct structure *pos, **savings;
+	uint32_t nr_savings = 0, nr_structs = 0, i;
+	uint64_t bytes_saved = 0;
+	int64_t cachelines_saved = 0;
+
+	list_for_each_entry(pos, &structures__list, node) {
+		if (pos->reorg_cu == UINT32_MAX)
 			continue;
-		/*
-		 * FIXME: No sense in adding an anonymous struct to the list of
-		 * structs already printed, as we look for the name... The
-		 * right fix probably will be to call class__fprintf on a
-		 * in-memory FILE, do a hash, and look it by full contents, not
-		 * by name. And this is needed for CTF as well, but its late now
-		 * and I'm sleepy, will leave for later...
-		 */
-		if (pos->type.namespace.name != 0) {
-			str = structures__add(pos, cu, &existing_entry);
-			if (str == NULL) {
-				fprintf(stderr, "pahole: insufficient memory for "
-					"processing %s, skipping it...\n", cu->name);
-				return;
-			}
+		++nr_structs;
+		if (pos->new_size < pos->size)
+			++nr_savings;
+	}
 
-			/* Already printed... */
-			if (existing_entry) {
-				str->nr_files++;
-				continue;
-			}
-		}
+	savings = malloc(nr_savings * sizeof(*savings) ?: 1);
+	if (savings == NULL)
+		return -ENOMEM;
 
-		if (show_packable && !global_verbose)
-			print_packable_info(pos, cu, id);
-		else if (formatter != NULL)
-			formatter(pos, cu, id);
+	nr_savings = 0;
+	list_for_each_entry(pos, &structures__list, node)
+		if (pos->reorg_cu != UINT32_MAX && pos->new_size < pos->size)
+			savings[nr_savings++] = pos;
+
+	qsort(savings, nr_savings, sizeof(*savings), structure__savings_cmp);
+
+	printf("name%csize%cnew_size%csaved%ccachelines_saved%choles%c"
+	       "bit_holes\n", separator, separator, separator, separator,
+	       separator, separator);
+	for (i = 0; i < nr_savings; ++i) {
+		pos = savings[i];
+		printf("%s%c%u%c%u%c%u%c%d%c%u%c%u\n", pos->name,
+		       separator, pos->size, separator, pos->new_size,
+		       separator, pos->size - pos->new_size, separator,
+		       pos->nr_cachelines - pos->new_nr_cachelines,
+		       separator, pos->nr_holes, separator, pos->nr_bit_holes);
+		bytes_saved	 += pos->size - pos->new_size;
+		cachelines_saved += pos->nr_cachelines - pos->new_nr_cachelines;
 	}
+
+	fprintf(stderr, "pahole: %u of %u structs can be made smaller, "
+		"saving %" PRIu64 " bytes and %" PRId64 " cachelines\n",
+		nr_savings, nr_structs, bytes_saved, cachelines_saved);
+
+	free(savings);
+	return 0;
 }
 
-static struct cu *cu__filter(struct cu *cu)
+/*
+ * For --reorg_benchmark: the bytes saved and the time taken by
+ * class__reorganize and by class__pack, for all the structs -R looked at.
+ */
+static void print_reorg_benchmark(void)
 {
-	if (cu__exclude_prefix != NULL &&
-	    (cu->name == NULL ||
-	     strncmp(cu__exclude_prefix, cu->name,
-		     cu__exclude_prefix_len) == 0))
-		return NULL;
+	/* class__fixup_alignment may make them bigger, i.e. negative savings */
+	int64_t greedy_saved = 0, pack_saved = 0;
+	uint64_t greedy_ns = 0, pack_ns = 0;
+	uint32_t nr = 0, nr_smaller = 0, nr_bigger = 0, nr_fallbacks = 0;
+	struct structure *pos;
 
-	return cu;
+	list_for_each_entry(pos, &structures__list, node) {
+		if (pos->reorg_cu == UINT32_MAX)
+			continue;
+		++nr;
+		greedy_saved += (int64_t)pos->size - pos->greedy_size;
+		pack_saved   += (int64_t)pos->size - pos->new_size;
+		greedy_ns    += pos->greedy_ns;
+		pack_ns	     += pos->pack_ns;
+		if (pos->new_size < pos->greedy_size)
+			++nr_smaller;
+		else if (pos->new_size > pos->greedy_size)
+			++nr_bigger;
+		if (pos->pack_fallback)
+			++nr_fallbacks;
+	}
+
+	printf("structs: %u\n"
+	       "greedy: %" PRId64 " bytes saved in %" PRIu64 " us\n"
+	       "pack: %" PRId64 " bytes saved in %" PRIu64 " us, "
+	       "%u smaller, %u bigger, %u timed out in %u ms\n",
+	       nr, greedy_saved, greedy_ns / 1000, pack_saved, pack_ns / 1000,
+	       nr_smaller, nr_bigger, nr_fallbacks, reorg_budget_ms);
 }
 
-static int class__packable(struct class *self, struct cu *cu)
+/*
+ * For --instances: how many instances of each struct there are, e.g. in a
+ * running kernel or in the heap of a process.
+ */
+struct instances {
+	struct rb_node rb_node;
+	uint64_t       nr;
+	char	       name[0];
+};
+
+static struct rb_root instances__tree = RB_ROOT;
+
+static struct instances *instances__find(const char *name)
 {
-	struct class *clone;
+	struct rb_node *n = instances__tree.rb_node;
 
-	if (self->nr_holes == 0 && self->nr_bit_holes == 0)
-		return 0;
+	while (n != NULL) {
+		struct instances *pos = rb_entry(n, struct instances, rb_node);
+		const int rc = strcmp(name, pos->name);
 
-	clone = class__clone(self, NULL, cu);
-	if (clone == NULL)
-		return 0;
-	class__reorganize(clone, cu, 0, stdout);
-	if (class__size(self) > class__size(clone)) {
-		self->priv = clone;
-		return 1;
+		if (rc == 0)
+			return pos;
+		n = rc < 0 ? n->rb_left : n->rb_right;
 	}
-	/* FIXME: we need to free in the right order,
-	 *	  cu->obstack is being corrupted...
-	class__delete(clone, cu);
-	*/
-	return 0;
+
+	return NULL;
 }
 
-static struct class *class__filter(struct class *class, struct cu *cu,
-				   uint16_t tag_id)
+/* The counts for a struct found in more than one line are added */
+static int instances__add(const char *name, uint64_t nr)
 {
-	struct tag *tag = class__tag(class);
-	const char *name;
+	struct rb_node **p = &instances__tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct instances *self;
 
-	if (!tag->top_level) {
-		class__find_holes(class);
+	while (*p != NULL) {
+		int rc;
 
-		if (!show_private_classes)
-			return NULL;
+		parent = *p;
+		self = rb_entry(parent, struct instances, rb_node);
+		rc = strcmp(name, self->name);
+		if (rc == 0) {
+			self->nr += nr;
+			return 0;
+		}
+		p = rc < 0 ? &(*p)->rb_left : &(*p)->rb_right;
 	}
 
-	name = class__name(class, cu);
+	self = malloc(sizeof(*self) + strlen(name) + 1);
+	if (self == NULL)
+		return -ENOMEM;
 
-	if (class__is_declaration(class))
-		return NULL;
+	self->nr = nr;
+	strcpy(self->name, name);
+	rb_link_node(&self->rb_node, parent, p);
+	rb_insert_color(&self->rb_node, &instances__tree);
+	return 0;
+}
 
-	if (!class__include_anonymous && name == NULL)
-		return NULL;
+/* A count, digits maybe surrounded by spaces, ULLONG_MAX if it isn't one */
+static unsigned long long instances__parse_nr(const char *s)
+{
+	unsigned long long nr;
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		++s;
+	if (!isdigit((unsigned char)*s))
+		return ULLONG_MAX;
+	nr = strtoull(s, &end, 10);
+	while (isspace((unsigned char)*end))
+		++end;
+	return *end == '\0' ? nr : ULLONG_MAX;
+}
 
-	if (class__exclude_prefix != NULL) {
-		if (name == NULL) {
-			const struct tag *tdef =
-				cu__find_first_typedef_of_type(cu, tag_id);
-			if (tdef != NULL) {
-				struct class *c = tag__class(tdef);
+/**
+ * instances__load - load the number of instances of structs
+ * @filename: a copy of /proc/slabinfo or a "name,count" CSV file
+ *
+ * In a slabinfo file the cache names are taken as struct names and the
+ * active objects as the instances, the caches not named after a struct,
+ * like kmalloc-64, will just not be found. In a CSV file the lines starting
+ * with '#' and a first line where the count isn't a number, i.e. a header,
+ * are skipped. The other lines without a name and a count are skipped with
+ * a warning. The blanks around the name are dropped, the ones inside it
+ * kept. The lines may end in CRLF.
+ */
+static int instances__load(const char *filename)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	uint32_t lineno = 0;
+	bool slabinfo = false;
+	int err = 0;
+	FILE *fp = fopen(filename, "r");
+
+	if (fp == NULL)
+		return -errno;
+
+	while (getline(&line, &line_size, fp) != -1) {
+		unsigned long long nr = ULLONG_MAX;
+		char *name, *count = NULL, *saveptr;
+
+		++lineno;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (strncmp(line, "slabinfo - version:", 19) == 0) {
+			slabinfo = true;
+			continue;
+		}
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
 
-				name = class__name(c, cu);
+		if (slabinfo) {
+			name = strtok_r(line, " \t", &saveptr);
+			if (name != NULL)
+				count = strtok_r(NULL, " \t", &saveptr);
+		} else {
+			name  = line;
+			count = strchr(line, ',');
+			if (count != NULL) {
+				char *end = count;
+
+				*count++ = '\0';
+				while (isspace((unsigned char)*name))
+					++name;
+				while (end > name &&
+				       isspace((unsigned char)end[-1]))
+					--end;
+				*end = '\0';
+				if (*name == '\0')
+					name = NULL;
 			}
 		}
-		if (name != NULL && strncmp(class__exclude_prefix, name,
-					    class__exclude_prefix_len) == 0)
-			return NULL;
-	}
-
-	if (class__include_prefix != NULL) {
-		if (name == NULL) {
-			const struct tag *tdef =
-				cu__find_first_typedef_of_type(cu, tag_id);
-			if (tdef != NULL) {
-				struct class *c = tag__class(tdef);
+		if (count != NULL)
+			nr = instances__parse_nr(count);
+
+		if (name == NULL || nr == ULLONG_MAX) {
+			if (lineno != 1 || slabinfo)
+				fprintf(stderr, "pahole: %s:%u: no struct name "
+					"and count, skipping it\n", filename,
+					lineno);
+			continue;
+		}
 
-				name = class__name(c, cu);
-			}
+		if (instances__add(name, nr) != 0) {
+			err = -ENOMEM;
+			break;
 		}
-		if (name != NULL && strncmp(class__include_prefix, name,
-					    class__include_prefix_len) != 0)
-			return NULL;
 	}
 
-	if (decl_exclude_prefix != NULL &&
-	    (!tag__decl_file(tag, cu) ||
-	     strncmp(decl_exclude_prefix, tag__decl_file(tag, cu),
-		     decl_exclude_prefix_len) == 0))
-		return NULL;
+	free(line);
+	fclose(fp);
+	return err;
+}
 
-	if (tag->top_level)
-		class__find_holes(class);
+void instances__delete(void)
+{
+	struct rb_node *next = rb_first(&instances__tree);
 
-	if (class->nr_holes < nr_holes ||
-	    class->nr_bit_holes < nr_bit_holes ||
-	    (hole_size_ge != 0 && !class__has_hole_ge(class, hole_size_ge)))
-		return NULL;
+	while (next != NULL) {
+		struct instances *pos = rb_entry(next, struct instances,
+						 rb_node);
+		next = rb_next(&pos->rb_node);
+		rb_erase(&pos->rb_node, &instances__tree);
+		free(pos);
+	}
+}
 
-	if (show_packable && !class__packable(class, cu))
-		return NULL;
+/* For --instances: the sort key and the instances found for a struct */
+struct instances_waste {
+	struct structure *str;
+	uint64_t	 nr;
+};
 
-	return class;
+/*
+ * For --instances: the bytes reorganizing saves per instance, negative when
+ * class__fixup_alignment makes it bigger, see print_reorg_benchmark.
+ */
+static int64_t structure__saved(const struct structure *self)
+{
+	return (int64_t)self->size - self->new_size;
 }
 
-static void union__find_new_size(struct tag *tag, struct cu *cu);
+/* Most bytes wasted first, then most bytes that can be saved */
+static int instances_waste__cmp(const void *a, const void *b)
+{
+	const struct instances_waste *wa = a, *wb = b;
+	const uint64_t wasted_a = wa->nr * wa->str->wasted,
+		       wasted_b = wb->nr * wb->str->wasted;
+	const int64_t saved_a = (int64_t)wa->nr * structure__saved(wa->str),
+		      saved_b = (int64_t)wb->nr * structure__saved(wb->str);
+
+	if (wasted_a != wasted_b)
+		return wasted_a > wasted_b ? -1 : 1;
+	if (saved_a != saved_b)
+		return saved_a > saved_b ? -1 : 1;
+	return strcmp(wa->str->name, wb->str->name);
+}
 
-static void class__resize_LP(struct tag *tag, struct cu *cu)
+/*
+ * For --instances: the structs with instances and holes or padding, the ones
+ * wasting the most memory at the top, with the number of instances, the
+ * size, the bytes wasted in holes and padding and the bytes that
+ * reorganizing would save, per instance and for all of them.
+ */
+static int print_instances_report(void)
 {
-	struct tag *tag_pos;
-	struct class *self = tag__class(tag);
-	size_t word_size_diff;
-	size_t orig_size = self->type.size;
+	struct instances_waste *waste;
+	struct structure *pos;
+	uint32_t nr_waste = 0, i;
 
-	if (tag__type(tag)->resized)
-		return;
+	list_for_each_entry(pos, &structures__list, node)
+		if (pos->reorg_cu != UINT32_MAX && pos->wasted != 0 &&
+		    instances__find(pos->name) != NULL)
+			++nr_waste;
 
-	tag__type(tag)->resized = 1;
+	waste = malloc(nr_waste * sizeof(*waste) ?: 1);
+	if (waste == NULL)
+		return -ENOMEM;
 
-	if (original_word_size > word_size)
-		word_size_diff = original_word_size - word_size;
-	else
-		word_size_diff = word_size - original_word_size;
+	nr_waste = 0;
+	list_for_each_entry(pos, &structures__list, node) {
+		const struct instances *instances;
 
-	type__for_each_tag(tag__type(tag), tag_pos) {
-		struct tag *type;
-		size_t diff = 0;
-		size_t array_multiplier = 1;
+		if (pos->reorg_cu == UINT32_MAX || pos->wasted == 0)
+			continue;
+		instances = instances__find(pos->name);
+		if (instances == NULL)
+			continue;
+		waste[nr_waste].str  = pos;
+		waste[nr_waste++].nr = instances->nr;
+	}
 
-		/* we want only data members, i.e. with byte_offset attr */
-		if (tag_pos->tag != DW_TAG_member &&
-		    tag_pos->tag != DW_TAG_inheritance)
-		    	continue;
+	qsort(waste, nr_waste, sizeof(*waste), instances_waste__cmp);
 
-		type = cu__type(cu, tag_pos->type);
-		tag__assert_search_result(type);
-		if (type->tag == DW_TAG_array_type) {
-			int i;
-			for (i = 0; i < tag__array_type(type)->dimensions; ++i)
-				array_multiplier *= tag__array_type(type)->nr_entries[i];
+	for (i = 0; i < nr_waste; ++i) {
+		const uint64_t nr = waste[i].nr;
+		const int64_t saved = structure__saved(waste[i].str);
 
-			type = cu__type(cu, type->type);
-			tag__assert_search_result(type);
-		}
+		pos = waste[i].str;
+		printf("%s%c%" PRIu64 "%c%u%c%u%c%" PRIu64 "%c%" PRId64 "%c%"
+		       PRId64 "\n", pos->name, separator, nr, separator,
+		       pos->size, separator, pos->wasted, separator,
+		       nr * pos->wasted, separator, saved, separator,
+		       (int64_t)nr * saved);
+	}
 
-		if (tag__is_typedef(type)) {
-			type = tag__follow_typedef(type, cu);
-			tag__assert_search_result(type);
-		}
+	free(waste);
+	return 0;
+}
 
-		switch (type->tag) {
-		case DW_TAG_base_type: {
-			struct base_type *bt = tag__base_type(type);
-			char bf[64];
-			const char *name = base_type__name(bt, cu, bf,
-							   sizeof(bf));
-			if (strcmp(name, "long int") != 0 &&
-			    strcmp(name, "long unsigned int") != 0)
-				break;
-			/* fallthru */
-		}
-		case DW_TAG_pointer_type:
-			diff = word_size_diff;
-			break;
-		case DW_TAG_structure_type:
-		case DW_TAG_union_type:
-			if (tag__is_union(type))
-				union__find_new_size(type, cu);
-			else
-				class__resize_LP(type, cu);
-			diff = tag__type(type)->size_diff;
-			break;
-		}
+/*
+ * For --accesses and --c2c: data address samples, e.g. from perf mem, to be
+ * resolved to the global variables of struct types, sorted by address.
+ * @nr_stores: for --c2c, @nr being the loads that hit a cacheline modified
+ *	       by another CPU
+ */
+struct access_sample {
+	uint64_t addr;
+	uint64_t nr;
+	uint64_t nr_stores;
+};
+
+static struct access_sample *access_samples;
+static uint32_t nr_access_samples;
+
+/*
+ * For --accesses and --c2c: the samples in a struct, from global variables
+ * and from heap objects of known type, per byte.
+ */
+struct access_counts {
+	struct rb_node rb_node;
+	uint64_t       *bytes;
+	uint64_t       *stores;
+	uint32_t       size;
+	uint64_t       nr_samples;
+	char	       name[0];
+};
+
+static struct rb_root access_counts__tree = RB_ROOT;
+static uint64_t access_counts__nr_samples;
+
+static struct access_counts *access_counts__findnew(const char *name)
+{
+	struct rb_node **p = &access_counts__tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct access_counts *self;
+
+	while (*p != NULL) {
+		int rc;
+
+		parent = *p;
+		self = rb_entry(parent, struct access_counts, rb_node);
+		rc = strcmp(name, self->name);
+		if (rc == 0)
+			return self;
+		p = rc < 0 ? &(*p)->rb_left : &(*p)->rb_right;
+	}
+
+	self = zalloc(sizeof(*self) + strlen(name) + 1);
+	if (self == NULL)
+		return NULL;
+
+	strcpy(self->name, name);
+	rb_link_node(&self->rb_node, parent, p);
+	rb_insert_color(&self->rb_node, &access_counts__tree);
+	return self;
+}
+
+/* @offset is in the struct, see heap_samples__account */
+static int access_counts__add(struct access_counts *self, uint64_t offset,
+			      uint64_t nr, uint64_t nr_stores)
+{
+	if (offset >= self->size) {
+		const uint32_t size = (offset | 63) + 1;
+		uint64_t *bytes = realloc(self->bytes, size * sizeof(*bytes));
+
+		if (bytes == NULL)
+			return -ENOMEM;
+		self->bytes = bytes;
+		bytes = realloc(self->stores, size * sizeof(*bytes));
+		if (bytes == NULL)
+			return -ENOMEM;
+		self->stores = bytes;
+		memset(self->bytes + self->size, 0,
+		       (size - self->size) * sizeof(*bytes));
+		memset(self->stores + self->size, 0,
+		       (size - self->size) * sizeof(*bytes));
+		self->size = size;
+	}
+
+	self->bytes[offset]  += nr;
+	self->stores[offset] += nr_stores;
+	self->nr_samples += nr + nr_stores;
+	access_counts__nr_samples += nr + nr_stores;
+	return 0;
+}
+
+/* The samples in @counts for the bytes in [@offset, @offset + @size) */
+static uint64_t access_counts__sum(const struct access_counts *self,
+				   const uint64_t *counts,
+				   uint32_t offset, uint32_t size)
+{
+	uint64_t sum = 0;
+	uint32_t i;
+
+	for (i = offset; i < offset + size && i < self->size; ++i)
+		sum += counts[i];
+
+	return sum;
+}
+
+void access_counts__delete(void)
+{
+	struct rb_node *next = rb_first(&access_counts__tree);
+
+	while (next != NULL) {
+		struct access_counts *pos = rb_entry(next, struct access_counts,
+						     rb_node);
+		next = rb_next(&pos->rb_node);
+		rb_erase(&pos->rb_node, &access_counts__tree);
+		free(pos->bytes);
+		free(pos->stores);
+		free(pos);
+	}
+}
+
+static int access_sample__cmp(const void *a, const void *b)
+{
+	const struct access_sample *sa = a, *sb = b;
+
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+	return 0;
+}
+
+static int access_samples__add(uint64_t addr, uint64_t nr, uint64_t nr_stores)
+{
+	static uint32_t nr_allocated;
+
+	if (nr_access_samples == nr_allocated) {
+		const uint32_t nr_new = nr_allocated ? nr_allocated * 2 : 1024;
+		struct access_sample *samples =
+				realloc(access_samples,
+					nr_new * sizeof(*samples));
+		if (samples == NULL)
+			return -ENOMEM;
+		access_samples = samples;
+		nr_allocated   = nr_new;
+	}
+
+	access_samples[nr_access_samples].addr	    = addr;
+	access_samples[nr_access_samples].nr	    = nr;
+	access_samples[nr_access_samples++].nr_stores = nr_stores;
+	return 0;
+}
+
+/*
+ * For --accesses: the samples with a struct name and an offset, kept till the
+ * structs are loaded, as their offsets may be past the end of the struct.
+ */
+struct heap_sample {
+	struct access_counts *counts;
+	uint64_t	     offset;
+	uint64_t	     nr;
+};
+
+static struct heap_sample *heap_samples;
+static uint32_t nr_heap_samples;
+
+static int heap_samples__add(struct access_counts *counts, uint64_t offset,
+			     uint64_t nr)
+{
+	static uint32_t nr_allocated;
+
+	if (nr_heap_samples == nr_allocated) {
+		const uint32_t nr_new = nr_allocated ? nr_allocated * 2 : 1024;
+		struct heap_sample *samples = realloc(heap_samples,
+						      nr_new * sizeof(*samples));
+		if (samples == NULL)
+			return -ENOMEM;
+		heap_samples = samples;
+		nr_allocated = nr_new;
+	}
+
+	heap_samples[nr_heap_samples].counts = counts;
+	heap_samples[nr_heap_samples].offset = offset;
+	heap_samples[nr_heap_samples++].nr   = nr;
+	return 0;
+}
+
+static int heap_sample__cmp(const void *a, const void *b)
+{
+	const struct heap_sample *sa = a, *sb = b;
+
+	if (sa->counts != sb->counts)
+		return sa->counts < sb->counts ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Adds up the heap samples now that the structs are loaded, skipping, with a
+ * warning, the ones past the end of their struct. The ones for structs not
+ * found are just counted, for print_accesses to say so.
+ */
+static int heap_samples__account(struct cus *cus)
+{
+	uint32_t i = 0;
+
+	qsort(heap_samples, nr_heap_samples, sizeof(*heap_samples),
+	      heap_sample__cmp);
+
+	while (i < nr_heap_samples) {
+		struct access_counts *counts = heap_samples[i].counts;
+		struct cu *cu;
+		struct tag *class = cus__find_struct_by_name(cus, &cu,
+							     counts->name,
+							     0, NULL);
+		const size_t size = class != NULL ? tag__size(class, cu) : 0;
+		uint64_t nr_skipped = 0;
+
+		for (; i < nr_heap_samples && heap_samples[i].counts == counts;
+		     ++i) {
+			const struct heap_sample *pos = &heap_samples[i];
+
+			if (class == NULL) {
+				counts->nr_samples	  += pos->nr;
+				access_counts__nr_samples += pos->nr;
+			} else if (pos->offset >= size)
+				nr_skipped += pos->nr;
+			else if (access_counts__add(counts, pos->offset,
+						    pos->nr, 0) != 0)
+				return -ENOMEM;
+		}
+
+		if (nr_skipped != 0)
+			fprintf(stderr, "pahole: %" PRIu64 " samples past the "
+				"end of struct %s, %zu bytes, skipped\n",
+				nr_skipped, counts->name, size);
+	}
+
+	return 0;
+}
+
+/**
+ * accesses__load - load data address samples
+ * @filename: one sample per line
+ *
+ * Each line has either a data address, in hex, e.g. what 'perf script -F
+ * addr' prints for the samples recorded with 'perf mem record', or, for heap
+ * objects whose type is known, a struct name and an offset, e.g.
+ * "task_struct+0x40". Both may be followed by a number of samples, 1 if
+ * missing. The other lines, e.g. comments, are skipped.
+ */
+static int accesses__load(const char *filename)
+{
+	char line[1024], name[256];
+	int err = -ENOMEM;
+	FILE *fp = fopen(filename, "r");
+
+	if (fp == NULL)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		unsigned long long offset, nr = 1;
+		char *start = line, *end;
+
+		while (isspace((unsigned char)*start))
+			++start;
+		if (*start == '#' || *start == '\0')
+			continue;
+
+		if (sscanf(start, "%255[^+ \t\n]+%lli %llu",
+			   name, &offset, &nr) >= 2) {
+			struct access_counts *counts =
+						access_counts__findnew(name);
+
+			if (counts == NULL ||
+			    heap_samples__add(counts, offset, nr) != 0)
+				goto out;
+			continue;
+		}
+
+		offset = strtoull(start, &end, 16);
+		if (end == start ||
+		    (*end != '\0' && !isspace((unsigned char)*end)))
+			continue;
+		sscanf(end, "%llu", &nr);
+
+		if (access_samples__add(offset, nr, 0) != 0)
+			goto out;
+	}
+
+	qsort(access_samples, nr_access_samples, sizeof(*access_samples),
+	      access_sample__cmp);
+	err = 0;
+out:
+	fclose(fp);
+	return err;
+}
+
+/* The counts per cacheline in a perf c2c report, at most */
+#define C2C__MAX_COLUMNS 8
+
+/* Rounded, with a line having some percentage being at least one sample */
+static uint64_t c2c__nr_samples(double nr, double percent)
+{
+	if (percent == 0)
+		return 0;
+	return nr < 1 ? 1 : (uint64_t)(nr + 0.5);
+}
+
+/**
+ * c2c__load - load the contended cachelines from a perf c2c report
+ * @filename: the output of 'perf c2c report --stdio'
+ *
+ * In its "Shared Cache Line Distribution Pareto" section each cacheline
+ * starts with a line with its index, its counts of HITMs, i.e. loads that
+ * found the cacheline modified by another CPU, remote and local, then the
+ * ones of stores, and its address, followed by a line per offset and code
+ * address, with the percentages of each of those counts, in the same order,
+ * then the offset. Each of those lines is the HITMs and stores that its
+ * percentages are of the cacheline's counts or, if those couldn't be
+ * parsed, that many samples as its percentages add up to, at least one.
+ */
+static int c2c__load(const char *filename)
+{
+	char line[4096];
+	uint64_t cacheline = 0, counts[C2C__MAX_COLUMNS];
+	uint32_t nr_counts = 0;
+	bool pareto = false;
+	int err = -ENOMEM;
+	FILE *fp = fopen(filename, "r");
+
+	if (fp == NULL)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *token, *saveptr, *first = NULL, *last = NULL;
+		uint64_t offset = UINT64_MAX, numbers[C2C__MAX_COLUMNS + 1];
+		uint32_t nr_percents = 0, nr_numbers = 0;
+		double hitm = 0, stores = 0, hitm_percent = 0, stores_percent = 0;
+
+		if (strstr(line, "Shared Cache Line Distribution Pareto")) {
+			pareto = true;
+			continue;
+		}
+		if (!pareto || line[0] == '#')
+			continue;
+
+		for (token = strtok_r(line, " \t\n", &saveptr); token != NULL;
+		     token = strtok_r(NULL, " \t\n", &saveptr)) {
+			if (first == NULL)
+				first = token;
+			last = token;
+
+			if (token[strlen(token) - 1] == '%') {
+				const double percent = strtod(token, NULL);
+				double nr = percent;
+
+				/* Without the counts, the percentages */
+				if (nr_percents < nr_counts)
+					nr *= counts[nr_percents] / 100.0;
+				else if (nr_counts != 0)
+					nr = 0;
+
+				if (nr_percents++ < 2) {
+					hitm	     += nr;
+					hitm_percent += percent;
+				} else {
+					stores	       += nr;
+					stores_percent += percent;
+				}
+			} else if (nr_percents != 0 && offset == UINT64_MAX &&
+				   strncmp(token, "0x", 2) == 0)
+				offset = strtoull(token, NULL, 16);
+			else if (nr_percents == 0 &&
+				 isdigit((unsigned char)*token) &&
+				 strncmp(token, "0x", 2) != 0 &&
+				 nr_numbers < C2C__MAX_COLUMNS + 1)
+				numbers[nr_numbers++] = strtoull(token, NULL,
+								 10);
+		}
+
+		if (nr_percents == 0) {
+			if (first != NULL && isdigit((unsigned char)*first) &&
+			    strncmp(last, "0x", 2) == 0) {
+				cacheline = strtoull(last, NULL, 16);
+				/* The first number is the index */
+				nr_counts = nr_numbers > 1 ? nr_numbers - 1 : 0;
+				memcpy(counts, numbers + 1,
+				       nr_counts * sizeof(*counts));
+			}
+			continue;
+		}
+
+		if (cacheline == 0 || offset == UINT64_MAX ||
+		    (hitm_percent == 0 && stores_percent == 0))
+			continue;
+
+		if (access_samples__add(cacheline + offset,
+					c2c__nr_samples(hitm, hitm_percent),
+					c2c__nr_samples(stores,
+							stores_percent)) != 0)
+			goto out;
+	}
+
+	qsort(access_samples, nr_access_samples, sizeof(*access_samples),
+	      access_sample__cmp);
+	err = 0;
+out:
+	fclose(fp);
+	return err;
+}
+
+/* Index of the first sample at or after @addr */
+static uint32_t access_samples__lower_bound(uint64_t addr)
+{
+	uint32_t low = 0, high = nr_access_samples;
+
+	while (low < high) {
+		const uint32_t mid = low + (high - low) / 2;
+
+		if (access_samples[mid].addr < addr)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/*
+ * Adds up the samples in the global variables of @cu that are structs or
+ * arrays of structs, per struct and offset.
+ */
+static int cu__account_accesses(struct cu *cu)
+{
+	struct tag *pos;
+	uint32_t id;
+
+	cu__for_each_variable(cu, id, pos) {
+		struct variable *var = tag__variable(pos);
+		struct access_counts *counts;
+		struct tag *type;
+		uint64_t nr_elements = 1, size;
+		const char *name;
+		uint32_t i;
+
+		if (var->declaration || var->location != LOCATION_GLOBAL)
+			continue;
+
+		type = tag__follow_typedef(pos, cu);
+		if (type != NULL && type->tag == DW_TAG_array_type) {
+			const struct array_type *at = tag__array_type(type);
+
+			for (i = 0; i < at->dimensions; ++i)
+				nr_elements *= at->nr_entries[i];
+			type = tag__follow_typedef(type, cu);
+		}
+		while (type != NULL && (type->tag == DW_TAG_const_type ||
+					type->tag == DW_TAG_volatile_type))
+			type = tag__follow_typedef(type, cu);
+
+		if (type == NULL || !tag__is_struct(type))
+			continue;
+		name = class__name(tag__class(type), cu);
+		size = tag__size(type, cu);
+		if (name == NULL || size == 0)
+			continue;
+
+		i = access_samples__lower_bound(var->ip.addr);
+		if (i == nr_access_samples ||
+		    access_samples[i].addr >= var->ip.addr +
+					      nr_elements * size)
+			continue;
+
+		counts = access_counts__findnew(name);
+		if (counts == NULL)
+			return -ENOMEM;
+
+		for (; i < nr_access_samples &&
+		       access_samples[i].addr < var->ip.addr +
+						nr_elements * size; ++i)
+			if (access_counts__add(counts,
+					       (access_samples[i].addr -
+						var->ip.addr) % size,
+					       access_samples[i].nr,
+					       access_samples[i].nr_stores) != 0)
+				return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static size_t access_counts__member_annotate(const struct class_member *member,
+					     void *priv, FILE *fp)
+{
+	const struct access_counts *self = priv;
+	const uint64_t nr = access_counts__sum(self, self->bytes,
+					       member->byte_offset,
+					       member->byte_size);
+
+	if (nr == 0)
+		return 0;
+
+	return fprintf(fp, " /* %" PRIu64 " samples, %.1f%% */", nr,
+		       nr * 100.0 / self->nr_samples);
+}
+
+static size_t access_counts__c2c_annotate(const struct class_member *member,
+					  void *priv, FILE *fp)
+{
+	const struct access_counts *self = priv;
+	const bool hitm = access_counts__sum(self, self->bytes,
+					     member->byte_offset,
+					     member->byte_size) != 0,
+		   written = access_counts__sum(self, self->stores,
+						member->byte_offset,
+						member->byte_size) != 0;
+
+	if (written)
+		return fprintf(fp, hitm ? " /* written, HITM */" :
+					  " /* written */");
+	return hitm ? fprintf(fp, " /* HITM */") : 0;
+}
+
+/*
+ * For --c2c: the cachelines of a struct that have written members and other
+ * members used, i.e. where the writes make other CPUs reload what they use
+ * even if nobody changed it.
+ */
+struct false_sharing {
+	const struct access_counts *counts;
+	size_t			   cacheline_size;
+};
+
+static bool false_sharing__written(const struct false_sharing *self,
+				   const struct class_member *member)
+{
+	return access_counts__sum(self->counts, self->counts->stores,
+				  member->byte_offset,
+				  member->byte_size) != 0;
+}
+
+static bool false_sharing__used(const struct false_sharing *self,
+				const struct class_member *member)
+{
+	return false_sharing__written(self, member) ||
+	       access_counts__sum(self->counts, self->counts->bytes,
+				  member->byte_offset,
+				  member->byte_size) != 0;
+}
+
+/*
+ * Move all the written members, not just the ones in the falsely shared
+ * cachelines, or the ones left could end up next to the members used.
+ */
+static bool false_sharing__isolate(const struct class_member *member,
+				   void *priv)
+{
+	return false_sharing__written(priv, member);
+}
+
+/*
+ * Prints the members of @class written and used in each of its falsely
+ * shared cachelines, returns how many there are.
+ */
+static uint32_t false_sharing__fprintf(const struct false_sharing *self,
+				       struct class *class,
+				       const struct cu *cu, FILE *fp)
+{
+	const uint32_t nr_cachelines = (class__size(class) +
+					self->cacheline_size - 1) /
+				       self->cacheline_size;
+	uint32_t cacheline, nr_shared = 0;
+
+	for (cacheline = 0; cacheline < nr_cachelines; ++cacheline) {
+		struct class_member *pos;
+		uint32_t nr_written = 0, nr_used = 0;
+
+		type__for_each_data_member(&class->type, pos) {
+			if (pos->byte_offset / self->cacheline_size !=
+			    cacheline)
+				continue;
+			nr_written += false_sharing__written(self, pos);
+			nr_used    += false_sharing__used(self, pos);
+		}
+
+		if (nr_written == 0 || nr_used < 2)
+			continue;
+
+		++nr_shared;
+		fprintf(fp, "/* false sharing in cacheline %u, written:",
+			cacheline);
+		type__for_each_data_member(&class->type, pos)
+			if (pos->byte_offset / self->cacheline_size ==
+			    cacheline && false_sharing__written(self, pos))
+				fprintf(fp, " %s", class_member__name(pos, cu));
+		fputs(", also used:", fp);
+		type__for_each_data_member(&class->type, pos)
+			if (pos->byte_offset / self->cacheline_size ==
+			    cacheline && false_sharing__used(self, pos) &&
+			    !false_sharing__written(self, pos))
+				fprintf(fp, " %s", class_member__name(pos, cu));
+		fputs(" */\n", fp);
+	}
+
+	return nr_shared;
+}
+
+static int access_counts__cmp(const void *a, const void *b)
+{
+	const struct access_counts *ca = *(const struct access_counts **)a,
+				   *cb = *(const struct access_counts **)b;
+
+	if (ca->nr_samples != cb->nr_samples)
+		return ca->nr_samples > cb->nr_samples ? -1 : 1;
+	return strcmp(ca->name, cb->name);
+}
+
+/* The structs with samples, the most accessed first */
+static struct access_counts **access_counts__sorted(uint32_t *nr_counts)
+{
+	struct access_counts **counts;
+	struct rb_node *next;
+	uint32_t nr = 0;
+
+	for (next = rb_first(&access_counts__tree); next; next = rb_next(next))
+		++nr;
+
+	counts = malloc(nr * sizeof(*counts) ?: 1);
+	if (counts == NULL)
+		return NULL;
+
+	nr = 0;
+	for (next = rb_first(&access_counts__tree); next; next = rb_next(next))
+		counts[nr++] = rb_entry(next, struct access_counts, rb_node);
+
+	qsort(counts, nr, sizeof(*counts), access_counts__cmp);
+	*nr_counts = nr;
+	return counts;
+}
+
+/*
+ * For --accesses: the structs with samples, the most accessed first, with
+ * the samples for each member and then for each cacheline.
+ */
+static int print_accesses(struct cus *cus)
+{
+	uint32_t nr_counts, i;
+	struct access_counts **counts;
+
+	if (heap_samples__account(cus) != 0)
+		return -ENOMEM;
+
+	counts = access_counts__sorted(&nr_counts);
+	if (counts == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_counts; ++i) {
+		struct conf_fprintf aconf = conf;
+		struct cu *cu;
+		struct tag *class = cus__find_struct_by_name(cus, &cu,
+							     counts[i]->name,
+							     0, NULL);
+		const size_t cacheline = dwarves__cacheline_size();
+		uint32_t offset, size;
+
+		if (class == NULL) {
+			fprintf(stderr, "pahole: struct %s, with %" PRIu64
+				" samples, not found\n", counts[i]->name,
+				counts[i]->nr_samples);
+			continue;
+		}
+
+		aconf.member_annotate = access_counts__member_annotate;
+		aconf.annotate_priv   = counts[i];
+		class__find_holes(tag__class(class));
+		tag__fprintf(class, cu, &aconf, stdout);
+
+		printf("   /* %" PRIu64 " samples", counts[i]->nr_samples);
+		size = tag__size(class, cu);
+		for (offset = 0; offset < size; offset += cacheline)
+			printf(", cacheline %zu: %" PRIu64, offset / cacheline,
+			       access_counts__sum(counts[i], counts[i]->bytes,
+						  offset, cacheline));
+		puts(" */\n");
+	}
+
+	free(counts);
+
+	if (global_verbose)
+		fprintf(stderr, "pahole: %" PRIu64 " samples in structs\n",
+			access_counts__nr_samples);
+	return 0;
+}
+
+/*
+ * For --c2c: the contended structs, the most contended first, with their
+ * written members and the ones with HITMs, the falsely shared cachelines
+ * and a layout with the written members moved to cachelines of their own.
+ */
+static int print_false_sharing(struct cus *cus)
+{
+	const size_t cacheline = dwarves__cacheline_size();
+	uint32_t nr_counts, i;
+	struct access_counts **counts = access_counts__sorted(&nr_counts);
+	int err = 0;
+
+	if (counts == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_counts; ++i) {
+		struct conf_fprintf aconf = conf;
+		struct false_sharing fs = {
+			.counts		= counts[i],
+			.cacheline_size = cacheline,
+		};
+		struct class *clone;
+		struct cu *cu;
+		struct tag *class = cus__find_struct_by_name(cus, &cu,
+							     counts[i]->name,
+							     0, NULL);
+		if (class == NULL) {
+			fprintf(stderr, "pahole: struct %s, with %" PRIu64
+				" samples, not found\n", counts[i]->name,
+				counts[i]->nr_samples);
+			continue;
+		}
+
+		aconf.member_annotate = access_counts__c2c_annotate;
+		aconf.annotate_priv   = counts[i];
+		class__find_holes(tag__class(class));
+		tag__fprintf(class, cu, &aconf, stdout);
+		putchar('\n');
+
+		if (false_sharing__fprintf(&fs, tag__class(class), cu,
+					   stdout) == 0) {
+			putchar('\n');
+			continue;
+		}
+
+		clone = class__clone(tag__class(class), NULL, cu);
+		if (clone == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+
+		class__isolate_members(clone, cu, false_sharing__isolate, &fs,
+				       cacheline);
+		puts("/* Written members moved to cachelines of their own: */");
+		tag__fprintf(class__tag(clone), cu, &conf, stdout);
+		printf("   /* %zd bytes bigger */\n\n",
+		       (ssize_t)class__size(clone) -
+		       class__size(tag__class(class)));
+		class__delete(clone, cu);
+	}
+
+	free(counts);
+	return err;
+}
+
+/*
+ * For --access_groups: members of a struct used together, e.g. in a hot
+ * path, the ones with the biggest @weight being laid out first.
+ */
+struct access_group {
+	char	   *line;
+	const char *class_name;
+	const char *name;
+	uint64_t   weight;
+	const char **members;
+	uint32_t   nr_members;
+	uint32_t   order;
+};
+
+static struct access_group *access_groups;
+static uint32_t nr_access_groups;
+
+/* Heaviest first, then in file order */
+static int access_group__cmp(const void *a, const void *b)
+{
+	const struct access_group *ga = a, *gb = b;
+
+	if (ga->weight != gb->weight)
+		return ga->weight > gb->weight ? -1 : 1;
+	return ga->order < gb->order ? -1 : 1;
+}
+
+static bool access_group__has(const struct access_group *self,
+			      const char *member_name)
+{
+	uint32_t i;
+
+	if (member_name == NULL)
+		return false;
+
+	for (i = 0; i < self->nr_members; ++i)
+		if (strcmp(self->members[i], member_name) == 0)
+			return true;
+	return false;
+}
+
+static int access_group__parse(struct access_group *self, char *line)
+{
+	char *saveptr, *token, *end;
+	const char **members;
+
+	self->class_name = strtok_r(line, " \t\n", &saveptr);
+	self->name	 = strtok_r(NULL, " \t\n", &saveptr);
+	token		 = strtok_r(NULL, " \t\n", &saveptr);
+	if (token == NULL)
+		return -EINVAL;
+	self->weight = strtoull(token, &end, 0);
+	if (*end != '\0')
+		return -EINVAL;
+
+	while ((token = strtok_r(NULL, " \t\n", &saveptr)) != NULL) {
+		members = realloc(self->members,
+				  (self->nr_members + 1) * sizeof(*members));
+		if (members == NULL)
+			return -ENOMEM;
+		self->members = members;
+		self->members[self->nr_members++] = token;
+	}
+
+	return self->nr_members != 0 ? 0 : -EINVAL;
+}
+
+/**
+ * access_groups__load - load the members of structs accessed together
+ * @filename: the file, with lines like "STRUCT GROUP WEIGHT MEMBER..."
+ *
+ * E.g. "sock rx 90 sk_rcvbuf sk_receive_queue" says that in struct sock the
+ * "rx" group, sk_rcvbuf and sk_receive_queue, is used together with a
+ * weight, e.g. the samples in the functions using them, of 90. A member can
+ * be in many groups, it is laid out with the heaviest. The lines starting
+ * with '#' are skipped.
+ */
+static int access_groups__load(const char *filename)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	int err = 0;
+	FILE *fp = fopen(filename, "r");
+
+	if (fp == NULL)
+		return -errno;
+
+	while (getline(&line, &line_size, fp) != -1) {
+		struct access_group *group;
+		const char *start = line;
+
+		while (isspace((unsigned char)*start))
+			++start;
+		if (*start == '#' || *start == '\0')
+			continue;
+
+		group = realloc(access_groups,
+				(nr_access_groups + 1) * sizeof(*group));
+		if (group == NULL) {
+			err = -ENOMEM;
+			break;
+		}
+		access_groups = group;
+		group = &access_groups[nr_access_groups];
+		memset(group, 0, sizeof(*group));
+		group->order = nr_access_groups++;
+		/* The names point into it */
+		group->line  = line;
+		line	     = NULL;
+		line_size    = 0;
+
+		err = access_group__parse(group, group->line);
+		if (err != 0)
+			break;
+	}
+
+	free(line);
+	fclose(fp);
+	if (err == 0)
+		qsort(access_groups, nr_access_groups, sizeof(*access_groups),
+		      access_group__cmp);
+	return err;
+}
+
+void access_groups__delete(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < nr_access_groups; ++i) {
+		free(access_groups[i].members);
+		free(access_groups[i].line);
+	}
+	free(access_groups);
+	access_groups	 = NULL;
+	nr_access_groups = 0;
+}
+
+/* For class__hot_cold_layout: the rank of the heaviest group with @member */
+struct access_groups__match {
+	const char	*class_name;
+	const struct cu *cu;
+};
+
+static int access_groups__member_group(const struct class_member *member,
+				       void *priv)
+{
+	const struct access_groups__match *match = priv;
+	const char *member_name = class_member__name(member, match->cu);
+	uint32_t i;
+
+	for (i = 0; i < nr_access_groups; ++i)
+		if (strcmp(access_groups[i].class_name,
+			   match->class_name) == 0 &&
+		    access_group__has(&access_groups[i], member_name))
+			return i;
+	return -1;
+}
+
+/* The cachelines, in @self, where there are members of @group */
+static uint32_t access_group__nr_cachelines(const struct access_group *group,
+					    struct class *self,
+					    const struct cu *cu,
+					    size_t cacheline_size)
+{
+	const size_t nr_cachelines = (class__size(self) + cacheline_size - 1) /
+				     cacheline_size + 1;
+	bool *touched = calloc(nr_cachelines, sizeof(*touched));
+	struct class_member *pos;
+	uint32_t nr = 0;
+	size_t i;
+
+	if (touched == NULL)
+		return 0;
+
+	type__for_each_data_member(&self->type, pos) {
+		const size_t size = pos->byte_size ?: 1;
+
+		if (!access_group__has(group, class_member__name(pos, cu)))
+			continue;
+		for (i = pos->byte_offset / cacheline_size;
+		     i <= (pos->byte_offset + size - 1) / cacheline_size &&
+		     i < nr_cachelines; ++i)
+			if (!touched[i]) {
+				touched[i] = true;
+				++nr;
+			}
+	}
+
+	free(touched);
+	return nr;
+}
+
+static struct class *class__filter(struct class *class, struct cu *cu,
+				   uint16_t tag_id);
+
+static void (*formatter)(struct class *self, struct cu *cu, uint16_t id,
+			 FILE *fp) = class_formatter;
+
+/*
+ * What a formatter thread printed for a cu: where the output for each struct
+ * ends, so that the ones already printed for a previous cu can be dropped
+ * when merging, in cu order, see pahole_merge.
+ */
+struct class_output {
+	struct structure *str;	/* NULL for anonymous structs */
+	size_t		 end;
+};
+
+struct cu_output {
+	char		    *buf;
+	size_t		    size;
+	struct class_output *classes;
+	uint32_t	    nr_classes;
+	uint32_t	    allocated_classes;
+	uint32_t	    nr;		/* of the cu, in load order */
+};
+
+static int cu_output__add(struct cu_output *self, struct structure *str,
+			  FILE *fp)
+{
+	if (self->nr_classes == self->allocated_classes) {
+		const uint32_t allocated = self->allocated_classes * 2 ?: 64;
+		struct class_output *classes =
+			realloc(self->classes, allocated * sizeof(*classes));
+
+		if (classes == NULL)
+			return -ENOMEM;
+
+		self->classes		= classes;
+		self->allocated_classes = allocated;
+	}
+
+	self->classes[self->nr_classes].str   = str;
+	self->classes[self->nr_classes++].end = ftell(fp);
+	return 0;
+}
+
+static void cu_output__delete(void *self)
+{
+	struct cu_output *output = self;
+
+	free(output->buf);
+	free(output->classes);
+	free(output);
+}
+
+/*
+ * With --dedup_layouts anonymous structs go by the name of their first
+ * typedef, if any, so that the ones with different typedefs are all printed.
+ */
+static const char *class__dedup_name(struct class *self, struct cu *cu,
+				     uint16_t id)
+{
+	const char *name = class__name(self, cu);
+
+	if (name == NULL) {
+		const struct tag *tdef = cu__find_first_typedef_of_type(cu, id);
+
+		if (tdef != NULL)
+			name = class__name(tag__class(tdef), cu);
+	}
+
+	return name ?: "";
+}
+
+static uint64_t clock__ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * For -R without -C and for --instances, reorganizes @class, from the cu
+ * number @nr in load order, keeping the result in @self for
+ * print_reorg_report and print_instances_report. The formatter
+ * threads may do it for the same struct in more than one cu, the first cu
+ * wins, like when printing the structs. That is the first cu having it,
+ * holes or not, the ones without holes being kept too, with nothing saved,
+ * so that which cu wins doesn't depend on the holes.
+ */
+static int structure__reorganize(struct structure *self, struct class *class,
+				 struct cu *cu, uint32_t nr, FILE *fp)
+{
+	struct structures_tree *tree;
+	struct class *clone = class, *greedy = class;
+	struct class_member *pos;
+	uint32_t wasted = class->padding;
+	uint64_t greedy_ns = 0, pack_ns = 0;
+	int err = 0;
+
+	type__for_each_data_member(&class->type, pos)
+		wasted += pos->hole;
+
+	if ((class->nr_holes != 0 || class->nr_bit_holes != 0) &&
+	    (reorg_benchmark ||
+	     class__size_lower_bound(class, cu) < class__size(class))) {
+		uint64_t start;
+
+		if (reorg_benchmark) {
+			greedy = class__clone(class, NULL, cu);
+			if (greedy == NULL)
+				return -ENOMEM;
+			start = clock__ns();
+			class__reorganize(greedy, cu, 0, fp);
+			greedy_ns = clock__ns() - start;
+		}
+
+		clone = class__clone(class, NULL, cu);
+		if (clone == NULL) {
+			err = -ENOMEM;
+			goto out_delete_greedy;
+		}
+		start = clock__ns();
+		err = class__pack(clone, cu, reorg_budget_ms, fp);
+		if (err == -ENOMEM)
+			goto out_delete_clone;
+		if (err != 0)
+			class__reorganize(clone, cu, 0, fp);
+		pack_ns = clock__ns() - start;
+	}
+
+	tree = structures__find_tree(self->name);
+	pthread_mutex_lock(&tree->lock);
+	if (nr < self->reorg_cu) {
+		self->reorg_cu		= nr;
+		self->size		= class__size(class);
+		self->new_size		= class__size(clone);
+		self->wasted		= wasted;
+		self->nr_holes		= class->nr_holes;
+		self->nr_bit_holes	= class->nr_bit_holes;
+		self->nr_cachelines	= tag__nr_cachelines(class__tag(class),
+							     cu);
+		self->new_nr_cachelines =
+			tag__nr_cachelines(class__tag(clone), cu);
+		self->greedy_size	= class__size(greedy);
+		self->pack_fallback	= err != 0;
+		self->greedy_ns		= greedy_ns;
+		self->pack_ns		= pack_ns;
+	}
+	pthread_mutex_unlock(&tree->lock);
+	err = 0;
+	/* Only their sizes were needed, the last cloned is deleted first */
+out_delete_clone:
+	if (clone != class)
+		class__delete(clone, cu);
+out_delete_greedy:
+	if (greedy != class)
+		class__delete(greedy, cu);
+	return err;
+}
+
+/*
+ * From the formatter threads @nr is the cu number in load order and @output
+ * gets where each struct output ends, see pahole_format_cu. With @output
+ * NULL this runs in the loader thread, that knows what was printed for the
+ * previous cus.
+ */
+static void print_classes(struct cu *cu, uint32_t nr, FILE *fp,
+			  struct cu_output *output)
+{
+	uint16_t id;
+	struct class *pos;
+
+	cu__for_each_struct(cu, id, pos) {
+		bool existing_entry = false;
+		struct structure *str = NULL;
+
+		if (pos->type.namespace.name == 0 &&
+		    !(class__include_anonymous ||
+		      class__include_nested_anonymous))
+			continue;
+
+		if (!class__filter(pos, cu, id))
+			continue;
+		/*
+		 * Anonymous structs can't be told apart by name, so they are
+		 * only deduplicated with --dedup_layouts, that looks at what
+		 * is in them.
+		 */
+		if (pos->type.namespace.name != 0 || dedup_layouts) {
+			const char *name = class__name(pos, cu);
+			uint64_t layout = 0;
+
+			if (dedup_layouts) {
+				name   = class__dedup_name(pos, cu, id);
+				layout = class__layout_hash(pos, cu);
+			}
+
+			str = structures__claim(name, layout, nr,
+						&existing_entry);
+			if (str == NULL)
+				goto out_enomem;
+			/* The loader thread knows about the previous cus */
+			if (output == NULL)
+				existing_entry = structure__seen(str, nr);
+
+			/* Already printed... */
+			if (existing_entry) {
+				if (output == NULL) {
+					str->nr_files++;
+					continue;
+				}
+				goto next;
+			}
+		}
+
+		if (reorganize || instances_filename != NULL) {
+			/* Only the named ones, see print_reorg_report */
+			if (str != NULL &&
+			    structure__reorganize(str, pos, cu, nr, fp) != 0)
+				goto out_enomem;
+		} else if (show_packable && !global_verbose)
+			print_packable_info(pos, cu, id, fp);
+		else if (formatter != NULL)
+			formatter(pos, cu, id, fp);
+next:
+		if (output != NULL && cu_output__add(output, str, fp) != 0)
+			goto out_enomem;
+	}
+
+	return;
+out_enomem:
+	fprintf(stderr, "pahole: insufficient memory for "
+		"processing %s, skipping it...\n", cu->name);
+}
+
+static struct cu *cu__filter(struct cu *cu)
+{
+	if (cu__exclude_prefix != NULL &&
+	    (cu->name == NULL ||
+	     strncmp(cu__exclude_prefix, cu->name,
+		     cu__exclude_prefix_len) == 0))
+		return NULL;
+
+	return cu;
+}
+
+static int class__packable(struct class *self, struct cu *cu)
+{
+	struct class *clone;
+
+	if (self->nr_holes == 0 && self->nr_bit_holes == 0)
+		return 0;
+	/* Most of the ones with holes can't get smaller anyway */
+	if (class__size_lower_bound(self, cu) >= class__size(self))
+		return 0;
+
+	clone = class__clone(self, NULL, cu);
+	if (clone == NULL)
+		return 0;
+	/* As with -R */
+	if (class__pack(clone, cu, reorg_budget_ms, stdout) != 0)
+		class__reorganize(clone, cu, 0, stdout);
+	if (class__size(self) > class__size(clone)) {
+		self->priv = clone;
+		return 1;
+	}
+	/* FIXME: we need to free in the right order,
+	 *	  cu->obstack is being corrupted...
+	class__delete(clone, cu);
+	*/
+	return 0;
+}
+
+static struct class *class__filter(struct class *class, struct cu *cu,
+				   uint16_t tag_id)
+{
+	struct tag *tag = class__tag(class);
+	const char *name;
+
+	if (!tag->top_level) {
+		class__find_holes(class);
+
+		if (!show_private_classes)
+			return NULL;
+	}
+
+	name = class__name(class, cu);
+
+	if (class__is_declaration(class))
+		return NULL;
+
+	if (!class__include_anonymous && name == NULL)
+		return NULL;
+
+	if (class__exclude_prefix != NULL) {
+		if (name == NULL) {
+			const struct tag *tdef =
+				cu__find_first_typedef_of_type(cu, tag_id);
+			if (tdef != NULL) {
+				struct class *c = tag__class(tdef);
+
+				name = class__name(c, cu);
+			}
+		}
+		if (name != NULL && strncmp(class__exclude_prefix, name,
+					    class__exclude_prefix_len) == 0)
+			return NULL;
+	}
+
+	if (class__include_prefix != NULL) {
+		if (name == NULL) {
+			const struct tag *tdef =
+				cu__find_first_typedef_of_type(cu, tag_id);
+			if (tdef != NULL) {
+				struct class *c = tag__class(tdef);
+
+				name = class__name(c, cu);
+			}
+		}
+		if (name != NULL && strncmp(class__include_prefix, name,
+					    class__include_prefix_len) != 0)
+			return NULL;
+	}
+
+	if (decl_exclude_prefix != NULL &&
+	    (!tag__decl_file(tag, cu) ||
+	     strncmp(decl_exclude_prefix, tag__decl_file(tag, cu),
+		     decl_exclude_prefix_len) == 0))
+		return NULL;
+
+	if (tag->top_level)
+		class__find_holes(class);
+
+	if (class->nr_holes < nr_holes ||
+	    class->nr_bit_holes < nr_bit_holes ||
+	    (hole_size_ge != 0 && !class__has_hole_ge(class, hole_size_ge)))
+		return NULL;
+
+	if (show_packable && !class__packable(class, cu))
+		return NULL;
+
+	return class;
+}
+
+static void union__find_new_size(struct tag *tag, struct cu *cu,
+				  uint8_t original_word_size);
+
+static void class__resize_LP(struct tag *tag, struct cu *cu,
+			     uint8_t original_word_size)
+{
+	struct tag *tag_pos;
+	struct class *self = tag__class(tag);
+	size_t word_size_diff;
+	size_t orig_size = self->type.size;
+
+	if (tag__type(tag)->resized)
+		return;
+
+	tag__type(tag)->resized = 1;
+
+	if (original_word_size > word_size)
+		word_size_diff = original_word_size - word_size;
+	else
+		word_size_diff = word_size - original_word_size;
+
+	type__for_each_tag(tag__type(tag), tag_pos) {
+		struct tag *type;
+		size_t diff = 0;
+		size_t array_multiplier = 1;
+
+		/* we want only data members, i.e. with byte_offset attr */
+		if (tag_pos->tag != DW_TAG_member &&
+		    tag_pos->tag != DW_TAG_inheritance)
+		    	continue;
+
+		type = cu__type(cu, tag_pos->type);
+		tag__assert_search_result(type);
+		if (type->tag == DW_TAG_array_type) {
+			int i;
+			for (i = 0; i < tag__array_type(type)->dimensions; ++i)
+				array_multiplier *= tag__array_type(type)->nr_entries[i];
+
+			type = cu__type(cu, type->type);
+			tag__assert_search_result(type);
+		}
+
+		if (tag__is_typedef(type)) {
+			type = tag__follow_typedef(type, cu);
+			tag__assert_search_result(type);
+		}
+
+		switch (type->tag) {
+		case DW_TAG_base_type: {
+			struct base_type *bt = tag__base_type(type);
+			char bf[64];
+			const char *name = base_type__name(bt, cu, bf,
+							   sizeof(bf));
+			if (strcmp(name, "long int") != 0 &&
+			    strcmp(name, "long unsigned int") != 0)
+				break;
+			/* fallthru */
+		}
+		case DW_TAG_pointer_type:
+			diff = word_size_diff;
+			break;
+		case DW_TAG_structure_type:
+		case DW_TAG_union_type:
+			if (tag__is_union(type))
+				union__find_new_size(type, cu,
+						     original_word_size);
+			else
+				class__resize_LP(type, cu,
+						 original_word_size);
+			diff = tag__type(type)->size_diff;
+			break;
+		}
 
 		diff *= array_multiplier;
 
@@ -510,11 +2241,13 @@ static void class__resize_LP(struct tag *tag, struct cu *cu)
 	else
 		tag__type(tag)->size_diff = self->type.size - orig_size;
 
-	class__find_holes(self);
+	class__refind_holes(self);
 	class__fixup_alignment(self, cu);
+	cu__invalidate_resolved_types(cu);
 }
 
-static void union__find_new_size(struct tag *tag, struct cu *cu)
+static void union__find_new_size(struct tag *tag, struct cu *cu,
+				  uint8_t original_word_size)
 {
 	struct tag *tag_pos;
 	struct type *self = tag__type(tag);
@@ -540,9 +2273,9 @@ static void union__find_new_size(struct tag *tag, struct cu *cu)
 			type = tag__follow_typedef(type, cu);
 
 		if (tag__is_union(type))
-			union__find_new_size(type, cu);
+			union__find_new_size(type, cu, original_word_size);
 		else if (tag__is_struct(type))
-			class__resize_LP(type, cu);
+			class__resize_LP(type, cu, original_word_size);
 
 		size = tag__size(type, cu);
 		if (size > max_size)
@@ -555,15 +2288,17 @@ static void union__find_new_size(struct tag *tag, struct cu *cu)
 		self->size_diff = self->size - max_size;
 
 	self->size = max_size;
+	cu__invalidate_resolved_types(cu);
 }
 
-static void tag__fixup_word_size(struct tag *tag, struct cu *cu)
+static void tag__fixup_word_size(struct tag *tag, struct cu *cu,
+				  uint8_t original_word_size)
 {
 	if (tag__is_struct(tag) || tag__is_union(tag)) {
 		struct tag *pos;
 
 		namespace__for_each_tag(tag__namespace(tag), pos)
-			tag__fixup_word_size(pos, cu);
+			tag__fixup_word_size(pos, cu, original_word_size);
 	}
 
 	switch (tag->tag) {
@@ -581,15 +2316,17 @@ static void tag__fixup_word_size(struct tag *tag, struct cu *cu)
 		const char *name = base_type__name(bt, cu, bf, sizeof(bf));
 
 		if (strcmp(name, "long int") == 0 ||
-		    strcmp(name, "long unsigned int") == 0)
+		    strcmp(name, "long unsigned int") == 0) {
 			bt->bit_size = word_size * 8;
+			cu__invalidate_resolved_types(cu);
+		}
 	}
 		break;
 	case DW_TAG_structure_type:
-		class__resize_LP(tag, cu);
+		class__resize_LP(tag, cu, original_word_size);
 		break;
 	case DW_TAG_union_type:
-		union__find_new_size(tag, cu);
+		union__find_new_size(tag, cu, original_word_size);
 		break;
 	}
 
@@ -598,115 +2335,143 @@ static void tag__fixup_word_size(struct tag *tag, struct cu *cu)
 
 static void cu_fixup_word_size_iterator(struct cu *cu)
 {
-	original_word_size = cu->addr_size;
+	const uint8_t original_word_size = cu->addr_size;
+
 	cu->addr_size = word_size;
+	/* The cached sizes of pointers and of what contains them are stale */
+	cu__invalidate_resolved_types(cu);
 
 	uint16_t id;
 	struct tag *pos;
 	cu__for_each_type(cu, id, pos)
-		tag__fixup_word_size(pos, cu);
+		tag__fixup_word_size(pos, cu, original_word_size);
 }
 
 static void cu__account_nr_methods(struct cu *self)
 {
-	struct function *pos_function;
+	struct class *pos;
 	struct structure *str;
-	uint32_t id;
+	uint16_t id;
 
-	cu__for_each_function(self, id, pos_function) {
-		struct class_member *pos;
-		list_for_each_entry(pos, &pos_function->proto.parms, tag.node) {
-			struct tag *type = cu__type(self, pos->tag.type);
+	cu__for_each_struct(self, id, pos) {
+		struct method_ref *method, *end;
+		uint32_t nr_methods = 0;
 
-			if (type == NULL || type->tag != DW_TAG_pointer_type)
-				continue;
+		if (pos->type.namespace.name == 0)
+			continue;
 
-			type = cu__type(self, type->type);
-			if (type == NULL || !tag__is_struct(type))
-				continue;
+		cu__for_each_method(self, id, method, end)
+			nr_methods += method->nr_parms;
 
-			struct type *ctype = tag__type(type);
-			if (ctype->namespace.name == 0)
-				continue;
+		if (nr_methods == 0 || !class__filter(pos, self, id))
+			continue;
 
-			struct class *class = tag__class(type);
+		bool existing_entry;
+		str = structures__add(pos, self, &existing_entry);
+		if (str == NULL) {
+			fprintf(stderr, "pahole: insufficient memory "
+				"for processing %s, skipping it...\n",
+				self->name);
+			return;
+		}
 
-			if (!class__filter(class, self, 0))
-				continue;
+		if (!existing_entry)
+			class__find_holes(pos);
+		str->nr_methods += nr_methods;
+	}
+}
+
+static char tab[128];
+
+static int class__print_pointers_to(struct class *self, struct cu *cu,
+				    uint16_t type, FILE *fp)
+{
+	struct class_member *pos_member;
+	bool looked = false;
+	struct structure *str;
 
+	if (self->type.namespace.name == 0)
+		return 0;
+
+	type__for_each_member(&self->type, pos_member) {
+		struct tag *ctype = cu__type(cu, pos_member->tag.type);
+
+		tag__assert_search_result(ctype);
+		if (ctype->tag != DW_TAG_pointer_type || ctype->type != type)
+			continue;
+
+		if (!looked) {
 			bool existing_entry;
-			str = structures__add(class, self, &existing_entry);
+
+			str = structures__add(self, cu, &existing_entry);
 			if (str == NULL) {
-				fprintf(stderr, "pahole: insufficient memory "
-					"for processing %s, skipping it...\n",
-					self->name);
-				return;
+				fprintf(stderr, "pahole: insufficient memory for "
+					"processing %s, skipping it...\n",
+					cu->name);
+				return -1;
 			}
-
-			if (!existing_entry)
-				class__find_holes(class);
-			++str->nr_methods;
+			/*
+			 * We already printed this struct in another CU
+			 */
+			if (existing_entry)
+				break;
+			looked = true;
 		}
+		fprintf(fp, "%s: %s\n", str->name,
+			class_member__name(pos_member, cu));
 	}
-}
 
-static char tab[128];
+	return 0;
+}
 
-static void print_structs_with_pointer_to(const struct cu *cu, uint16_t type)
+static void print_structs_with_pointer_to(struct cu *cu, uint16_t type,
+					  FILE *fp)
 {
-	struct class *pos;
-	struct class_member *pos_member;
-	uint16_t id;
+	struct type_ref *pointer, *pointers_end;
 
-	cu__for_each_struct(cu, id, pos) {
-		bool looked = false;
-		struct structure *str;
+	cu__for_each_type_ref(cu, type, pointer, pointers_end) {
+		struct type_ref *ref, *end;
+		struct tag *last = NULL;
 
-		if (pos->type.namespace.name == 0)
+		if (pointer->from->tag != DW_TAG_pointer_type)
 			continue;
 
-		type__for_each_member(&pos->type, pos_member) {
-			struct tag *ctype = cu__type(cu, pos_member->tag.type);
-
-			tag__assert_search_result(ctype);
-			if (ctype->tag != DW_TAG_pointer_type || ctype->type != type)
+		cu__for_each_type_ref(cu, pointer->id, ref, end) {
+			/*
+			 * Members of the same struct are contiguous in the
+			 * index, class__print_pointers_to looks at all of them
+			 */
+			if (ref->owner == NULL || ref->owner == last ||
+			    !tag__is_struct(ref->owner))
 				continue;
 
-			if (!looked) {
-				bool existing_entry;
-
-				str = structures__add(pos, cu, &existing_entry);
-				if (str == NULL) {
-					fprintf(stderr, "pahole: insufficient memory for "
-						"processing %s, skipping it...\n",
-						cu->name);
-					return;
-				}
-				/*
-				 * We already printed this struct in another CU
-				 */
-				if (existing_entry)
-					break;
-				looked = true;
-			}
-			printf("%s: %s\n", str->name,
-			       class_member__name(pos_member, cu));
+			last = ref->owner;
+			if (class__print_pointers_to(tag__class(last), cu,
+						     type, fp) != 0)
+				return;
 		}
 	}
 }
 
-static void print_containers(const struct cu *cu, uint16_t type, int ident)
+static void print_containers(struct cu *cu, uint16_t type, int ident,
+			     FILE *fp)
 {
-	struct class *pos;
-	uint16_t id;
+	struct type_ref *ref, *end;
+	struct tag *last = NULL;
 
-	cu__for_each_struct(cu, id, pos) {
+	cu__for_each_type_ref(cu, type, ref, end) {
+		struct class *pos;
+
+		if (ref->owner == NULL || ref->owner == last ||
+		    !tag__is_struct(ref->owner))
+			continue;
+
+		last = ref->owner;
+		pos = tag__class(last);
 		if (pos->type.namespace.name == 0)
 			continue;
 
 		const uint32_t n = type__nr_members_of_type(&pos->type, type);
-		if (n == 0)
-			continue;
 
 		if (ident == 0) {
 			bool existing_entry;
@@ -724,12 +2489,12 @@ static void print_containers(const struct cu *cu, uint16_t type, int ident)
 				break;
 		}
 
-		printf("%.*s%s", ident * 2, tab, class__name(pos, cu));
+		fprintf(fp, "%.*s%s", ident * 2, tab, class__name(pos, cu));
 		if (global_verbose)
-			printf(": %u", n);
-		putchar('\n');
+			fprintf(fp, ": %u", n);
+		fputc('\n', fp);
 		if (recursive)
-			print_containers(cu, id, ident + 1);
+			print_containers(cu, ref->id, ident + 1, fp);
 	}
 }
 
@@ -742,6 +2507,16 @@ ARGP_PROGRAM_VERSION_HOOK_DEF = dwarves_print_version;
 #define ARGP_first_obj_only	   303
 #define ARGP_classes_as_structs	   304
 #define ARGP_hex_fmt		   305
+#define ARGP_save_snapshot	   306
+#define ARGP_dedup_layouts	   307
+#define ARGP_instances		   308
+#define ARGP_accesses		   309
+#define ARGP_c2c		   310
+#define ARGP_access_groups	   311
+#define ARGP_reorg_budget	   312
+#define ARGP_reorg_benchmark	   313
+#define ARGP_serve		   314
+#define ARGP_client		   315
 
 static const struct argp_option pahole__options[] = {
 	{
@@ -964,6 +2739,86 @@ static const struct argp_option pahole__options[] = {
 		.key  = ARGP_hex_fmt,
 		.doc  = "Print offsets and sizes in hexadecimal",
 	},
+	{
+		.name = "save_snapshot",
+		.key  = ARGP_save_snapshot,
+		.arg  = "FILE",
+		.doc  = "Save the CUs to FILE, to be loaded faster later",
+	},
+	{
+		.name = "dedup_layouts",
+		.key  = ARGP_dedup_layouts,
+		.doc  = "Print each struct layout once, anonymous ones included, "
+			"then how many CUs have it",
+	},
+	{
+		.name = "instances",
+		.key  = ARGP_instances,
+		.arg  = "FILE",
+		.doc  = "Rank the structs by the bytes wasted in holes and "
+			"padding by the instances in FILE, a copy of "
+			"/proc/slabinfo or a 'name,count' CSV file",
+	},
+	{
+		.name = "accesses",
+		.key  = ARGP_accesses,
+		.arg  = "FILE",
+		.doc  = "Show the structs with data address samples in FILE, "
+			"e.g. from perf mem, with the samples per member and "
+			"cacheline",
+	},
+	{
+		.name = "c2c",
+		.key  = ARGP_c2c,
+		.arg  = "FILE",
+		.doc  = "Show the structs with false sharing in FILE, the "
+			"output of 'perf c2c report --stdio', and layouts "
+			"avoiding it",
+	},
+	{
+		.name = "access_groups",
+		.key  = ARGP_access_groups,
+		.arg  = "FILE",
+		.doc  = "Lay out the structs in FILE, with lines like 'STRUCT "
+			"GROUP WEIGHT MEMBER...', with the members of the "
+			"heaviest access groups in the fewest cachelines",
+	},
+	{
+		.name = "reorg_budget",
+		.key  = ARGP_reorg_budget,
+		.arg  = "MS",
+		.doc  = "With -R, look for the smallest layout of each struct "
+			"for up to MS milliseconds, then just move members to "
+			"holes, default: 10",
+	},
+	{
+		.name = "reorg_benchmark",
+		.key  = ARGP_reorg_benchmark,
+		.doc  = "Reorganize all the structs looking for the smallest "
+			"layouts and just moving members to holes, comparing "
+			"the bytes saved and the time taken",
+	},
+	{
+		.name = "serve",
+		.key  = ARGP_serve,
+		.arg  = "SOCKET",
+		.doc  = "Load FILE once and answer queries from --client on "
+			"the UNIX socket SOCKET",
+	},
+	{
+		.name = "client",
+		.key  = ARGP_client,
+		.arg  = "SOCKET",
+		.doc  = "Ask the pahole serving on SOCKET for what -C, -i, "
+			"-f, -R -C or -s would print, no FILE needed",
+	},
+	{
+		.name = "jobs",
+		.key  = 'j',
+		.arg  = "NR_JOBS",
+		.doc  = "Print the structs using NR_JOBS threads, "
+			"default: one per online CPU",
+	},
 	{
 		.name = NULL,
 	}
@@ -995,6 +2850,7 @@ static error_t pahole__options_parser(int key, char *arg,
 		  conf_load.extra_dbg_info = 1;		break;
 	case 'i': find_containers = 1;
 		  class_name = arg;			break;
+	case 'j': nr_jobs = atoi(arg);			break;
 	case 'l': conf.show_first_biggest_size_base_type_member = 1;	break;
 	case 'M': conf.show_only_data_members = 1;	break;
 	case 'm': stats_formatter = nr_methods_formatter; break;
@@ -1043,58 +2899,261 @@ static error_t pahole__options_parser(int key, char *arg,
 		conf.classes_as_structs = 1;		break;
 	case ARGP_hex_fmt:
 		conf.hex_fmt = 1;			break;
+	case ARGP_c2c:
+		c2c_filename = arg;			break;
+	case ARGP_access_groups:
+		access_groups_filename = arg;		break;
+	case ARGP_reorg_budget:
+		reorg_budget_ms = atoi(arg);		break;
+	case ARGP_reorg_benchmark:
+		reorganize = 1;
+		reorg_benchmark = true;			break;
+	case ARGP_serve:
+		serve_socket = arg;			break;
+	case ARGP_client:
+		client_socket = arg;			break;
+	case ARGP_accesses:
+		accesses_filename = arg;		break;
+	case ARGP_instances:
+		instances_filename = arg;		break;
+	case ARGP_dedup_layouts:
+		/* Anonymous structs are told apart by layout too */
+		class__include_anonymous = 1;
+		dedup_layouts = true;			break;
+	case ARGP_save_snapshot:
+		snapshot_filename = arg;
+		conf_load.extra_dbg_info = 1;		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
-	return 0;
+	return 0;
+}
+
+static const char pahole__args_doc[] = "FILE";
+
+static struct argp pahole__argp = {
+	.options  = pahole__options,
+	.parser	  = pahole__options_parser,
+	.args_doc = pahole__args_doc,
+};
+
+static void do_reorg(struct tag *class, struct cu *cu, FILE *fp)
+{
+	int savings;
+	const uint8_t reorg_verbose =
+			show_reorg_steps ? 2 : global_verbose;
+	struct class *clone = class__clone(tag__class(class), NULL, cu);
+	if (clone == NULL) {
+		fprintf(stderr, "pahole: out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+	/* The steps are shown as class__reorganize moves the members */
+	if (reorg_verbose != 0 ||
+	    class__pack(clone, cu, reorg_budget_ms, fp) != 0)
+		class__reorganize(clone, cu, reorg_verbose, fp);
+	savings = class__size(tag__class(class)) - class__size(clone);
+	if (savings != 0 && reorg_verbose) {
+		fputc('\n', fp);
+		if (show_reorg_steps)
+			fputs("/* Final reorganized struct: */\n", fp);
+	}
+	tag__fprintf(class__tag(clone), cu, &conf, fp);
+	if (savings != 0) {
+		const size_t cacheline_savings =
+		      (tag__nr_cachelines(class, cu) -
+		       tag__nr_cachelines(class__tag(clone), cu));
+
+		fprintf(fp, "   /* saved %d byte%s", savings,
+			savings != 1 ? "s" : "");
+		if (cacheline_savings != 0)
+			fprintf(fp, " and %zu cacheline%s",
+				cacheline_savings,
+				cacheline_savings != 1 ?
+					"s" : "");
+		fputs("! */\n", fp);
+	} else
+		fputc('\n', fp);
+
+	/* FIXME: we need to free in the right order,
+	 *	  cu->obstack is being corrupted...
+	 class__delete(clone, cu);
+	*/
+}
+
+static void do_hot_cold(struct tag *class, struct cu *cu, FILE *fp)
+{
+	const size_t cacheline = dwarves__cacheline_size();
+	struct class *clone = class__clone(tag__class(class), NULL, cu);
+	struct access_groups__match match = {
+		.class_name = class__name(tag__class(class), cu),
+		.cu	    = cu,
+	};
+	uint32_t i;
+
+	if (clone == NULL ||
+	    class__hot_cold_layout(clone, cu, access_groups__member_group,
+				   &match, cacheline) != 0) {
+		fprintf(stderr, "pahole: out of memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	tag__fprintf(class__tag(clone), cu, &conf, fp);
+	fputc('\n', fp);
+	for (i = 0; i < nr_access_groups; ++i) {
+		const struct access_group *group = &access_groups[i];
+		uint32_t before, after;
+
+		if (strcmp(group->class_name, match.class_name) != 0)
+			continue;
+		before = access_group__nr_cachelines(group, tag__class(class),
+						     cu, cacheline);
+		after  = access_group__nr_cachelines(group, clone, cu,
+						     cacheline);
+		fprintf(fp, "   /* group %s (weight %" PRIu64 "): %u "
+			"cacheline%s before, %u after */\n", group->name,
+			group->weight, before, before != 1 ? "s" : "", after);
+	}
+	if (class__size(clone) > class__size(tag__class(class)))
+		fprintf(fp, "   /* %zd bytes bigger */\n",
+			(ssize_t)class__size(clone) -
+			class__size(tag__class(class)));
+	else if (class__size(clone) < class__size(tag__class(class)))
+		fprintf(fp, "   /* saved %zd bytes */\n",
+			(ssize_t)class__size(tag__class(class)) -
+			class__size(clone));
+	fputc('\n', fp);
+	class__delete(clone, cu);
+}
+
+/* What -C, -i, -f and -R print for the struct @class in @cu */
+static void print_class(struct tag *class, uint16_t class_id, struct cu *cu,
+			FILE *fp)
+{
+	class__find_holes(tag__class(class));
+	if (access_groups_filename != NULL)
+		do_hot_cold(class, cu, fp);
+	else if (reorganize)
+		do_reorg(class, cu, fp);
+	else if (find_containers)
+		print_containers(cu, class_id, 0, fp);
+	else if (find_pointers_in_structs)
+		print_structs_with_pointer_to(cu, class_id, fp);
+	else {
+		/*
+		 * We don't need to print it for every compile unit
+		 * but the previous options need
+		 */
+		tag__fprintf(class, cu, &conf, fp);
+		fputc('\n', fp);
+	}
+}
+
+/*
+ * For --serve: where each struct is first found, in load order, as -C, -i
+ * and -R look for it, i.e. defined, in @cu, or as -f does, declarations
+ * included, in @decl_cu.
+ */
+struct class_index {
+	struct rb_node rb_node;
+	const char     *name;
+	struct cu      *cu;
+	struct cu      *decl_cu;
+	uint32_t       cu_nr;
+	uint32_t       decl_cu_nr;
+	uint16_t       id;
+	uint16_t       decl_id;
+};
+
+static struct rb_root class_index__tree = RB_ROOT;
+
+static struct class_index *class_index__find(const char *name)
+{
+	struct rb_node *n = class_index__tree.rb_node;
+
+	while (n != NULL) {
+		struct class_index *pos = rb_entry(n, struct class_index,
+						   rb_node);
+		const int rc = strcmp(name, pos->name);
+
+		if (rc == 0)
+			return pos;
+		n = rc < 0 ? n->rb_left : n->rb_right;
+	}
+
+	return NULL;
 }
 
-static const char pahole__args_doc[] = "FILE";
+static struct class_index *class_index__findnew(const char *name)
+{
+	struct rb_node **p = &class_index__tree.rb_node, *parent = NULL;
+	struct class_index *pos;
 
-static struct argp pahole__argp = {
-	.options  = pahole__options,
-	.parser	  = pahole__options_parser,
-	.args_doc = pahole__args_doc,
-};
+	while (*p != NULL) {
+		int rc;
 
-static void do_reorg(struct tag *class, struct cu *cu)
-{
-	int savings;
-	const uint8_t reorg_verbose =
-			show_reorg_steps ? 2 : global_verbose;
-	struct class *clone = class__clone(tag__class(class), NULL, cu);
-	if (clone == NULL) {
-		fprintf(stderr, "pahole: out of memory!\n");
-		exit(EXIT_FAILURE);
+		parent = *p;
+		pos = rb_entry(parent, struct class_index, rb_node);
+		rc = strcmp(name, pos->name);
+		if (rc == 0)
+			return pos;
+		p = rc < 0 ? &(*p)->rb_left : &(*p)->rb_right;
 	}
-	class__reorganize(clone, cu, reorg_verbose, stdout);
-	savings = class__size(tag__class(class)) - class__size(clone);
-	if (savings != 0 && reorg_verbose) {
-		putchar('\n');
-		if (show_reorg_steps)
-			puts("/* Final reorganized struct: */");
+
+	pos = zalloc(sizeof(*pos));
+	if (pos == NULL)
+		return NULL;
+
+	pos->name = name;
+	rb_link_node(&pos->rb_node, parent, p);
+	rb_insert_color(&pos->rb_node, &class_index__tree);
+	return pos;
+}
+
+/* @cu being the @nr-th loaded, kept till the end, its names included */
+static int class_index__add_cu(struct cu *cu, uint32_t nr)
+{
+	struct tag *pos;
+	uint16_t id;
+
+	cu__for_each_type(cu, id, pos) {
+		struct class_index *index;
+		const char *name;
+
+		if (!tag__is_struct(pos))
+			continue;
+		name = type__name(tag__type(pos), cu);
+		if (name == NULL)
+			continue;
+
+		index = class_index__findnew(name);
+		if (index == NULL)
+			return -ENOMEM;
+		if (index->decl_cu == NULL) {
+			index->decl_cu	  = cu;
+			index->decl_cu_nr = nr;
+			index->decl_id	  = id;
+		}
+		if (index->cu == NULL && !tag__type(pos)->declaration) {
+			index->cu    = cu;
+			index->cu_nr = nr;
+			index->id    = id;
+		}
 	}
-	tag__fprintf(class__tag(clone), cu, &conf, stdout);
-	if (savings != 0) {
-		const size_t cacheline_savings =
-		      (tag__nr_cachelines(class, cu) -
-		       tag__nr_cachelines(class__tag(clone), cu));
 
-		printf("   /* saved %d byte%s", savings,
-		       savings != 1 ? "s" : "");
-		if (cacheline_savings != 0)
-			printf(" and %zu cacheline%s",
-			       cacheline_savings,
-			       cacheline_savings != 1 ?
-					"s" : "");
-		puts("! */");
-	} else
-		putchar('\n');
+	return 0;
+}
 
-	/* FIXME: we need to free in the right order,
-	 *	  cu->obstack is being corrupted...
-	 class__delete(clone, cu);
-	*/
+void class_index__delete(void)
+{
+	struct rb_node *next = rb_first(&class_index__tree);
+
+	while (next != NULL) {
+		struct class_index *pos = rb_entry(next, struct class_index,
+						   rb_node);
+		next = rb_next(&pos->rb_node);
+		rb_erase(&pos->rb_node, &class_index__tree);
+		free(pos);
+	}
 }
 
 static enum load_steal_kind pahole_stealer(struct cu *cu,
@@ -1105,6 +3164,46 @@ static enum load_steal_kind pahole_stealer(struct cu *cu,
 	if (!cu__filter(cu))
 		goto filter_it;
 
+	if (serve_socket != NULL) {
+		static uint32_t nr_cus;
+
+		/* Just the first cu let thru is kept, as printed otherwise */
+		if (first_obj_only && nr_cus != 0) {
+			ret = LSK__STOP_LOADING;
+			goto filter_it;
+		}
+
+		/* Queried after loading, see pahole__serve */
+		if (class_index__add_cu(cu, nr_cus++) != 0) {
+			fputs("pahole: out of memory!\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		return LSK__KEEPIT;
+	}
+
+	if (cu_pipeline != NULL) {
+		/* It deletes the cu when done with it */
+		if (cu_pipeline__add(cu_pipeline, cu) != 0 || first_obj_only)
+			return LSK__STOP_LOADING;
+		return LSK__STOLEN;
+	}
+
+	if (snapshot_writer != NULL) {
+		if (snapshot_writer__add_cu(snapshot_writer, cu) != 0)
+			goto dump_and_stop;
+		goto dump_it;
+	}
+
+	if (accesses_filename != NULL || c2c_filename != NULL) {
+		if (cu__account_accesses(cu) != 0) {
+			fprintf(stderr, "pahole: insufficient memory for "
+				"processing %s, skipping it...\n", cu->name);
+			goto dump_it;
+		}
+		/* The structs are printed after loading, see print_accesses */
+		return LSK__KEEPIT;
+	}
+
 	if (ctf_encode) {
 		cu__encode_ctf(cu, global_verbose);
 		/*
@@ -1115,7 +3214,7 @@ static enum load_steal_kind pahole_stealer(struct cu *cu,
 		goto dump_and_stop;
 	}
 
-	if (class_name == NULL) {
+	if (!filter_classes) {
 		if (stats_formatter == nr_methods_formatter) {
 			cu__account_nr_methods(cu);
 			goto dump_it;
@@ -1124,9 +3223,9 @@ static enum load_steal_kind pahole_stealer(struct cu *cu,
 		if (word_size != 0)
 			cu_fixup_word_size_iterator(cu);
 
-		memset(tab, ' ', sizeof(tab) - 1);
+		static uint32_t nr_cus;
 
-		print_classes(cu);
+		print_classes(cu, nr_cus++, stdout, NULL);
 		goto dump_it;
 	}
 
@@ -1156,21 +3255,7 @@ static enum load_steal_kind pahole_stealer(struct cu *cu,
 		 */
 		strlist__remove(class_names, pos);
 
-		class__find_holes(tag__class(class));
-		if (reorganize)
-			do_reorg(class, cu);
-		else if (find_containers)
-			print_containers(cu, class_id, 0);
-		else if (find_pointers_in_structs)
-			print_structs_with_pointer_to(cu, class_id);
-		else {
-			/*
-			 * We don't need to print it for every compile unit
-			 * but the previous options need
-			 */
-			tag__fprintf(class, cu, &conf, stdout);
-			putchar('\n');
-		}
+		print_class(class, class_id, cu, stdout);
 	}
 
 	/*
@@ -1188,6 +3273,397 @@ filter_it:
 	return ret;
 }
 
+/* Runs in the cu_pipeline threads, see print_classes */
+static int pahole_format_cu(struct cu *cu, uint32_t nr,
+			    void *cookie __unused, void **priv)
+{
+	struct cu_output *output = zalloc(sizeof(*output));
+	FILE *fp;
+
+	if (output == NULL)
+		return -ENOMEM;
+
+	*priv = output;
+	output->nr = nr;
+	fp = open_memstream(&output->buf, &output->size);
+	if (fp == NULL)
+		return -ENOMEM;
+
+	if (word_size != 0)
+		cu_fixup_word_size_iterator(cu);
+
+	print_classes(cu, nr, fp, output);
+	return fclose(fp) == 0 ? 0 : -ENOMEM;
+}
+
+/*
+ * Called in cu order, so the structs are accounted as in the sequential
+ * case and only the first cu that has a struct gets it printed.
+ */
+static int pahole_merge(void *cookie __unused, void *priv)
+{
+	struct cu_output *output = priv;
+	size_t start = 0;
+	uint32_t i;
+	int err = 0;
+
+	for (i = 0; i < output->nr_classes; ++i) {
+		struct class_output *class = &output->classes[i];
+
+		if (class->str != NULL &&
+		    structure__seen(class->str, output->nr))
+			class->str->nr_files++;
+		else if (class->end != start &&
+			 fwrite(output->buf + start, class->end - start,
+				1, stdout) != 1) {
+			err = -errno ?: -EIO;
+			break;
+		}
+		start = class->end;
+	}
+
+	cu_output__delete(output);
+	return err;
+}
+
+/* A struct a query asks for, where the stealer would find it */
+struct class_query {
+	const char *name;
+	struct cu  *cu;
+	uint32_t   cu_nr;
+	uint16_t   id;
+};
+
+/* In cu order, then in name order, as the stealer prints them */
+static int class_query__cmp(const void *a, const void *b)
+{
+	const struct class_query *qa = a, *qb = b;
+
+	if (qa->cu_nr != qb->cu_nr)
+		return qa->cu_nr < qb->cu_nr ? -1 : 1;
+	return strcmp(qa->name, qb->name);
+}
+
+static int pahole__query_classes(char *names, bool include_decls, FILE *fp)
+{
+	struct class_query *queries = NULL;
+	uint32_t nr_queries = 0, i;
+	char *saveptr, *name;
+
+	for (name = strtok_r(names, ",", &saveptr); name != NULL;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		const struct class_index *index = class_index__find(name);
+		struct class_query *query;
+
+		if (index == NULL || (include_decls ? index->decl_cu :
+						      index->cu) == NULL)
+			continue;
+		/* Dups are ignored, as in -C */
+		for (i = 0; i < nr_queries; ++i)
+			if (strcmp(queries[i].name, name) == 0)
+				break;
+		if (i != nr_queries)
+			continue;
+
+		query = realloc(queries, (nr_queries + 1) * sizeof(*query));
+		if (query == NULL) {
+			free(queries);
+			return -ENOMEM;
+		}
+		queries = query;
+		query = &queries[nr_queries++];
+		query->name  = index->name;
+		query->cu    = include_decls ? index->decl_cu : index->cu;
+		query->cu_nr = include_decls ? index->decl_cu_nr :
+					       index->cu_nr;
+		query->id    = include_decls ? index->decl_id : index->id;
+	}
+
+	if (nr_queries == 0)
+		return 0;
+
+	qsort(queries, nr_queries, sizeof(*queries), class_query__cmp);
+	for (i = 0; i < nr_queries; ++i) {
+		struct cu *cu = queries[i].cu;
+		/*
+		 * The clones -R prints are never freed, so that a long running
+		 * --serve doesn't grow with each query they go, with the
+		 * caches pointing to them.
+		 */
+		void *mark = obstack_alloc(&cu->obstack, 1);
+
+		if (mark == NULL) {
+			free(queries);
+			return -ENOMEM;
+		}
+		print_class(cu__type(cu, queries[i].id), queries[i].id, cu, fp);
+		obstack_free(&cu->obstack, mark);
+		cu__invalidate_resolved_types(cu);
+	}
+
+	free(queries);
+	return 0;
+}
+
+/*
+ * pahole__query - answer a --serve query
+ * @cus: the cus loaded, in load order, see class_index__add_cu
+ * @query: "class", "containers", "pointers" or "reorg", then a comma
+ *	   separated list of struct names, or "sizes"
+ * @fp: where to print what -C, -i, -f, -R -C or -s would
+ */
+static int pahole__query(struct cus *cus, char *query, FILE *fp)
+{
+	char *saveptr, *verb = strtok_r(query, " \t\n", &saveptr),
+	     *names = strtok_r(NULL, " \t\n", &saveptr);
+	int err = 0;
+
+	if (verb == NULL || strtok_r(NULL, " \t\n", &saveptr) != NULL)
+		return -EINVAL;
+
+	/* As if just started, e.g. for -i printing each struct once */
+	structures__delete();
+	structures__init();
+
+	if (strcmp(verb, "sizes") == 0) {
+		struct cu *cu;
+		uint32_t nr = 0;
+
+		if (names != NULL)
+			return -EINVAL;
+
+		formatter = size_formatter;
+		list_for_each_entry(cu, &cus->cus, node)
+			print_classes(cu, nr++, fp, NULL);
+		formatter = class_formatter;
+		return 0;
+	}
+
+	if (names == NULL)
+		return -EINVAL;
+
+	if (strcmp(verb, "class") == 0)
+		err = pahole__query_classes(names, false, fp);
+	else if (strcmp(verb, "containers") == 0) {
+		find_containers = 1;
+		err = pahole__query_classes(names, false, fp);
+		find_containers = 0;
+	} else if (strcmp(verb, "pointers") == 0) {
+		find_pointers_in_structs = 1;
+		err = pahole__query_classes(names, true, fp);
+		find_pointers_in_structs = 0;
+	} else if (strcmp(verb, "reorg") == 0) {
+		reorganize = 1;
+		err = pahole__query_classes(names, false, fp);
+		reorganize = 0;
+	} else
+		err = -EINVAL;
+
+	return err;
+}
+
+static int write_all(int fd, const void *buf, size_t size)
+{
+	while (size != 0) {
+		/* The client going away is not a reason to stop serving */
+		const ssize_t n = send(fd, buf, size, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf   = (const char *)buf + n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Each query is a line, each answer "OK SIZE\n" followed by SIZE bytes,
+ * what pahole would print, or "ERR message\n".
+ */
+static void pahole__serve_client(struct cus *cus, int fd)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	FILE *in = fdopen(dup(fd), "r");
+
+	if (in == NULL)
+		return;
+
+	while (getline(&line, &line_size, in) != -1) {
+		char header[128], *buf = NULL;
+		size_t size = 0;
+		FILE *fp = open_memstream(&buf, &size);
+		int err = fp != NULL ? pahole__query(cus, line, fp) : -ENOMEM;
+
+		if (fp != NULL && fclose(fp) != 0 && err == 0)
+			err = -ENOMEM;
+		if (err != 0) {
+			snprintf(header, sizeof(header), "ERR %s\n",
+				 strerror(-err));
+			size = 0;
+		} else
+			snprintf(header, sizeof(header), "OK %zu\n", size);
+
+		err = write_all(fd, header, strlen(header)) ?:
+		      write_all(fd, buf, size);
+		free(buf);
+		if (err != 0)
+			break;
+	}
+
+	free(line);
+	fclose(in);
+}
+
+static int unix_socket__addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/*
+ * pahole__serve - answer queries on a UNIX socket, one client at a time
+ * @cus: the cus loaded, that stay loaded, see pahole__query
+ * @path: the socket, replaced if it is there from a previous run
+ *
+ * Only returns on errors.
+ */
+static int pahole__serve(struct cus *cus, const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd, err = unix_socket__addr(&addr, path);
+
+	if (err != 0)
+		return err;
+
+	/* Some other file, not a socket, is left alone */
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, SOMAXCONN) != 0) {
+		err = -errno;
+		goto out;
+	}
+
+	for (;;) {
+		const int client = accept(fd, NULL, NULL);
+
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err = -errno;
+			break;
+		}
+		pahole__serve_client(cus, client);
+		close(client);
+	}
+out:
+	close(fd);
+	return err;
+}
+
+/* The query for what the options ask for, NULL if --serve can't answer it */
+static const char *pahole__client_query(void)
+{
+	if (class_name == NULL)
+		return formatter == size_formatter ? "sizes" : NULL;
+	if (reorganize)
+		return "reorg";
+	if (find_containers)
+		return "containers";
+	if (find_pointers_in_structs)
+		return "pointers";
+	return "class";
+}
+
+/*
+ * pahole__client - print what a --serve pahole answers
+ * @path: the socket it is serving on
+ * @verb: what to ask, see pahole__query
+ *
+ * Asks for @verb, with the structs in class_name, and prints the answer.
+ */
+static int pahole__client(const char *path, const char *verb)
+{
+	struct sockaddr_un addr;
+	char *line = NULL, *request, bf[BUFSIZ];
+	size_t line_size = 0, size;
+	FILE *in = NULL;
+	int fd, err = unix_socket__addr(&addr, path);
+
+	if (err != 0)
+		return err;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		err = -errno;
+		goto out;
+	}
+
+	/* -C can name any number of structs, so no fixed size buffer */
+	if (asprintf(&request, "%s%s%s\n", verb, class_name ? " " : "",
+		     class_name ?: "") < 0) {
+		err = -ENOMEM;
+		goto out;
+	}
+	err = write_all(fd, request, strlen(request));
+	free(request);
+	if (err != 0)
+		goto out;
+
+	in = fdopen(fd, "r");
+	if (in == NULL) {
+		err = -errno;
+		goto out;
+	}
+	fd = -1;
+
+	err = -EPROTO;
+	if (getline(&line, &line_size, in) == -1)
+		goto out;
+	if (strncmp(line, "ERR ", 4) == 0) {
+		fprintf(stderr, "pahole: %s", line + 4);
+		err = -EINVAL;
+		goto out;
+	}
+	if (sscanf(line, "OK %zu", &size) != 1)
+		goto out;
+
+	while (size != 0) {
+		const size_t n = fread(bf, 1, size < sizeof(bf) ?
+					      size : sizeof(bf), in);
+		if (n == 0)
+			goto out;
+		fwrite(bf, 1, n, stdout);
+		size -= n;
+	}
+	err = 0;
+out:
+	free(line);
+	if (in != NULL)
+		fclose(in);
+	if (fd >= 0)
+		close(fd);
+	return err;
+}
+
 static int add_class_name_entry(const char *s)
 {
 	if (strncmp(s, "file://", 7) == 0) {
@@ -1225,20 +3701,109 @@ int main(int argc, char *argv[])
 	int err, remaining, rc = EXIT_FAILURE;
 
 	if (argp_parse(&pahole__argp, argc, argv, 0, &remaining, NULL) ||
-	    remaining == argc) {
+	    (remaining == argc && client_socket == NULL)) {
 		argp_help(&pahole__argp, stderr, ARGP_HELP_SEE, argv[0]);
 		goto out;
 	}
 
 	class_names = strlist__new(true);
+	structures__init();
 
 	if (class_names == NULL || dwarves__init(cacheline_size)) {
 		fputs("pahole: insufficient memory\n", stderr);
 		goto out;
 	}
 
-	if (class_name && populate_class_names())
+	dwarves__fprintf_set_buffer(stdout);
+
+	if (class_name != NULL) {
+		if (populate_class_names())
+			goto out_dwarves_exit;
+		filter_classes = true;
+	}
+
+	/*
+	 * -w changes the types in place, and only when printing all the
+	 * structs, that --serve would then answer for all queries.
+	 */
+	if ((serve_socket != NULL || client_socket != NULL) && word_size != 0) {
+		fputs("pahole: -w can't be used with --serve or --client\n",
+		      stderr);
+		goto out_dwarves_exit;
+	}
+
+	if (client_socket != NULL && (defined_in || first_obj_only)) {
+		fputs("pahole: -u can't be used with --client, "
+		      "--first_obj_only goes with --serve\n", stderr);
+		goto out_dwarves_exit;
+	}
+
+	if (client_socket != NULL) {
+		const char *verb = pahole__client_query();
+
+		if (verb == NULL) {
+			fputs("pahole: --client needs -C or -s\n", stderr);
+			goto out_dwarves_exit;
+		}
+		err = pahole__client(client_socket, verb);
+		if (err != 0) {
+			if (err != -EINVAL)
+				fprintf(stderr, "pahole: %s: %s\n",
+					client_socket, strerror(-err));
+			goto out_dwarves_exit;
+		}
+		rc = EXIT_SUCCESS;
 		goto out_dwarves_exit;
+	}
+
+	if (accesses_filename != NULL) {
+		err = accesses__load(accesses_filename);
+		if (err != 0) {
+			fprintf(stderr, "pahole: couldn't load %s: %s\n",
+				accesses_filename, strerror(-err));
+			goto out_dwarves_exit;
+		}
+		/* The variable addresses are needed */
+		conf_load.get_addr_info = true;
+	}
+
+	if (c2c_filename != NULL) {
+		err = c2c__load(c2c_filename);
+		if (err != 0) {
+			fprintf(stderr, "pahole: couldn't load %s: %s\n",
+				c2c_filename, strerror(-err));
+			goto out_dwarves_exit;
+		}
+		conf_load.get_addr_info = true;
+	}
+
+	if (access_groups_filename != NULL) {
+		uint32_t i;
+
+		err = access_groups__load(access_groups_filename);
+		if (err != 0) {
+			fprintf(stderr, "pahole: couldn't load %s: %s\n",
+				access_groups_filename, strerror(-err));
+			goto out_dwarves_exit;
+		}
+		/* Just the structs in it, like with -C */
+		for (i = 0; class_name == NULL && i < nr_access_groups; ++i)
+			if (strlist__add(class_names,
+					 access_groups[i].class_name) == -ENOMEM) {
+				fputs("pahole: insufficient memory\n", stderr);
+				goto out_dwarves_exit;
+			}
+		filter_classes = true;
+	}
+
+	if (instances_filename != NULL) {
+		err = instances__load(instances_filename);
+		if (err != 0) {
+			fprintf(stderr, "pahole: couldn't load %s: %s\n",
+				instances_filename, strerror(-err));
+			goto out_dwarves_exit;
+		}
+	}
 
 	struct cus *cus = cus__new();
 	if (cus == NULL) {
@@ -1247,23 +3812,115 @@ int main(int argc, char *argv[])
 	}
 
 	conf_load.steal = pahole_stealer;
+	memset(tab, ' ', sizeof(tab) - 1);
+
+	/*
+	 * Printing all the structs can be done in parallel, the others go
+	 * looking for something or write to a file in cu order.
+	 */
+	if (nr_jobs != 1 && !filter_classes && !ctf_encode &&
+	    serve_socket == NULL &&
+	    snapshot_filename == NULL && accesses_filename == NULL &&
+	    c2c_filename == NULL &&
+	    stats_formatter != nr_methods_formatter) {
+		cu_pipeline = cu_pipeline__new(nr_jobs, pahole_format_cu,
+					       pahole_merge, cu_output__delete,
+					       NULL, 0);
+		if (cu_pipeline == NULL) {
+			fputs("pahole: insufficient memory\n", stderr);
+			goto out_cus_delete;
+		}
+		conf_load.threaded_steal = true;
+	}
+
+	if (snapshot_filename != NULL) {
+		snapshot_writer = snapshot_writer__new(snapshot_filename);
+		if (snapshot_writer == NULL) {
+			fprintf(stderr, "pahole: couldn't create %s: %s\n",
+				snapshot_filename, strerror(errno));
+			goto out_cus_delete;
+		}
+	}
 
 	err = cus__load_files(cus, &conf_load, argv + remaining);
+
+	if (cu_pipeline != NULL) {
+		int perr = cu_pipeline__delete(cu_pipeline);
+
+		if (err == 0 && perr != 0) {
+			fprintf(stderr, "pahole: %s\n", strerror(-perr));
+			goto out_cus_delete;
+		}
+	}
+
+	if (snapshot_writer != NULL) {
+		int serr = snapshot_writer__close(snapshot_writer);
+
+		if (err != 0)
+			unlink(snapshot_filename);
+		else if (serr != 0) {
+			fprintf(stderr, "pahole: couldn't save %s: %s\n",
+				snapshot_filename, strerror(-serr));
+			goto out_cus_delete;
+		}
+	}
+
 	if (err != 0) {
 		fputs("pahole: No debugging information found\n", stderr);
 		goto out_cus_delete;
 	}
 
+	if (serve_socket != NULL) {
+		err = pahole__serve(cus, serve_socket);
+		fprintf(stderr, "pahole: couldn't serve on %s: %s\n",
+			serve_socket, strerror(-err));
+		goto out_cus_delete;
+	}
+
 	if (stats_formatter != NULL)
 		print_stats();
+	if (dedup_layouts)
+		print_layouts();
+	if (c2c_filename != NULL) {
+		if (print_false_sharing(cus) != 0) {
+			fputs("pahole: insufficient memory for the "
+			      "--c2c report\n", stderr);
+			goto out_cus_delete;
+		}
+	} else if (accesses_filename != NULL) {
+		if (print_accesses(cus) != 0) {
+			fputs("pahole: insufficient memory for the "
+			      "--accesses report\n", stderr);
+			goto out_cus_delete;
+		}
+	} else if (instances_filename != NULL) {
+		if (print_instances_report() != 0) {
+			fputs("pahole: insufficient memory for the "
+			      "--instances report\n", stderr);
+			goto out_cus_delete;
+		}
+	} else if (reorg_benchmark && !filter_classes) {
+		print_reorg_benchmark();
+	} else if (reorganize && !filter_classes &&
+		   print_reorg_report() != 0) {
+		fputs("pahole: insufficient memory for the -R report\n",
+		      stderr);
+		goto out_cus_delete;
+	}
 	rc = EXIT_SUCCESS;
 out_cus_delete:
 #ifdef DEBUG_CHECK_LEAKS
 	cus__delete(cus);
 	structures__delete();
+	class_index__delete();
 #endif
 out_dwarves_exit:
 #ifdef DEBUG_CHECK_LEAKS
+	instances__delete();
+	access_counts__delete();
+	access_groups__delete();
+	free(access_samples);
+	free(heap_samples);
 	dwarves__exit();
 #endif
 out:
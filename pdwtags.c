@@ -136,6 +136,8 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	dwarves__fprintf_set_buffer(stdout);
+
 	if (argp_parse(&pdwtags__argp, argc, argv, 0, &remaining, NULL) ||
 	    remaining == argc) {
                 argp_help(&pdwtags__argp, stderr, ARGP_HELP_SEE, argv[0]);
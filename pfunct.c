@@ -279,10 +279,20 @@ static bool function__filter(struct function *function, struct cu *cu)
 	return false;
 }
 
-static int cu_unique_iterator(struct cu *cu, void *cookie __unused)
+static int cu_unique_iterator(struct cu *cu, void *cookie __unused,
+			      FILE *fp __unused, void **priv __unused)
 {
 	cu__account_inline_expansions(cu);
+	return 0;
+}
 
+/*
+ * The fn_stats list is shared by all cus, so this is done in cu order, after
+ * cu_unique_iterator.
+ */
+static int cu_unique_merge(struct cu *cu, void *cookie __unused,
+			   void *priv __unused)
+{
 	struct function *pos;
 	uint32_t id;
 
@@ -292,7 +302,8 @@ static int cu_unique_iterator(struct cu *cu, void *cookie __unused)
 	return 0;
 }
 
-static int cu_class_iterator(struct cu *cu, void *cookie)
+static int cu_class_iterator(struct cu *cu, void *cookie, FILE *fp,
+			     void **priv __unused)
 {
 	uint16_t target_id;
 	struct tag *target = cu__find_struct_by_name(cu, cookie, 0, &target_id);
@@ -300,19 +311,19 @@ static int cu_class_iterator(struct cu *cu, void *cookie)
 	if (target == NULL)
 		return 0;
 
-	struct function *pos;
-	uint32_t id;
+	struct method_ref *method, *end;
+
+	cu__for_each_method(cu, target_id, method, end) {
+		struct function *pos = method->function;
 
-	cu__for_each_function(cu, id, pos) {
-		if (pos->inlined ||
-		    !ftype__has_parm_of_type(&pos->proto, target_id, cu))
+		if (pos->inlined)
 			continue;
 
 		if (verbose)
-			tag__fprintf(function__tag(pos), cu, &conf, stdout);
+			tag__fprintf(function__tag(pos), cu, &conf, fp);
 		else
-			fputs(function__name(pos, cu), stdout);
-		putchar('\n');
+			fputs(function__name(pos, cu), fp);
+		fputc('\n', fp);
 	}
 
 	return 0;
@@ -656,6 +667,8 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	dwarves__fprintf_set_buffer(stdout);
+
 	struct cus *cus = cus__new();
 	if (cus == NULL) {
 		fputs("pfunct: insufficient memory\n", stderr);
@@ -666,7 +679,8 @@ int main(int argc, char *argv[])
 	if (err != 0)
 		goto out_cus_delete;
 
-	cus__for_each_cu(cus, cu_unique_iterator, NULL, NULL);
+	cus__for_each_cu_parallel(cus, 0, cu_unique_iterator, cu_unique_merge,
+				  NULL, NULL, NULL);
 
 	if (addr) {
 		struct cu *cu;
@@ -681,7 +695,8 @@ int main(int argc, char *argv[])
 	} else if (show_total_inline_expansion_stats)
 		print_total_inline_stats();
 	else if (class_name != NULL)
-		cus__for_each_cu(cus, cu_class_iterator, class_name, NULL);
+		cus__for_each_cu_parallel(cus, 0, cu_class_iterator, NULL,
+					  class_name, stdout, NULL);
 	else if (function_name != NULL)
 		cus__for_each_cu(cus, cu_function_iterator,
 				 function_name, NULL);
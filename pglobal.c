@@ -84,61 +84,108 @@ static int extfun__compare(const void *a, const void *b)
 	return strcmp(ga->name, gb->name);
 }
 
-static void extvar__add(const struct variable *var, const struct cu *cu)
+static void extvar__add(struct extvar *gvar)
 {
-	struct extvar **nodep, *gvar = extvar__new(var, cu);
-
-	if (gvar != NULL) {
-		nodep = tsearch(gvar, &tree, extvar__compare);
-		if (nodep == NULL)
-			oom("tsearch");
-		else if (*nodep != gvar)
-			if (gvar->var->declaration) {
-				gvar->next = (*nodep)->next;
-				(*nodep)->next = gvar;
-			} else {
-				gvar->next = *nodep;
-				*nodep = gvar;
-			}
-	}
+	struct extvar **nodep = tsearch(gvar, &tree, extvar__compare);
+
+	if (nodep == NULL)
+		oom("tsearch");
+	else if (*nodep != gvar)
+		if (gvar->var->declaration) {
+			gvar->next = (*nodep)->next;
+			(*nodep)->next = gvar;
+		} else {
+			gvar->next = *nodep;
+			*nodep = gvar;
+		}
 }
 
-static void extfun__add(struct function *fun, const struct cu *cu)
+static void extfun__add(struct extfun *gfun)
 {
-	struct extfun **nodep, *gfun = extfun__new(fun, cu);
+	struct extfun **nodep = tsearch(gfun, &tree, extfun__compare);
 
-	if (gfun != NULL) {
-		nodep = tsearch(gfun, &tree, extfun__compare);
-		if (nodep == NULL)
-			oom("tsearch");
-		else if (*nodep != gfun) {
-			gfun->next = (*nodep)->next;
-			(*nodep)->next = gfun;
-		}
+	if (nodep == NULL)
+		oom("tsearch");
+	else if (*nodep != gfun) {
+		gfun->next = (*nodep)->next;
+		(*nodep)->next = gfun;
 	}
 }
 
-static int cu_extvar_iterator(struct cu *cu, void *cookie __unused)
+/*
+ * The extvar__add and extfun__add calls have to be done in cu order, so
+ * collect the entries in parallel and add them to the tree in the merge
+ * callbacks.
+ */
+static int cu_extvar_iterator(struct cu *cu, void *cookie __unused,
+			      FILE *fp __unused, void **priv)
 {
+	struct extvar *vars = NULL, **last = &vars;
 	struct tag *pos;
 	uint32_t id;
 
 	cu__for_each_variable(cu, id, pos) {
 		struct variable *var = tag__variable(pos);
-		if (var->external)
-			extvar__add(var, cu);
+		if (var->external) {
+			struct extvar *gvar = extvar__new(var, cu);
+
+			if (gvar == NULL)
+				oom("extvar__new");
+			*last = gvar;
+			last = &gvar->next;
+		}
 	}
+	*priv = vars;
 	return 0;
 }
 
-static int cu_extfun_iterator(struct cu *cu, void *cookie __unused)
+static int cu_extvar_merge(struct cu *cu __unused, void *cookie __unused,
+			   void *priv)
 {
+	struct extvar *pos = priv;
+
+	while (pos != NULL) {
+		struct extvar *next = pos->next;
+
+		pos->next = NULL;
+		extvar__add(pos);
+		pos = next;
+	}
+	return 0;
+}
+
+static int cu_extfun_iterator(struct cu *cu, void *cookie __unused,
+			      FILE *fp __unused, void **priv)
+{
+	struct extfun *funs = NULL, **last = &funs;
 	struct function *pos;
 	uint32_t id;
 
 	cu__for_each_function(cu, id, pos)
-		if (pos->external)
-			extfun__add(pos, cu);
+		if (pos->external) {
+			struct extfun *gfun = extfun__new(pos, cu);
+
+			if (gfun == NULL)
+				oom("extfun__new");
+			*last = gfun;
+			last = &gfun->next;
+		}
+	*priv = funs;
+	return 0;
+}
+
+static int cu_extfun_merge(struct cu *cu __unused, void *cookie __unused,
+			   void *priv)
+{
+	struct extfun *pos = priv;
+
+	while (pos != NULL) {
+		struct extfun *next = pos->next;
+
+		pos->next = NULL;
+		extfun__add(pos);
+		pos = next;
+	}
 	return 0;
 }
 
@@ -295,6 +342,8 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	dwarves__fprintf_set_buffer(stdout);
+
 	struct cus *cus = cus__new();
 	if (cus == NULL) {
 		fputs("pglobal: insufficient memory\n", stderr);
@@ -306,10 +355,12 @@ int main(int argc, char *argv[])
 		goto out_cus_delete;
 
 	if (walk_var) {
-		cus__for_each_cu(cus, cu_extvar_iterator, NULL, NULL);
+		cus__for_each_cu_parallel(cus, 0, cu_extvar_iterator,
+					  cu_extvar_merge, NULL, NULL, NULL);
 		twalk(tree, declaration_action__walk);
 	} else if (walk_fun) {
-		cus__for_each_cu(cus, cu_extfun_iterator, NULL, NULL);
+		cus__for_each_cu_parallel(cus, 0, cu_extfun_iterator,
+					  cu_extfun_merge, NULL, NULL, NULL);
 		twalk(tree, function_action__walk);
 	}
 
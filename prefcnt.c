@@ -107,7 +107,8 @@ static void refcnt_function(struct function *function, const struct cu *cu)
 	refcnt_lexblock(&function->lexblock, cu);
 }
 
-static int cu_refcnt_iterator(struct cu *cu, void *cookie __unused)
+static int cu_refcnt_iterator(struct cu *cu, void *cookie __unused,
+			      FILE *fp __unused, void **priv __unused)
 {
 	struct function *pos;
 	uint32_t id;
@@ -117,19 +118,19 @@ static int cu_refcnt_iterator(struct cu *cu, void *cookie __unused)
 	return 0;
 }
 
-static int lost_iterator(struct tag *tag, struct cu *cu,
-			 void *cookie __unused)
+static int lost_iterator(struct tag *tag, struct cu *cu, void *fp)
 {
 	if (!tag->visited && tag__decl_file(tag, cu)) {
-		tag__fprintf(tag, cu, NULL, stdout);
-		puts(";\n");
+		tag__fprintf(tag, cu, NULL, fp);
+		fputs(";\n\n", fp);
 	}
 	return 0;
 }
 
-static int cu_lost_iterator(struct cu *cu, void *cookie)
+static int cu_lost_iterator(struct cu *cu, void *cookie __unused, FILE *fp,
+			    void **priv __unused)
 {
-	return cu__for_all_tags(cu, lost_iterator, cookie);
+	return cu__for_all_tags(cu, lost_iterator, fp);
 }
 
 int main(int argc __unused, char *argv[])
@@ -146,8 +147,10 @@ int main(int argc __unused, char *argv[])
 	if (err != 0)
 		return EXIT_FAILURE;
 
-	cus__for_each_cu(cus, cu_refcnt_iterator, NULL, NULL);
-	cus__for_each_cu(cus, cu_lost_iterator, NULL, NULL);
+	cus__for_each_cu_parallel(cus, 0, cu_refcnt_iterator, NULL,
+				  NULL, NULL, NULL);
+	cus__for_each_cu_parallel(cus, 0, cu_lost_iterator, NULL,
+				  NULL, stdout, NULL);
 
 	return EXIT_SUCCESS;
 }
@@ -100,6 +100,7 @@ rm -rf %{buildroot}
 %files -n %{libname}%{libver}-devel
 %defattr(0644,root,root,0755)
 %doc MANIFEST README
+%{_includedir}/dwarves/arena.h
 %{_includedir}/dwarves/dwarves.h
 %{_includedir}/dwarves/dwarves_emit.h
 %{_includedir}/dwarves/dwarves_reorganize.h
@@ -107,6 +108,7 @@ rm -rf %{buildroot}
 %{_includedir}/dwarves/gobuffer.h
 %{_includedir}/dwarves/list.h
 %{_includedir}/dwarves/rbtree.h
+%{_includedir}/dwarves/snapshot.h
 %{_includedir}/dwarves/strings.h
 %{_libdir}/%{libname}.so
 %{_libdir}/%{libname}_emit.so
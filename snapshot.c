@@ -0,0 +1,1870 @@
+/*
+  Copyright (C) 2026 agent <agent@local>
+
+  Binary snapshot of the core representation of the cus
+
+  Most of what a tool run costs is decoding the debugging information, a
+  snapshot has the tags as the loaders left them, with the ids they have in
+  the cu tables and the lists they are in, so that loading it is a single
+  linear pass creating the tags in the cu obstack, with the strings and,
+  for extra_dbg_info, the decl info, used straight from the mmaped file.
+
+  All in host byte order, a snapshot is only valid in the kind of machine
+  that wrote it:
+
+	struct snapshot_header
+	for each cu:
+		struct snapshot_cu
+		records: a struct snapshot_record, the body for its tag, if
+			 any, then the records for its children, the cu->tags
+			 ones first, then the tags only found in the tables
+		padding to 8 bytes
+		struct snapshot_decl[nr_decls]
+	strings, the strings_t in the records and decls are offsets here
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of version 2 of the GNU General Public License as
+  published by the Free Software Foundation.
+*/
+
+#include <dwarf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <obstack.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dwarves.h"
+#include "dutil.h"
+#include "hash.h"
+#include "snapshot.h"
+
+#define obstack_chunk_alloc malloc
+#define obstack_chunk_free free
+
+#define SNAPSHOT__MAGIC		"DWVSNAP"
+#define SNAPSHOT__VERSION	1
+#define SNAPSHOT__BYTE_ORDER	0x01020304
+#define SNAPSHOT__BUILD_ID_MAX	64
+#define SNAPSHOT__NO_DECL	UINT32_MAX
+#define SNAPSHOT__MAX_DEPTH	1024
+
+struct snapshot_header {
+	char	 magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t nr_cus;
+	uint32_t strings_size;
+	uint64_t strings_offset;
+};
+
+enum snapshot_cu_flags {
+	SNAPSHOT_CU__HAS_ADDR_INFO = 1 << 0,
+};
+
+/*
+ * @size: of the whole cu, header, records and decls, to get to the next one
+ * @nr_types, @nr_tags, @nr_functions: entries in the cu tables
+ * @nr_listed: top level records for the tags in cu->tags
+ * @nr_unlisted: top level records for the tags only in the cu tables
+ */
+struct snapshot_cu {
+	uint64_t  size;
+	strings_t name;
+	strings_t filename;
+	uint32_t  nr_types;
+	uint32_t  nr_tags;
+	uint32_t  nr_functions;
+	uint32_t  nr_listed;
+	uint32_t  nr_unlisted;
+	uint32_t  records_size;
+	uint32_t  nr_decls;
+	uint16_t  language;
+	uint8_t	  addr_size;
+	uint8_t	  flags;
+	uint8_t	  build_id_len;
+	uint8_t	  padding[7];
+	uint8_t	  build_id[SNAPSHOT__BUILD_ID_MAX];
+};
+
+/* What tag__priv points to in the cus loaded with extra_dbg_info */
+struct snapshot_decl {
+	strings_t decl_file;
+	uint32_t  decl_line;
+	uint64_t  orig_id;
+};
+
+enum snapshot_table {
+	SNAPSHOT_TABLE__NONE,
+	SNAPSHOT_TABLE__TYPES,
+	SNAPSHOT_TABLE__TAGS,
+	SNAPSHOT_TABLE__FUNCTIONS,
+	SNAPSHOT_TABLE__NR,
+};
+
+enum snapshot_record_flags {
+	SNAPSHOT_RECORD__TOP_LEVEL = 1 << 0,
+};
+
+/*
+ * @table: enum snapshot_table, the cu table @id is in, if any
+ * @decl: index in the cu decls, SNAPSHOT__NO_DECL if none
+ */
+struct snapshot_record {
+	uint16_t tag;
+	uint16_t type;
+	uint8_t	 flags;
+	uint8_t	 table;
+	uint16_t padding;
+	uint32_t id;
+	uint32_t decl;
+	uint32_t nr_children;
+};
+
+struct snapshot_base_type {
+	strings_t name;
+	uint16_t  bit_size;
+	uint8_t	  is_signed;
+	uint8_t	  is_bool;
+	uint8_t	  is_varargs;
+	uint8_t	  float_type;
+	uint16_t  padding;
+};
+
+/* Followed by uint32_t nr_entries[dimensions] */
+struct snapshot_array_type {
+	uint8_t	 dimensions;
+	uint8_t	 is_vector;
+	uint16_t padding;
+};
+
+struct snapshot_ptr_to_member_type {
+	uint16_t containing_type;
+	uint16_t padding;
+};
+
+/* For all the struct namespace tags, @size and @declaration for types */
+struct snapshot_namespace {
+	strings_t name;
+	uint32_t  size;
+	uint8_t	  declaration;
+	uint8_t	  padding[3];
+};
+
+struct snapshot_class_member {
+	uint64_t  byte_size;
+	strings_t name;
+	uint32_t  bit_offset;
+	uint32_t  bit_size;
+	uint32_t  byte_offset;
+	uint8_t	  bitfield_offset;
+	uint8_t	  bitfield_size;
+	uint8_t	  accessibility;
+	uint8_t	  virtuality;
+	uint32_t  padding;
+};
+
+struct snapshot_enumerator {
+	strings_t name;
+	uint32_t  value;
+};
+
+struct snapshot_ftype {
+	uint8_t unspec_parms;
+	uint8_t padding[3];
+};
+
+struct snapshot_parameter {
+	strings_t name;
+};
+
+/* The first @nr_parms children are the parameters, then the lexblock tags */
+struct snapshot_function {
+	uint64_t  addr;
+	uint32_t  size;
+	strings_t name;
+	strings_t linkage_name;
+	int32_t	  vtable_entry;
+	uint16_t  nr_parms;
+	uint8_t	  inlined;
+	uint8_t	  abstract_origin;
+	uint8_t	  external;
+	uint8_t	  accessibility;
+	uint8_t	  virtuality;
+	uint8_t	  unspec_parms;
+};
+
+struct snapshot_lexblock {
+	uint64_t addr;
+	uint32_t size;
+	uint32_t padding;
+};
+
+struct snapshot_variable {
+	uint64_t  addr;
+	strings_t name;
+	uint8_t	  external;
+	uint8_t	  declaration;
+	uint8_t	  location;
+	uint8_t	  padding;
+};
+
+struct snapshot_label {
+	uint64_t  addr;
+	strings_t name;
+	uint32_t  padding;
+};
+
+struct snapshot_inline_expansion {
+	uint64_t addr;
+	uint64_t high_pc;
+	uint64_t size;
+};
+
+static const char snapshot__zeroes[8];
+
+static enum snapshot_table tag__snapshot_table(const struct tag *self)
+{
+	if (tag__is_tag_type(self))
+		return SNAPSHOT_TABLE__TYPES;
+	if (tag__is_function(self))
+		return SNAPSHOT_TABLE__FUNCTIONS;
+	return SNAPSHOT_TABLE__TAGS;
+}
+
+/*
+ * The tags in the lists of @self, in the order the loader has to add
+ * them back, see snapshot_load__add_child.
+ */
+static int tag__snapshot_for_each_child(struct tag *self,
+					int (*iterator)(struct tag *child,
+							void *cookie),
+					void *cookie)
+{
+	struct parameter *parm;
+	struct lexblock *block;
+	struct tag *pos;
+	int err;
+
+	switch (self->tag) {
+	case DW_TAG_enumeration_type: {
+		struct enumerator *enumerator;
+
+		type__for_each_enumerator(tag__type(self), enumerator) {
+			err = iterator(&enumerator->tag, cookie);
+			if (err != 0)
+				return err;
+		}
+		return 0;
+	}
+	case DW_TAG_class_type:
+	case DW_TAG_interface_type:
+	case DW_TAG_namespace:
+	case DW_TAG_structure_type:
+	case DW_TAG_union_type:
+		namespace__for_each_tag(tag__namespace(self), pos) {
+			err = iterator(pos, cookie);
+			if (err != 0)
+				return err;
+		}
+		return 0;
+	case DW_TAG_subroutine_type:
+		ftype__for_each_parameter(tag__ftype(self), parm) {
+			err = iterator(&parm->tag, cookie);
+			if (err != 0)
+				return err;
+		}
+		return 0;
+	case DW_TAG_subprogram:
+		ftype__for_each_parameter(&tag__function(self)->proto, parm) {
+			err = iterator(&parm->tag, cookie);
+			if (err != 0)
+				return err;
+		}
+		block = &tag__function(self)->lexblock;
+		break;
+	case DW_TAG_lexical_block:
+		block = tag__lexblock(self);
+		break;
+	default:
+		return 0;
+	}
+
+	list_for_each_entry(pos, &block->tags, node) {
+		err = iterator(pos, cookie);
+		if (err != 0)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Where a tag is in the tables of the cu being written, @emitted is set
+ * when its record is written, @child when it is in the lists of a tag
+ * that is not in cu->tags, see snapshot_writer__write_unlisted.
+ */
+struct snapshot_ref {
+	const struct tag *tag;
+	uint32_t	 id;
+	uint8_t		 table;
+	uint8_t		 emitted:1;
+	uint8_t		 child:1;
+};
+
+struct snapshot_writer {
+	FILE		     *fp;
+	char		     *filename;
+	struct strings	     *strings;
+	struct snapshot_ref  *refs;
+	uint32_t	     nr_ref_bits;
+	uint32_t	     allocated_refs;
+	struct snapshot_decl *decls;
+	uint32_t	     nr_decls;
+	uint32_t	     allocated_decls;
+	uint32_t	     nr_cus;
+	int		     err;
+};
+
+static int snapshot_writer__write(struct snapshot_writer *self,
+				  const void *data, size_t size)
+{
+	if (size != 0 && fwrite(data, size, 1, self->fp) != 1)
+		return -EIO;
+	return 0;
+}
+
+static int snapshot_writer__align(struct snapshot_writer *self)
+{
+	const off_t offset = ftello(self->fp);
+
+	if (offset < 0)
+		return -EIO;
+
+	return snapshot_writer__write(self, snapshot__zeroes,
+				      (8 - (offset & 7)) & 7);
+}
+
+static int snapshot_writer__string(struct snapshot_writer *self,
+				   const char *s, strings_t *index)
+{
+	*index = strings__add(self->strings, s);
+	return s != NULL && *index == 0 ? -ENOMEM : 0;
+}
+
+static struct snapshot_ref *snapshot_writer__ref_slot(const struct snapshot_writer *self,
+						      const struct tag *tag)
+{
+	const uint32_t mask = (1U << self->nr_ref_bits) - 1;
+	uint32_t i = hash_ptr((void *)tag, self->nr_ref_bits);
+
+	while (self->refs[i].tag != NULL && self->refs[i].tag != tag)
+		i = (i + 1) & mask;
+
+	return &self->refs[i];
+}
+
+static struct snapshot_ref *snapshot_writer__find_ref(const struct snapshot_writer *self,
+						      const struct tag *tag)
+{
+	struct snapshot_ref *ref = snapshot_writer__ref_slot(self, tag);
+
+	return ref->tag != NULL ? ref : NULL;
+}
+
+static const struct ptr_table *cu__snapshot_table(const struct cu *self,
+						  enum snapshot_table table)
+{
+	switch (table) {
+	case SNAPSHOT_TABLE__TYPES:	return &self->types_table;
+	case SNAPSHOT_TABLE__TAGS:	return &self->tags_table;
+	case SNAPSHOT_TABLE__FUNCTIONS: return &self->functions_table;
+	default:			return NULL;
+	}
+}
+
+/*
+ * Maps the tags in the @cu tables to their ids, at most half full. Only
+ * the types table can have holes, as the loaders add NULL entries there
+ * for the types they don't support.
+ */
+static int snapshot_writer__build_refs(struct snapshot_writer *self,
+				       const struct cu *cu)
+{
+	const uint32_t nr_entries = cu->types_table.nr_entries +
+				    cu->tags_table.nr_entries +
+				    cu->functions_table.nr_entries;
+	uint32_t bits = 4, table, id;
+
+	while ((1U << bits) < 2 * nr_entries)
+		++bits;
+
+	if ((1U << bits) > self->allocated_refs) {
+		struct snapshot_ref *refs = realloc(self->refs,
+						    sizeof(*refs) << bits);
+		if (refs == NULL)
+			return -ENOMEM;
+		self->refs = refs;
+		self->allocated_refs = 1U << bits;
+	}
+
+	self->nr_ref_bits = bits;
+	memset(self->refs, 0, sizeof(*self->refs) << bits);
+
+	for (table = SNAPSHOT_TABLE__TYPES; table < SNAPSHOT_TABLE__NR; ++table) {
+		const struct ptr_table *pt = cu__snapshot_table(cu, table);
+
+		for (id = 0; id < pt->nr_entries; ++id) {
+			const struct tag *tag = pt->entries[id];
+			struct snapshot_ref *ref;
+
+			if (tag == NULL) {
+				if (table != SNAPSHOT_TABLE__TYPES)
+					return -EINVAL;
+				continue;
+			}
+
+			ref = snapshot_writer__ref_slot(self, tag);
+			if (ref->tag != NULL)
+				return -EINVAL;
+
+			ref->tag   = tag;
+			ref->id	   = id;
+			ref->table = table;
+		}
+	}
+
+	return 0;
+}
+
+static int snapshot_writer__add_decl(struct snapshot_writer *self,
+				     const struct cu *cu,
+				     const struct tag *tag, uint32_t *decl)
+{
+	struct snapshot_decl *entry;
+	int err;
+
+	*decl = SNAPSHOT__NO_DECL;
+	if (!cu->extra_dbg_info || tag__priv(tag, cu) == NULL)
+		return 0;
+
+	if (self->nr_decls == self->allocated_decls) {
+		const uint32_t allocated = self->allocated_decls ?: 1024;
+		struct snapshot_decl *decls;
+
+		if (allocated > UINT32_MAX / 2)
+			return -E2BIG;
+
+		decls = realloc(self->decls, sizeof(*decls) * 2 * allocated);
+		if (decls == NULL)
+			return -ENOMEM;
+
+		self->decls = decls;
+		self->allocated_decls = 2 * allocated;
+	}
+
+	entry = &self->decls[self->nr_decls];
+	err = snapshot_writer__string(self, tag__decl_file(tag, cu),
+				      &entry->decl_file);
+	if (err != 0)
+		return err;
+
+	entry->decl_line = tag__decl_line(tag, cu);
+	entry->orig_id	 = tag__orig_id(tag, cu);
+	*decl = self->nr_decls++;
+	return 0;
+}
+
+static int snapshot_writer__write_body(struct snapshot_writer *self,
+				       struct cu *cu, struct tag *tag)
+{
+	int err;
+
+	switch (tag->tag) {
+	case DW_TAG_base_type: {
+		struct base_type *bt = tag__base_type(tag);
+		struct snapshot_base_type body;
+
+		memset(&body, 0, sizeof(body));
+		err = snapshot_writer__string(self, cu__string(cu, bt->name),
+					      &body.name);
+		if (err != 0)
+			return err;
+		body.bit_size = bt->bit_size;
+		/* Otherwise the name already has the encoding */
+		if (!bt->name_has_encoding) {
+			body.is_signed	= bt->is_signed;
+			body.is_bool	= bt->is_bool;
+			body.is_varargs = bt->is_varargs;
+			body.float_type = bt->float_type;
+		}
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_array_type: {
+		struct array_type *at = tag__array_type(tag);
+		struct snapshot_array_type body;
+
+		memset(&body, 0, sizeof(body));
+		body.dimensions = at->dimensions;
+		body.is_vector	= at->is_vector;
+		err = snapshot_writer__write(self, &body, sizeof(body));
+		if (err != 0)
+			return err;
+		return snapshot_writer__write(self, at->nr_entries,
+					      at->dimensions * sizeof(uint32_t));
+	}
+	case DW_TAG_ptr_to_member_type: {
+		struct snapshot_ptr_to_member_type body;
+
+		memset(&body, 0, sizeof(body));
+		body.containing_type = tag__ptr_to_member_type(tag)->containing_type;
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_class_type:
+	case DW_TAG_enumeration_type:
+	case DW_TAG_interface_type:
+	case DW_TAG_namespace:
+	case DW_TAG_structure_type:
+	case DW_TAG_typedef:
+	case DW_TAG_union_type: {
+		struct snapshot_namespace body;
+
+		memset(&body, 0, sizeof(body));
+		err = snapshot_writer__string(self,
+					namespace__name(tag__namespace(tag), cu),
+					&body.name);
+		if (err != 0)
+			return err;
+		if (tag->tag != DW_TAG_namespace) {
+			body.size	 = tag__type(tag)->size;
+			body.declaration = tag__type(tag)->declaration;
+		}
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_inheritance:
+	case DW_TAG_member: {
+		struct class_member *member = tag__class_member(tag);
+		struct snapshot_class_member body;
+
+		memset(&body, 0, sizeof(body));
+		err = snapshot_writer__string(self,
+					      class_member__name(member, cu),
+					      &body.name);
+		if (err != 0)
+			return err;
+		body.byte_size	     = member->byte_size;
+		body.bit_offset	     = member->bit_offset;
+		body.bit_size	     = member->bit_size;
+		body.byte_offset     = member->byte_offset;
+		body.bitfield_offset = member->bitfield_offset;
+		body.bitfield_size   = member->bitfield_size;
+		body.accessibility   = member->accessibility;
+		body.virtuality	     = member->virtuality;
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_enumerator: {
+		struct enumerator *enumerator = (struct enumerator *)tag;
+		struct snapshot_enumerator body;
+
+		err = snapshot_writer__string(self,
+					      enumerator__name(enumerator, cu),
+					      &body.name);
+		if (err != 0)
+			return err;
+		body.value = enumerator->value;
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_subroutine_type: {
+		struct snapshot_ftype body;
+
+		memset(&body, 0, sizeof(body));
+		body.unspec_parms = tag__ftype(tag)->unspec_parms;
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_formal_parameter: {
+		struct snapshot_parameter body;
+
+		err = snapshot_writer__string(self,
+				parameter__name(tag__parameter(tag), cu),
+				&body.name);
+		if (err != 0)
+			return err;
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_subprogram: {
+		struct function *function = tag__function(tag);
+		struct snapshot_function body;
+		struct parameter *parm;
+
+		memset(&body, 0, sizeof(body));
+		err = snapshot_writer__string(self,
+					      function__name(function, cu),
+					      &body.name);
+		if (err == 0)
+			err = snapshot_writer__string(self,
+					function__linkage_name(function, cu),
+					&body.linkage_name);
+		if (err != 0)
+			return err;
+		body.addr	     = function->lexblock.ip.addr;
+		body.size	     = function->lexblock.size;
+		body.vtable_entry    = function->vtable_entry;
+		body.inlined	     = function->inlined;
+		body.abstract_origin = function->abstract_origin;
+		body.external	     = function->external;
+		body.accessibility   = function->accessibility;
+		body.virtuality	     = function->virtuality;
+		body.unspec_parms    = function->proto.unspec_parms;
+		function__for_each_parameter(function, parm)
+			++body.nr_parms;
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_lexical_block: {
+		struct lexblock *block = tag__lexblock(tag);
+		struct snapshot_lexblock body;
+
+		memset(&body, 0, sizeof(body));
+		body.addr = block->ip.addr;
+		body.size = block->size;
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_variable: {
+		struct variable *var = tag__variable(tag);
+		struct snapshot_variable body;
+
+		memset(&body, 0, sizeof(body));
+		err = snapshot_writer__string(self, variable__name(var, cu),
+					      &body.name);
+		if (err != 0)
+			return err;
+		body.addr	 = var->ip.addr;
+		body.external	 = var->external;
+		body.declaration = var->declaration;
+		body.location	 = var->location;
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_label: {
+		struct label *label = tag__label(tag);
+		struct snapshot_label body;
+
+		memset(&body, 0, sizeof(body));
+		err = snapshot_writer__string(self, label__name(label, cu),
+					      &body.name);
+		if (err != 0)
+			return err;
+		body.addr = label->ip.addr;
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	case DW_TAG_inlined_subroutine: {
+		struct inline_expansion *exp = tag__inline_expansion(tag);
+		struct snapshot_inline_expansion body = {
+			.addr	 = exp->ip.addr,
+			.high_pc = exp->high_pc,
+			.size	 = exp->size,
+		};
+
+		return snapshot_writer__write(self, &body, sizeof(body));
+	}
+	}
+
+	/* pointers, const, volatile, etc, just the record */
+	return 0;
+}
+
+struct snapshot_writer_walk {
+	struct snapshot_writer *writer;
+	struct cu	       *cu;
+	uint32_t	       nr_children;
+	int		       depth;
+};
+
+static int snapshot_writer__count_child(struct tag *child __unused,
+					void *cookie)
+{
+	struct snapshot_writer_walk *walk = cookie;
+
+	++walk->nr_children;
+	return 0;
+}
+
+static int snapshot_writer__write_tag(struct snapshot_writer *self,
+				      struct cu *cu, struct tag *tag,
+				      int depth);
+
+static int snapshot_writer__write_child(struct tag *child, void *cookie)
+{
+	struct snapshot_writer_walk *walk = cookie;
+
+	return snapshot_writer__write_tag(walk->writer, walk->cu, child,
+					  walk->depth + 1);
+}
+
+static int snapshot_writer__write_tag(struct snapshot_writer *self,
+				      struct cu *cu, struct tag *tag,
+				      int depth)
+{
+	struct snapshot_ref *ref = snapshot_writer__find_ref(self, tag);
+	struct snapshot_writer_walk walk = {
+		.writer = self,
+		.cu	= cu,
+		.depth	= depth,
+	};
+	struct snapshot_record record;
+	int err;
+
+	if (depth > SNAPSHOT__MAX_DEPTH)
+		return -ELOOP;
+
+	memset(&record, 0, sizeof(record));
+	record.tag   = tag->tag;
+	record.type  = tag->type;
+	record.flags = tag->top_level ? SNAPSHOT_RECORD__TOP_LEVEL : 0;
+	record.table = SNAPSHOT_TABLE__NONE;
+
+	if (ref != NULL) {
+		/* In more than one list? */
+		if (ref->emitted)
+			return -EINVAL;
+		ref->emitted = 1;
+		record.table = ref->table;
+		record.id    = ref->id;
+	}
+
+	err = snapshot_writer__add_decl(self, cu, tag, &record.decl);
+	if (err != 0)
+		return err;
+
+	tag__snapshot_for_each_child(tag, snapshot_writer__count_child, &walk);
+	record.nr_children = walk.nr_children;
+
+	err = snapshot_writer__write(self, &record, sizeof(record));
+	if (err == 0)
+		err = snapshot_writer__write_body(self, cu, tag);
+	if (err == 0)
+		err = tag__snapshot_for_each_child(tag,
+						   snapshot_writer__write_child,
+						   &walk);
+	return err;
+}
+
+static int snapshot_writer__mark_child(struct tag *child, void *cookie)
+{
+	struct snapshot_writer_walk *walk = cookie;
+	struct snapshot_ref *ref = snapshot_writer__find_ref(walk->writer,
+							     child);
+	if (ref != NULL)
+		ref->child = 1;
+
+	return tag__snapshot_for_each_child(child, snapshot_writer__mark_child,
+					    cookie);
+}
+
+/*
+ * Tags that are in the cu tables but not in cu->tags, nor in the lists
+ * of the tags in it, such as the inline expansions inside other inline
+ * expansions. Written as top level records, but only the ones that are
+ * not in the lists of another such tag, that will write them as its
+ * children.
+ */
+static int snapshot_writer__write_unlisted(struct snapshot_writer *self,
+					   struct cu *cu,
+					   uint32_t *nr_unlisted)
+{
+	struct snapshot_writer_walk walk = {
+		.writer = self,
+		.cu	= cu,
+	};
+	uint32_t table, id;
+	int err;
+
+	for (table = SNAPSHOT_TABLE__TYPES; table < SNAPSHOT_TABLE__NR; ++table) {
+		const struct ptr_table *pt = cu__snapshot_table(cu, table);
+
+		for (id = 0; id < pt->nr_entries; ++id) {
+			struct tag *tag = pt->entries[id];
+
+			if (tag != NULL &&
+			    !snapshot_writer__find_ref(self, tag)->emitted)
+				tag__snapshot_for_each_child(tag,
+						snapshot_writer__mark_child,
+						&walk);
+		}
+	}
+
+	*nr_unlisted = 0;
+	for (table = SNAPSHOT_TABLE__TYPES; table < SNAPSHOT_TABLE__NR; ++table) {
+		const struct ptr_table *pt = cu__snapshot_table(cu, table);
+
+		for (id = 0; id < pt->nr_entries; ++id) {
+			struct tag *tag = pt->entries[id];
+			struct snapshot_ref *ref;
+
+			if (tag == NULL)
+				continue;
+
+			ref = snapshot_writer__find_ref(self, tag);
+			if (ref->emitted || ref->child)
+				continue;
+
+			err = snapshot_writer__write_tag(self, cu, tag, 0);
+			if (err != 0)
+				return err;
+			++*nr_unlisted;
+		}
+	}
+
+	/* Only possible if there are loops in the lists */
+	for (table = SNAPSHOT_TABLE__TYPES; table < SNAPSHOT_TABLE__NR; ++table) {
+		const struct ptr_table *pt = cu__snapshot_table(cu, table);
+
+		for (id = 0; id < pt->nr_entries; ++id)
+			if (pt->entries[id] != NULL &&
+			    !snapshot_writer__find_ref(self,
+						       pt->entries[id])->emitted)
+				return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int __snapshot_writer__add_cu(struct snapshot_writer *self,
+				     struct cu *cu)
+{
+	struct snapshot_cu header;
+	off_t start, records_start, end;
+	struct tag *pos;
+	int err;
+
+	memset(&header, 0, sizeof(header));
+
+	err = snapshot_writer__build_refs(self, cu);
+	if (err == 0)
+		err = snapshot_writer__string(self, cu->name, &header.name);
+	if (err == 0)
+		err = snapshot_writer__string(self, cu->filename,
+					      &header.filename);
+	if (err != 0)
+		return err;
+
+	header.nr_types	    = cu->types_table.nr_entries;
+	header.nr_tags	    = cu->tags_table.nr_entries;
+	header.nr_functions = cu->functions_table.nr_entries;
+	header.language	    = cu->language;
+	header.addr_size    = cu->addr_size;
+	if (cu->has_addr_info)
+		header.flags |= SNAPSHOT_CU__HAS_ADDR_INFO;
+	if (cu->build_id_len > 0 &&
+	    cu->build_id_len <= SNAPSHOT__BUILD_ID_MAX) {
+		header.build_id_len = cu->build_id_len;
+		memcpy(header.build_id, cu->build_id, cu->build_id_len);
+	}
+
+	self->nr_decls = 0;
+
+	start = ftello(self->fp);
+	if (start < 0)
+		return -EIO;
+
+	/* Filled in when we know the sizes */
+	err = snapshot_writer__write(self, &header, sizeof(header));
+	if (err != 0)
+		return err;
+
+	records_start = start + sizeof(header);
+
+	list_for_each_entry(pos, &cu->tags, node) {
+		err = snapshot_writer__write_tag(self, cu, pos, 0);
+		if (err != 0)
+			return err;
+		++header.nr_listed;
+	}
+
+	err = snapshot_writer__write_unlisted(self, cu, &header.nr_unlisted);
+	if (err != 0)
+		return err;
+
+	end = ftello(self->fp);
+	if (end < 0)
+		return -EIO;
+	if (end - records_start > UINT32_MAX)
+		return -E2BIG;
+	header.records_size = end - records_start;
+	header.nr_decls	    = self->nr_decls;
+
+	err = snapshot_writer__align(self);
+	if (err == 0)
+		err = snapshot_writer__write(self, self->decls,
+					     sizeof(*self->decls) *
+					     self->nr_decls);
+	if (err != 0)
+		return err;
+
+	end = ftello(self->fp);
+	if (end < 0)
+		return -EIO;
+	header.size = end - start;
+
+	if (fseeko(self->fp, start, SEEK_SET) != 0 ||
+	    snapshot_writer__write(self, &header, sizeof(header)) != 0 ||
+	    fseeko(self->fp, end, SEEK_SET) != 0)
+		return -EIO;
+
+	++self->nr_cus;
+	return 0;
+}
+
+/**
+ * snapshot_writer__add_cu - write @cu to the snapshot
+ * @self: the snapshot being written
+ * @cu: the cu, left as is
+ *
+ * Can be called from a conf_load->steal callback, with the cu deleted
+ * right after, so that the snapshot can be written without having all
+ * the cus loaded at once.
+ *
+ * Returns 0 on success, a negative errno otherwise, in which case the
+ * snapshot is not written and all the subsequent calls fail.
+ */
+int snapshot_writer__add_cu(struct snapshot_writer *self, struct cu *cu)
+{
+	if (self->err == 0)
+		self->err = __snapshot_writer__add_cu(self, cu);
+
+	return self->err;
+}
+
+/**
+ * snapshot_writer__new - start writing a snapshot
+ * @filename: where to write it
+ *
+ * Returns NULL if @filename can't be created or there is no memory, with
+ * errno set.
+ */
+struct snapshot_writer *snapshot_writer__new(const char *filename)
+{
+	struct snapshot_writer *self = zalloc(sizeof(*self));
+	struct snapshot_header header;
+
+	if (self == NULL)
+		return NULL;
+
+	self->filename = strdup(filename);
+	self->strings  = strings__new();
+	if (self->filename == NULL || self->strings == NULL)
+		goto out_delete;
+
+	self->fp = fopen(filename, "w");
+	if (self->fp == NULL)
+		goto out_delete;
+
+	/* Filled in by snapshot_writer__close */
+	memset(&header, 0, sizeof(header));
+	if (snapshot_writer__write(self, &header, sizeof(header)) == 0)
+		return self;
+
+	fclose(self->fp);
+	unlink(filename);
+out_delete:
+	strings__delete(self->strings);
+	free(self->filename);
+	free(self);
+	return NULL;
+}
+
+static int snapshot_writer__write_strings(struct snapshot_writer *self,
+					  struct snapshot_header *header)
+{
+	const uint32_t size = strings__size(self->strings);
+	const off_t offset = ftello(self->fp);
+	int err;
+
+	if (offset < 0)
+		return -EIO;
+
+	header->strings_offset = offset;
+	header->strings_size   = size;
+
+	/* Offset 0 is NULL, the gobuffer doesn't even have it */
+	err = snapshot_writer__write(self, snapshot__zeroes, 1);
+	if (err == 0 && size > 1)
+		err = snapshot_writer__write(self,
+					     strings__entries(self->strings) + 1,
+					     size - 1);
+	return err;
+}
+
+/**
+ * snapshot_writer__close - finish writing the snapshot
+ * @self: the snapshot being written, freed
+ *
+ * Returns 0 if the snapshot was written, a negative errno otherwise, in
+ * which case the file is removed.
+ */
+int snapshot_writer__close(struct snapshot_writer *self)
+{
+	struct snapshot_header header;
+	int err = self->err;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT__MAGIC, sizeof(header.magic));
+	header.version	  = SNAPSHOT__VERSION;
+	header.byte_order = SNAPSHOT__BYTE_ORDER;
+	header.nr_cus	  = self->nr_cus;
+
+	if (err == 0)
+		err = snapshot_writer__write_strings(self, &header);
+	if (err == 0 &&
+	    (fseeko(self->fp, 0, SEEK_SET) != 0 ||
+	     snapshot_writer__write(self, &header, sizeof(header)) != 0))
+		err = -EIO;
+	if (fclose(self->fp) != 0 && err == 0)
+		err = -EIO;
+	if (err != 0)
+		unlink(self->filename);
+
+	strings__delete(self->strings);
+	free(self->decls);
+	free(self->refs);
+	free(self->filename);
+	free(self);
+	return err;
+}
+
+/**
+ * cus__save_snapshot - write all the cus in @self to a snapshot
+ * @self: the cus
+ * @filename: where to write it, see cus__load_snapshot
+ */
+int cus__save_snapshot(struct cus *self, const char *filename)
+{
+	struct snapshot_writer *writer = snapshot_writer__new(filename);
+	struct cu *pos;
+	int err = 0;
+
+	if (writer == NULL)
+		return errno ? -errno : -ENOMEM;
+
+	list_for_each_entry(pos, &self->cus, node) {
+		err = snapshot_writer__add_cu(writer, pos);
+		if (err != 0)
+			break;
+	}
+
+	return snapshot_writer__close(writer) ?: err;
+}
+
+/*
+ * The mmaped file, shared by all the cus loaded from it, that use its
+ * strings and decls till they are deleted, possibly in other threads, see
+ * cu_pipeline__new, so the references are counted atomically.
+ */
+struct snapshot {
+	void	     *map;
+	size_t	     size;
+	const char   *strings;
+	uint32_t     strings_size;
+	unsigned int nr_users;
+};
+
+static void snapshot__put(struct snapshot *self)
+{
+	if (__atomic_sub_fetch(&self->nr_users, 1, __ATOMIC_ACQ_REL) == 0) {
+		munmap(self->map, self->size);
+		free(self);
+	}
+}
+
+static bool snapshot__valid_string(const struct snapshot *self, strings_t s)
+{
+	return s < self->strings_size;
+}
+
+struct snapshot_load {
+	struct cu		   *cu;
+	struct snapshot		   *snapshot;
+	const uint8_t		   *pos;
+	const uint8_t		   *end;
+	const struct snapshot_decl *decls;
+	uint32_t		   nr_decls;
+	struct tag		   **tables[SNAPSHOT_TABLE__NR];
+	uint32_t		   nr_entries[SNAPSHOT_TABLE__NR];
+};
+
+static int snapshot_load__read(struct snapshot_load *self, void *data,
+			       size_t size)
+{
+	if ((size_t)(self->end - self->pos) < size)
+		return -EINVAL;
+
+	memcpy(data, self->pos, size);
+	self->pos += size;
+	return 0;
+}
+
+static void *obstack_zalloc(struct obstack *self, size_t size)
+{
+	void *o = obstack_alloc(self, size);
+
+	if (o)
+		memset(o, 0, size);
+	return o;
+}
+
+/* Allocated and initialized as the dwarf loader does */
+static struct tag *snapshot_load__new_tag(struct snapshot_load *self,
+					  uint16_t tag)
+{
+	struct obstack *obstack = &self->cu->obstack;
+
+	switch (tag) {
+	case DW_TAG_class_type:
+	case DW_TAG_interface_type:
+	case DW_TAG_structure_type:
+	case DW_TAG_union_type: {
+		struct class *class = obstack_zalloc(obstack, sizeof(*class));
+
+		if (class == NULL)
+			return NULL;
+		INIT_LIST_HEAD(&class->type.namespace.tags);
+		INIT_LIST_HEAD(&class->type.node);
+		INIT_LIST_HEAD(&class->vtable);
+		return class__tag(class);
+	}
+	case DW_TAG_enumeration_type:
+	case DW_TAG_typedef: {
+		struct type *type = obstack_zalloc(obstack, sizeof(*type));
+
+		if (type == NULL)
+			return NULL;
+		INIT_LIST_HEAD(&type->namespace.tags);
+		INIT_LIST_HEAD(&type->node);
+		return &type->namespace.tag;
+	}
+	case DW_TAG_namespace: {
+		struct namespace *space = obstack_zalloc(obstack,
+							 sizeof(*space));
+		if (space == NULL)
+			return NULL;
+		INIT_LIST_HEAD(&space->tags);
+		return &space->tag;
+	}
+	case DW_TAG_subprogram: {
+		struct function *function = obstack_zalloc(obstack,
+							   sizeof(*function));
+		if (function == NULL)
+			return NULL;
+		INIT_LIST_HEAD(&function->proto.parms);
+		INIT_LIST_HEAD(&function->lexblock.tags);
+		INIT_LIST_HEAD(&function->vtable_node);
+		INIT_LIST_HEAD(&function->tool_node);
+		return function__tag(function);
+	}
+	case DW_TAG_subroutine_type: {
+		struct ftype *ftype = obstack_zalloc(obstack, sizeof(*ftype));
+
+		if (ftype == NULL)
+			return NULL;
+		INIT_LIST_HEAD(&ftype->parms);
+		return &ftype->tag;
+	}
+	case DW_TAG_lexical_block: {
+		struct lexblock *block = obstack_zalloc(obstack,
+							sizeof(*block));
+		if (block == NULL)
+			return NULL;
+		INIT_LIST_HEAD(&block->tags);
+		return &block->ip.tag;
+	}
+	case DW_TAG_base_type:
+		return obstack_zalloc(obstack, sizeof(struct base_type));
+	case DW_TAG_array_type:
+		return obstack_zalloc(obstack, sizeof(struct array_type));
+	case DW_TAG_ptr_to_member_type:
+		return obstack_zalloc(obstack,
+				      sizeof(struct ptr_to_member_type));
+	case DW_TAG_inheritance:
+	case DW_TAG_member:
+		return obstack_zalloc(obstack, sizeof(struct class_member));
+	case DW_TAG_enumerator:
+		return obstack_zalloc(obstack, sizeof(struct enumerator));
+	case DW_TAG_formal_parameter:
+		return obstack_zalloc(obstack, sizeof(struct parameter));
+	case DW_TAG_variable:
+		return obstack_zalloc(obstack, sizeof(struct variable));
+	case DW_TAG_label:
+		return obstack_zalloc(obstack, sizeof(struct label));
+	case DW_TAG_inlined_subroutine:
+		return obstack_zalloc(obstack, sizeof(struct inline_expansion));
+	}
+
+	return obstack_zalloc(obstack, sizeof(struct tag));
+}
+
+#define snapshot_load__read_string(self, s, field)			\
+	(snapshot__valid_string((self)->snapshot, (s)) ?		\
+		((field) = (s), 0) : -EINVAL)
+
+static int snapshot_load__read_body(struct snapshot_load *self,
+				    struct tag *tag, uint16_t *nr_parms)
+{
+	int err;
+
+	*nr_parms = 0;
+
+	switch (tag->tag) {
+	case DW_TAG_base_type: {
+		struct base_type *bt = tag__base_type(tag);
+		struct snapshot_base_type body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err == 0)
+			err = snapshot_load__read_string(self, body.name,
+							 bt->name);
+		if (err != 0)
+			return err;
+		bt->bit_size   = body.bit_size;
+		bt->is_signed  = body.is_signed;
+		bt->is_bool    = body.is_bool;
+		bt->is_varargs = body.is_varargs;
+		bt->float_type = body.float_type;
+		return 0;
+	}
+	case DW_TAG_array_type: {
+		struct array_type *at = tag__array_type(tag);
+		struct snapshot_array_type body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err != 0)
+			return err;
+		at->dimensions = body.dimensions;
+		at->is_vector  = body.is_vector;
+		at->nr_entries = obstack_alloc(&self->cu->obstack,
+					       body.dimensions *
+					       sizeof(uint32_t));
+		if (at->nr_entries == NULL)
+			return -ENOMEM;
+		return snapshot_load__read(self, at->nr_entries,
+					   body.dimensions * sizeof(uint32_t));
+	}
+	case DW_TAG_ptr_to_member_type: {
+		struct snapshot_ptr_to_member_type body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err != 0)
+			return err;
+		tag__ptr_to_member_type(tag)->containing_type = body.containing_type;
+		return 0;
+	}
+	case DW_TAG_class_type:
+	case DW_TAG_enumeration_type:
+	case DW_TAG_interface_type:
+	case DW_TAG_namespace:
+	case DW_TAG_structure_type:
+	case DW_TAG_typedef:
+	case DW_TAG_union_type: {
+		struct snapshot_namespace body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err == 0)
+			err = snapshot_load__read_string(self, body.name,
+						tag__namespace(tag)->name);
+		if (err != 0)
+			return err;
+		if (tag->tag != DW_TAG_namespace) {
+			tag__type(tag)->size	    = body.size;
+			tag__type(tag)->declaration = body.declaration;
+		}
+		return 0;
+	}
+	case DW_TAG_inheritance:
+	case DW_TAG_member: {
+		struct class_member *member = tag__class_member(tag);
+		struct snapshot_class_member body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err == 0)
+			err = snapshot_load__read_string(self, body.name,
+							 member->name);
+		if (err != 0)
+			return err;
+		member->byte_size	= body.byte_size;
+		member->bit_offset	= body.bit_offset;
+		member->bit_size	= body.bit_size;
+		member->byte_offset	= body.byte_offset;
+		member->bitfield_offset = body.bitfield_offset;
+		member->bitfield_size	= body.bitfield_size;
+		member->accessibility	= body.accessibility;
+		member->virtuality	= body.virtuality;
+		return 0;
+	}
+	case DW_TAG_enumerator: {
+		struct enumerator *enumerator = (struct enumerator *)tag;
+		struct snapshot_enumerator body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err == 0)
+			err = snapshot_load__read_string(self, body.name,
+							 enumerator->name);
+		if (err != 0)
+			return err;
+		enumerator->value = body.value;
+		return 0;
+	}
+	case DW_TAG_subroutine_type: {
+		struct snapshot_ftype body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err != 0)
+			return err;
+		tag__ftype(tag)->unspec_parms = body.unspec_parms;
+		return 0;
+	}
+	case DW_TAG_formal_parameter: {
+		struct snapshot_parameter body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err != 0)
+			return err;
+		return snapshot_load__read_string(self, body.name,
+						  tag__parameter(tag)->name);
+	}
+	case DW_TAG_subprogram: {
+		struct function *function = tag__function(tag);
+		struct snapshot_function body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err == 0)
+			err = snapshot_load__read_string(self, body.name,
+							 function->name);
+		if (err == 0)
+			err = snapshot_load__read_string(self,
+							 body.linkage_name,
+							 function->linkage_name);
+		if (err != 0)
+			return err;
+		function->lexblock.ip.addr   = body.addr;
+		function->lexblock.size	     = body.size;
+		function->vtable_entry	     = body.vtable_entry;
+		function->inlined	     = body.inlined;
+		function->abstract_origin    = body.abstract_origin;
+		function->external	     = body.external;
+		function->accessibility	     = body.accessibility;
+		function->virtuality	     = body.virtuality;
+		function->proto.unspec_parms = body.unspec_parms;
+		*nr_parms = body.nr_parms;
+		return 0;
+	}
+	case DW_TAG_lexical_block: {
+		struct lexblock *block = tag__lexblock(tag);
+		struct snapshot_lexblock body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err != 0)
+			return err;
+		block->ip.addr = body.addr;
+		block->size    = body.size;
+		return 0;
+	}
+	case DW_TAG_variable: {
+		struct variable *var = tag__variable(tag);
+		struct snapshot_variable body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err == 0)
+			err = snapshot_load__read_string(self, body.name,
+							 var->name);
+		if (err != 0)
+			return err;
+		var->ip.addr	 = body.addr;
+		var->external	 = body.external;
+		var->declaration = body.declaration;
+		var->location	 = body.location;
+		return 0;
+	}
+	case DW_TAG_label: {
+		struct label *label = tag__label(tag);
+		struct snapshot_label body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err == 0)
+			err = snapshot_load__read_string(self, body.name,
+							 label->name);
+		if (err != 0)
+			return err;
+		label->ip.addr = body.addr;
+		return 0;
+	}
+	case DW_TAG_inlined_subroutine: {
+		struct inline_expansion *exp = tag__inline_expansion(tag);
+		struct snapshot_inline_expansion body;
+
+		err = snapshot_load__read(self, &body, sizeof(body));
+		if (err != 0)
+			return err;
+		exp->ip.addr = body.addr;
+		exp->high_pc = body.high_pc;
+		exp->size    = body.size;
+		return 0;
+	}
+	}
+
+	return 0;
+}
+
+static int lexblock__snapshot_add(struct lexblock *self, struct tag *child)
+{
+	switch (child->tag) {
+	case DW_TAG_lexical_block:
+		lexblock__add_lexblock(self, tag__lexblock(child));
+		break;
+	case DW_TAG_inlined_subroutine:
+		lexblock__add_inline_expansion(self,
+					       tag__inline_expansion(child));
+		break;
+	case DW_TAG_label:
+		lexblock__add_label(self, tag__label(child));
+		break;
+	case DW_TAG_variable:
+		lexblock__add_variable(self, tag__variable(child));
+		break;
+	default:
+		lexblock__add_tag(self, child);
+		break;
+	}
+	return 0;
+}
+
+/* Puts @child back in the list it was in, see tag__snapshot_for_each_child */
+static int snapshot_load__add_child(struct tag *self, struct tag *child,
+				    uint32_t nth, uint16_t nr_parms)
+{
+	switch (self->tag) {
+	case DW_TAG_enumeration_type:
+		if (child->tag != DW_TAG_enumerator)
+			return -EINVAL;
+		enumeration__add(tag__type(self), (struct enumerator *)child);
+		return 0;
+	case DW_TAG_class_type:
+	case DW_TAG_interface_type:
+	case DW_TAG_structure_type:
+	case DW_TAG_union_type:
+		if (child->tag == DW_TAG_member ||
+		    child->tag == DW_TAG_inheritance) {
+			type__add_member(tag__type(self),
+					 tag__class_member(child));
+			return 0;
+		}
+		namespace__add_tag(tag__namespace(self), child);
+		if (tag__is_function(child) &&
+		    tag__function(child)->vtable_entry != -1)
+			class__add_vtable_entry(tag__class(self),
+						tag__function(child));
+		return 0;
+	case DW_TAG_namespace:
+		namespace__add_tag(tag__namespace(self), child);
+		return 0;
+	case DW_TAG_subroutine_type:
+		if (child->tag != DW_TAG_formal_parameter)
+			return -EINVAL;
+		ftype__add_parameter(tag__ftype(self), tag__parameter(child));
+		return 0;
+	case DW_TAG_subprogram:
+		if (nth >= nr_parms)
+			return lexblock__snapshot_add(&tag__function(self)->lexblock,
+						      child);
+		if (child->tag != DW_TAG_formal_parameter)
+			return -EINVAL;
+		ftype__add_parameter(&tag__function(self)->proto,
+				     tag__parameter(child));
+		return 0;
+	case DW_TAG_lexical_block:
+		return lexblock__snapshot_add(tag__lexblock(self), child);
+	}
+
+	return -EINVAL;
+}
+
+static int snapshot_load__read_tag(struct snapshot_load *self, int depth,
+				   struct tag **ptag)
+{
+	struct snapshot_record record;
+	struct tag *tag;
+	uint16_t nr_parms;
+	uint32_t i;
+	int err;
+
+	if (depth > SNAPSHOT__MAX_DEPTH)
+		return -EINVAL;
+
+	err = snapshot_load__read(self, &record, sizeof(record));
+	if (err != 0)
+		return err;
+
+	tag = snapshot_load__new_tag(self, record.tag);
+	if (tag == NULL)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&tag->node);
+	tag->tag       = record.tag;
+	tag->type      = record.type;
+	tag->top_level = (record.flags & SNAPSHOT_RECORD__TOP_LEVEL) != 0;
+
+	err = snapshot_load__read_body(self, tag, &nr_parms);
+	if (err != 0)
+		return err;
+
+	if (record.table != SNAPSHOT_TABLE__NONE) {
+		/* cu__table_add_tag has to put it in the same table */
+		if (record.table != tag__snapshot_table(tag) ||
+		    record.id >= self->nr_entries[record.table] ||
+		    self->tables[record.table][record.id] != NULL)
+			return -EINVAL;
+		self->tables[record.table][record.id] = tag;
+	}
+
+	if (record.decl != SNAPSHOT__NO_DECL && self->cu->extra_dbg_info) {
+		if (record.decl >= self->nr_decls)
+			return -EINVAL;
+		err = tag__set_priv(tag, self->cu,
+				    (void *)&self->decls[record.decl]);
+		if (err != 0)
+			return err;
+	}
+
+	for (i = 0; i < record.nr_children; ++i) {
+		struct tag *child;
+
+		err = snapshot_load__read_tag(self, depth + 1, &child);
+		if (err != 0)
+			return err;
+
+		err = snapshot_load__add_child(tag, child, i, nr_parms);
+		if (err != 0)
+			return err;
+	}
+
+	*ptag = tag;
+	return 0;
+}
+
+/*
+ * Adds the tags to the cu tables in id order, so that they get the ids
+ * they had, with the types that were NULL in the saved cu nullified.
+ */
+static int snapshot_load__add_tables(struct snapshot_load *self)
+{
+	uint32_t table, id;
+
+	for (table = SNAPSHOT_TABLE__TYPES; table < SNAPSHOT_TABLE__NR; ++table) {
+		/* The void entry is added by cu__new */
+		for (id = table == SNAPSHOT_TABLE__TYPES ? 1 : 0;
+		     id < self->nr_entries[table]; ++id) {
+			struct tag *tag = self->tables[table][id];
+			long new_id = -1;
+
+			if (tag == NULL) {
+				if (table != SNAPSHOT_TABLE__TYPES)
+					return -EINVAL;
+				if (cu__table_nullify_type_entry(self->cu, id))
+					return -ENOMEM;
+				continue;
+			}
+
+			if (cu__table_add_tag(self->cu, tag, &new_id) != 0)
+				return -ENOMEM;
+			if (new_id != id)
+				return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int snapshot_load__cu(struct snapshot_load *self,
+			     const struct snapshot_cu *header)
+{
+	const uint32_t nr_entries = header->nr_types + header->nr_tags +
+				    header->nr_functions;
+	const uint32_t nr_records = header->nr_listed + header->nr_unlisted;
+	const uint32_t max_records = header->records_size /
+				     sizeof(struct snapshot_record);
+	struct tag **tables;
+	uint32_t i;
+	int err = -ENOMEM;
+
+	/*
+	 * Type ids are uint16_t and every tag in the other tables has a
+	 * record, so that bogus counts don't make us allocate huge tables.
+	 */
+	if (header->nr_types == 0 || header->nr_types > UINT16_MAX + 1 ||
+	    header->nr_tags > max_records ||
+	    header->nr_functions > max_records - header->nr_tags ||
+	    nr_records > max_records || nr_records < header->nr_listed)
+		return -EINVAL;
+
+	tables = calloc(nr_entries, sizeof(*tables));
+	if (tables == NULL)
+		return -ENOMEM;
+
+	self->tables[SNAPSHOT_TABLE__TYPES]	= tables;
+	self->tables[SNAPSHOT_TABLE__TAGS]	= tables + header->nr_types;
+	self->tables[SNAPSHOT_TABLE__FUNCTIONS] = tables + header->nr_types +
+						  header->nr_tags;
+	self->nr_entries[SNAPSHOT_TABLE__TYPES]	    = header->nr_types;
+	self->nr_entries[SNAPSHOT_TABLE__TAGS]	    = header->nr_tags;
+	self->nr_entries[SNAPSHOT_TABLE__FUNCTIONS] = header->nr_functions;
+
+	if (cu__reserve_tables(self->cu, header->nr_types, header->nr_tags,
+			       header->nr_functions) != 0)
+		goto out_free;
+
+	for (i = 0; i < nr_records; ++i) {
+		struct tag *tag;
+
+		err = snapshot_load__read_tag(self, 0, &tag);
+		if (err != 0)
+			goto out_free;
+
+		if (i < header->nr_listed)
+			list_add_tail(&tag->node, &self->cu->tags);
+	}
+
+	err = -EINVAL;
+	if (self->pos != self->end)
+		goto out_free;
+
+	err = snapshot_load__add_tables(self);
+out_free:
+	free(tables);
+	return err;
+}
+
+static const char *snapshot__strings_ptr(const struct cu *cu, strings_t s)
+{
+	const struct snapshot *snapshot = cu->priv;
+
+	return s != 0 ? snapshot->strings + s : NULL;
+}
+
+static const char *snapshot_tag__decl_file(const struct tag *self,
+					   const struct cu *cu)
+{
+	const struct snapshot_decl *decl = tag__priv(self, cu);
+
+	return decl != NULL ? snapshot__strings_ptr(cu, decl->decl_file) : NULL;
+}
+
+static uint32_t snapshot_tag__decl_line(const struct tag *self,
+					const struct cu *cu)
+{
+	const struct snapshot_decl *decl = tag__priv(self, cu);
+
+	return decl != NULL ? decl->decl_line : 0;
+}
+
+static unsigned long long snapshot_tag__orig_id(const struct tag *self,
+						const struct cu *cu)
+{
+	const struct snapshot_decl *decl = tag__priv(self, cu);
+
+	return decl != NULL ? decl->orig_id : 0;
+}
+
+static void snapshot__cu_delete(struct cu *self)
+{
+	snapshot__put(self->priv);
+	self->priv = NULL;
+}
+
+struct debug_fmt_ops snapshot__ops;
+
+/*
+ * Checks what is in @header, so that snapshot_load__cu only has to care
+ * about the records.
+ */
+static int snapshot__load_cu(struct snapshot *self, struct cus *cus,
+			     struct conf_load *conf,
+			     const struct snapshot_cu *header,
+			     const uint8_t *start)
+{
+	const uint64_t decls_offset = (sizeof(*header) +
+				       header->records_size + 7) & ~7ULL;
+	struct snapshot_load load = {
+		.snapshot = self,
+		.pos	  = start + sizeof(*header),
+		.end	  = start + sizeof(*header) + header->records_size,
+		.decls	  = (const void *)(start + decls_offset),
+		.nr_decls = header->nr_decls,
+	};
+	uint32_t i;
+	int err;
+
+	if (decls_offset > header->size ||
+	    (header->size - decls_offset) / sizeof(*load.decls) <
+							header->nr_decls ||
+	    !snapshot__valid_string(self, header->name) ||
+	    !snapshot__valid_string(self, header->filename) ||
+	    header->build_id_len > SNAPSHOT__BUILD_ID_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < header->nr_decls; ++i)
+		if (!snapshot__valid_string(self, load.decls[i].decl_file))
+			return -EINVAL;
+
+	load.cu = cu__new(self->strings + header->name, header->addr_size,
+			  header->build_id, header->build_id_len,
+			  self->strings + header->filename, cus->arena);
+	if (load.cu == NULL)
+		return -ENOMEM;
+
+	__atomic_add_fetch(&self->nr_users, 1, __ATOMIC_RELAXED);
+	load.cu->dfops		 = &snapshot__ops;
+	load.cu->priv		 = self;
+	load.cu->language	 = header->language;
+	load.cu->has_addr_info	 = (header->flags &
+				    SNAPSHOT_CU__HAS_ADDR_INFO) != 0;
+	load.cu->extra_dbg_info	 = conf && conf->extra_dbg_info &&
+				   header->nr_decls != 0;
+	load.cu->uses_global_strings = false;
+
+	err = snapshot_load__cu(&load, header);
+	if (err != 0) {
+		cu__delete(load.cu);
+		return err;
+	}
+	/* Without memory for it the functions are looked up later */
+	cu__sort_functions(load.cu);
+
+	if (conf && conf->steal) {
+		switch (conf->steal(load.cu, conf)) {
+		case LSK__STOP_LOADING:
+			return 1;
+		case LSK__STOLEN:
+			/*
+			 * The app stole this cu, possibly deleting it,
+			 * so forget about it:
+			 */
+			return 0;
+		case LSK__KEEPIT:
+			break;
+		}
+	}
+
+	cus__add(cus, load.cu);
+	return 0;
+}
+
+/**
+ * cus__load_snapshot - load the cus in a snapshot
+ * @self: where to add the cus
+ * @conf: load configuration, the decl info is only kept, as for the other
+ *	  loaders, if @conf->extra_dbg_info is set
+ * @filename: written by snapshot_writer__close or cus__save_snapshot
+ *
+ * Also reachable thru cus__load_file as the "snapshot" format.
+ *
+ * Returns 0 on success, -1 if @filename is not a snapshot for this kind of
+ * machine, so that the other loaders can be tried, a negative errno if it
+ * is one but can't be loaded.
+ */
+int cus__load_snapshot(struct cus *self, struct conf_load *conf,
+		       const char *filename)
+{
+	const struct snapshot_header *header;
+	struct snapshot *snapshot;
+	const uint8_t *pos, *end;
+	struct stat st;
+	uint32_t i;
+	int fd, err = -1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header))
+		goto out_close;
+
+	snapshot = zalloc(sizeof(*snapshot));
+	if (snapshot == NULL) {
+		err = -ENOMEM;
+		goto out_close;
+	}
+
+	snapshot->size = st.st_size;
+	snapshot->map  = mmap(NULL, snapshot->size, PROT_READ, MAP_PRIVATE,
+			      fd, 0);
+	if (snapshot->map == MAP_FAILED) {
+		free(snapshot);
+		goto out_close;
+	}
+
+	/* Ours till all the cus are loaded */
+	snapshot->nr_users = 1;
+
+	header = snapshot->map;
+	if (memcmp(header->magic, SNAPSHOT__MAGIC, sizeof(header->magic)) != 0 ||
+	    header->byte_order != SNAPSHOT__BYTE_ORDER)
+		goto out_put;
+
+	err = -EINVAL;
+	if (header->version != SNAPSHOT__VERSION ||
+	    header->strings_size == 0 ||
+	    /* The cu records are between the header and the strings */
+	    header->strings_offset < sizeof(*header) ||
+	    (header->strings_offset & 7) != 0 ||
+	    header->strings_offset > snapshot->size ||
+	    snapshot->size - header->strings_offset < header->strings_size)
+		goto out_put;
+
+	snapshot->strings      = (const char *)snapshot->map +
+				 header->strings_offset;
+	snapshot->strings_size = header->strings_size;
+	/* So that any offset in the table is a valid string */
+	if (snapshot->strings[snapshot->strings_size - 1] != '\0')
+		goto out_put;
+
+	pos = (const uint8_t *)(header + 1);
+	end = (const uint8_t *)snapshot->strings;
+	for (i = 0; i < header->nr_cus; ++i) {
+		struct snapshot_cu cu_header;
+
+		err = -EINVAL;
+		if ((size_t)(end - pos) < sizeof(cu_header))
+			goto out_put;
+
+		memcpy(&cu_header, pos, sizeof(cu_header));
+		if (cu_header.size < sizeof(cu_header) ||
+		    (cu_header.size & 7) != 0 ||
+		    cu_header.size > (size_t)(end - pos) ||
+		    cu_header.records_size > cu_header.size - sizeof(cu_header))
+			goto out_put;
+
+		err = snapshot__load_cu(snapshot, self, conf, &cu_header, pos);
+		if (err < 0)
+			goto out_put;
+		if (err > 0)
+			break;
+
+		pos += cu_header.size;
+	}
+
+	err = 0;
+out_put:
+	snapshot__put(snapshot);
+out_close:
+	close(fd);
+	return err;
+}
+
+struct debug_fmt_ops snapshot__ops = {
+	.name		= "snapshot",
+	.load_file	= cus__load_snapshot,
+	.strings__ptr	= snapshot__strings_ptr,
+	.tag__decl_file	= snapshot_tag__decl_file,
+	.tag__decl_line	= snapshot_tag__decl_line,
+	.tag__orig_id	= snapshot_tag__orig_id,
+	.cu__delete	= snapshot__cu_delete,
+};
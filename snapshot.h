@@ -0,0 +1,23 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_ 1
+/*
+  Copyright (C) 2026 agent <agent@local>
+
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of version 2 of the GNU General Public License as
+  published by the Free Software Foundation.
+*/
+
+#include "dwarves.h"
+
+struct snapshot_writer;
+
+struct snapshot_writer *snapshot_writer__new(const char *filename);
+int snapshot_writer__add_cu(struct snapshot_writer *self, struct cu *cu);
+int snapshot_writer__close(struct snapshot_writer *self);
+
+int cus__save_snapshot(struct cus *self, const char *filename);
+int cus__load_snapshot(struct cus *self, struct conf_load *conf,
+		       const char *filename);
+
+#endif /* _SNAPSHOT_H_ */
@@ -25,6 +25,7 @@ struct strings *strings__new(void)
 	if (self != NULL) {
 		self->tree = NULL;
 		gobuffer__init(&self->gb);
+		gobuffer__use_mmap(&self->gb);
 	}
 
 	return self;
@@ -46,6 +46,27 @@ static inline strings_t strings__size(const struct strings *self)
 	return gobuffer__size(&self->gb);
 }
 
+/**
+ * strings__reserve - size hint for the strings table
+ * @self: the strings table
+ * @size: bytes expected to be needed in total
+ */
+static inline int strings__reserve(struct strings *self, unsigned int size)
+{
+	return gobuffer__reserve(&self->gb, size);
+}
+
+/**
+ * strings__share - let other threads use strings__ptr while strings are added
+ * @self: the strings table
+ *
+ * See gobuffer__share.
+ */
+static inline void strings__share(struct strings *self)
+{
+	gobuffer__share(&self->gb);
+}
+
 static inline const char *strings__compress(struct strings *self,
 					    unsigned int *size)
 {